@@ -5,6 +5,31 @@
 #include <map>
 #include <set>
 #include <algorithm>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <unordered_map>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <elf.h>
+#endif
 
 using namespace std;
 
@@ -25,6 +50,63 @@ struct Token {
     TokenType type;
     string value;
     int line;
+    size_t offset;
+};
+
+// A comment skipped by the lexer: byte range [begin, end) of the source and
+// the line it starts on.
+struct Trivia {
+    size_t begin, end;
+    int line;
+};
+
+enum NodeKind {
+    NODE_NUM, NODE_VAR, NODE_CALL, NODE_UNARY, NODE_BINARY,
+    NODE_DECL, NODE_ASSIGN, NODE_EXPR, NODE_IF, NODE_WHILE,
+    NODE_BREAK, NODE_CONTINUE, NODE_RETURN, NODE_BLOCK, NODE_EMPTY
+};
+
+// AST node. Expressions keep their operator in op and operands in kids;
+// NODE_DECL holds one NODE_VAR per declarator, each with its optional
+// initializer as only kid. slot (variables) and callee (calls) are filled in
+// by the Resolver.
+struct Node {
+    NodeKind kind;
+    TokenType op;
+    int line;
+    int value;
+    string name;
+    vector<Node*> kids;
+    int slot;
+    int callee;
+};
+
+struct FuncDef {
+    string name;
+    bool returnsInt;
+    vector<string> params;
+    int line;
+    Node* body;
+    int frameSize;
+};
+
+// A parsed compilation unit. Nodes are owned by the program and live as long
+// as it does.
+struct Program {
+    vector<FuncDef> funcs;
+    vector<unique_ptr<Node> > nodes;
+
+    Node* newNode(NodeKind kind, int line) {
+        Node* n = new Node();
+        n->kind = kind;
+        n->op = TOK_EOF;
+        n->line = line;
+        n->value = 0;
+        n->slot = -1;
+        n->callee = -1;
+        nodes.push_back(unique_ptr<Node>(n));
+        return n;
+    }
 };
 
 class Lexer {
@@ -32,6 +114,7 @@ private:
     string input;
     size_t pos;
     int line;
+    vector<Trivia>* trivia;
     map<int, string> errors;
 
     char peek(int offset = 0) {
@@ -54,15 +137,20 @@ private:
 
     bool skipComment() {
         if (peek() == '/' && peek(1) == '/') {
+            size_t start = pos;
+            int startLine = line;
             while (peek() != '\n' && peek() != '\0') advance();
+            if (trivia) trivia->push_back(Trivia{start, pos, startLine});
             return true;
         }
         if (peek() == '/' && peek(1) == '*') {
+            size_t start = pos;
             int startLine = line;
             advance(); advance();
             while (true) {
                 if (peek() == '\0') {
                     errors[startLine] = "Unterminated comment";
+                    if (trivia) trivia->push_back(Trivia{start, pos, startLine});
                     return false;
                 }
                 if (peek() == '*' && peek(1) == '/') {
@@ -71,13 +159,17 @@ private:
                 }
                 advance();
             }
+            if (trivia) trivia->push_back(Trivia{start, pos, startLine});
             return true;
         }
         return false;
     }
 
 public:
-    Lexer(const string& src) : input(src), pos(0), line(1) {}
+    // With a trivia table, every skipped comment is recorded there as it is
+    // passed; the token stream itself is the same either way.
+    Lexer(const string& src, vector<Trivia>* commentTable = nullptr)
+        : input(src), pos(0), line(1), trivia(commentTable) {}
 
     map<int, string> getErrors() { return errors; }
 
@@ -89,6 +181,7 @@ public:
 
         Token tok;
         tok.line = line;
+        tok.offset = pos;
 
         if (peek() == '\0') {
             tok.type = TOK_EOF;
@@ -198,26 +291,177 @@ public:
     }
 };
 
-class Parser {
+// Parser policies. The parser reports every construct it recognizes to a
+// builder chosen at compile time: NullBuilder turns all of it into no-ops for
+// the plain syntax check, AstBuilder assembles the tree.
+struct NullBuilder {
+    typedef int Ref;
+    // Tokens passed in are never read, so the parser may stream them.
+    static const bool keepsTokens = false;
+
+    Ref none() { return 0; }
+    Ref number(const Token&) { return 0; }
+    Ref variable(const Token&) { return 0; }
+    Ref call(const Token&) { return 0; }
+    void addArg(Ref, Ref) {}
+    Ref unary(const Token&, Ref) { return 0; }
+    Ref binary(const Token&, Ref, Ref) { return 0; }
+    Ref declaration(int) { return 0; }
+    void addDeclarator(Ref, const Token&, Ref) {}
+    Ref assign(const Token&, Ref) { return 0; }
+    Ref exprStmt(Ref, int) { return 0; }
+    Ref ifStmt(int, Ref, Ref, Ref) { return 0; }
+    Ref whileStmt(int, Ref, Ref) { return 0; }
+    Ref jump(const Token&) { return 0; }
+    Ref returnStmt(int, Ref) { return 0; }
+    Ref block(int) { return 0; }
+    void addStmt(Ref, Ref) {}
+    Ref empty(int) { return 0; }
+    void beginFunc(const Token&, bool) {}
+    void addParam(const Token&) {}
+    void endFunc(Ref) {}
+};
+
+class AstBuilder {
+public:
+    typedef Node* Ref;
+    static const bool keepsTokens = true;
+
+    Program program;
+
+    Ref none() { return nullptr; }
+
+    Ref number(const Token& tok) {
+        Node* n = program.newNode(NODE_NUM, tok.line);
+        n->value = (int)(unsigned)strtoull(tok.value.c_str(), nullptr, 10);
+        return n;
+    }
+
+    Ref variable(const Token& tok) {
+        Node* n = program.newNode(NODE_VAR, tok.line);
+        n->name = tok.value;
+        return n;
+    }
+
+    Ref call(const Token& tok) {
+        Node* n = program.newNode(NODE_CALL, tok.line);
+        n->name = tok.value;
+        return n;
+    }
+
+    void addArg(Ref call, Ref arg) { call->kids.push_back(arg); }
+
+    Ref unary(const Token& op, Ref operand) {
+        Node* n = program.newNode(NODE_UNARY, op.line);
+        n->op = op.type;
+        n->kids.push_back(operand);
+        return n;
+    }
+
+    Ref binary(const Token& op, Ref lhs, Ref rhs) {
+        Node* n = program.newNode(NODE_BINARY, op.line);
+        n->op = op.type;
+        n->kids.push_back(lhs);
+        n->kids.push_back(rhs);
+        return n;
+    }
+
+    Ref declaration(int line) { return program.newNode(NODE_DECL, line); }
+
+    void addDeclarator(Ref decl, const Token& name, Ref init) {
+        Node* var = variable(name);
+        if (init) var->kids.push_back(init);
+        decl->kids.push_back(var);
+    }
+
+    Ref assign(const Token& name, Ref value) {
+        Node* n = program.newNode(NODE_ASSIGN, name.line);
+        n->name = name.value;
+        n->kids.push_back(value);
+        return n;
+    }
+
+    Ref exprStmt(Ref expr, int line) {
+        Node* n = program.newNode(NODE_EXPR, line);
+        n->kids.push_back(expr);
+        return n;
+    }
+
+    Ref ifStmt(int line, Ref cond, Ref then, Ref els) {
+        Node* n = program.newNode(NODE_IF, line);
+        n->kids.push_back(cond);
+        n->kids.push_back(then);
+        if (els) n->kids.push_back(els);
+        return n;
+    }
+
+    Ref whileStmt(int line, Ref cond, Ref body) {
+        Node* n = program.newNode(NODE_WHILE, line);
+        n->kids.push_back(cond);
+        n->kids.push_back(body);
+        return n;
+    }
+
+    Ref jump(const Token& tok) {
+        return program.newNode(tok.type == TOK_BREAK ? NODE_BREAK : NODE_CONTINUE, tok.line);
+    }
+
+    Ref returnStmt(int line, Ref value) {
+        Node* n = program.newNode(NODE_RETURN, line);
+        if (value) n->kids.push_back(value);
+        return n;
+    }
+
+    Ref block(int line) { return program.newNode(NODE_BLOCK, line); }
+
+    void addStmt(Ref block, Ref stmt) { block->kids.push_back(stmt); }
+
+    Ref empty(int line) { return program.newNode(NODE_EMPTY, line); }
+
+    void beginFunc(const Token& name, bool returnsInt) {
+        FuncDef f;
+        f.name = name.value;
+        f.returnsInt = returnsInt;
+        f.line = name.line;
+        f.body = nullptr;
+        f.frameSize = 0;
+        program.funcs.push_back(f);
+    }
+
+    void addParam(const Token& name) { program.funcs.back().params.push_back(name.value); }
+
+    void endFunc(Ref body) { program.funcs.back().body = body; }
+};
+
+template <class Builder>
+class BasicParser {
 private:
+    typedef typename Builder::Ref Ref;
+
     vector<Token> tokens;
     size_t pos;
+    Lexer* lexer;
     map<int, string> errors;
     int loopDepth;
     bool hasError;
+    Builder& builder;
 
-    Token current() {
+    const Token& current() {
         if (pos >= tokens.size()) return tokens.back();
         return tokens[pos];
     }
 
-    Token peek(int offset = 0) {
+    const Token& peek(int offset = 0) {
         if (pos + offset >= tokens.size()) return tokens.back();
         return tokens[pos + offset];
     }
 
     void advance() {
-        if (pos < tokens.size()) pos++;
+        if (lexer) {
+            if (tokens[0].type != TOK_EOF) tokens[0] = lexer->nextToken();
+        } else if (pos < tokens.size()) {
+            pos++;
+        }
     }
 
     void error(const string& msg) {
@@ -261,13 +505,16 @@ private:
             if (match(TOK_RBRACE)) advance();
             return;
         }
+        bool returnsInt = match(TOK_INT);
         advance();
 
+        const Token& name = current();
         if (!consume(TOK_ID, "Expected function name")) {
             sync();
             if (match(TOK_RBRACE)) advance();
             return;
         }
+        builder.beginFunc(name, returnsInt);
 
         consume(TOK_LPAREN, "Lack of '('");
 
@@ -280,193 +527,237 @@ private:
         }
 
         consume(TOK_RPAREN, "Lack of ')'");
-        parseBlock();
+        builder.endFunc(parseBlock());
     }
 
     void parseParam() {
         consume(TOK_INT, "Expected int");
-        consume(TOK_ID, "Expected identifier");
+        const Token& name = current();
+        if (consume(TOK_ID, "Expected identifier")) {
+            builder.addParam(name);
+        }
     }
 
-    void parseBlock() {
+    Ref parseBlock() {
+        Ref block = builder.block(current().line);
         if (!consume(TOK_LBRACE, "Lack of '{'")) {
-            return;
+            return block;
         }
 
         while (!match(TOK_RBRACE) && !match(TOK_EOF)) {
-            parseStmt();
+            builder.addStmt(block, parseStmt());
         }
 
         consume(TOK_RBRACE, "Lack of '}'");
+        return block;
     }
 
-    void parseStmt() {
-        if (match(TOK_INT)) {
+    void parseDeclarator(Ref decl) {
+        const Token& name = current();
+        bool named = consume(TOK_ID, "Expected identifier");
+        Ref init = builder.none();
+        if (match(TOK_ASSIGN)) {
             advance();
-            consume(TOK_ID, "Expected identifier");
-            if (match(TOK_ASSIGN)) {
+            init = parseExpr();
+        }
+        if (named) builder.addDeclarator(decl, name, init);
+    }
+
+    Ref parseCall(const Token& name) {
+        Ref call = builder.call(name);
+        advance();
+        if (!match(TOK_RPAREN)) {
+            builder.addArg(call, parseExpr());
+            while (match(TOK_COMMA)) {
                 advance();
-                parseExpr();
+                builder.addArg(call, parseExpr());
             }
+        }
+        consume(TOK_RPAREN, "Lack of ')'");
+        return call;
+    }
+
+    Ref parseStmt() {
+        int line = current().line;
+        if (match(TOK_INT)) {
+            Ref decl = builder.declaration(line);
+            advance();
+            parseDeclarator(decl);
             // 循环解析后续用逗号分隔的变量
             while (match(TOK_COMMA)) {
                 advance(); // 消耗逗号
-                consume(TOK_ID, "Expected identifier");
-                if (match(TOK_ASSIGN)) {
-                    advance();
-                    parseExpr();
-                }
+                parseDeclarator(decl);
             }
             consume(TOK_SEMICOLON, "Lack of ';'");
+            return decl;
         } else if (match(TOK_IF)) {
             advance();
             consume(TOK_LPAREN, "Lack of '('");
-            parseExpr();
+            Ref cond = parseExpr();
             consume(TOK_RPAREN, "Lack of ')'");
-            parseStmt();
+            Ref then = parseStmt();
+            Ref els = builder.none();
             if (match(TOK_ELSE)) {
                 advance();
-                parseStmt();
+                els = parseStmt();
             }
+            return builder.ifStmt(line, cond, then, els);
         } else if (match(TOK_WHILE)) {
             advance();
             consume(TOK_LPAREN, "Lack of '('");
-            parseExpr();
+            Ref cond = parseExpr();
             consume(TOK_RPAREN, "Lack of ')'");
             loopDepth++;
-            parseStmt();
+            Ref body = parseStmt();
             loopDepth--;
-        } else if (match(TOK_BREAK)) {
-            advance();
-            consume(TOK_SEMICOLON, "Lack of ';'");
-        } else if (match(TOK_CONTINUE)) {
+            return builder.whileStmt(line, cond, body);
+        } else if (match(TOK_BREAK) || match(TOK_CONTINUE)) {
+            Ref jump = builder.jump(current());
             advance();
             consume(TOK_SEMICOLON, "Lack of ';'");
+            return jump;
         } else if (match(TOK_RETURN)) {
             advance();
+            Ref value = builder.none();
             if (!match(TOK_SEMICOLON)) {
-                parseExpr();
+                value = parseExpr();
             }
             consume(TOK_SEMICOLON, "Lack of ';'");
+            return builder.returnStmt(line, value);
         } else if (match(TOK_LBRACE)) {
-            parseBlock();
+            return parseBlock();
         } else if (match(TOK_ID)) {
+            const Token& name = current();
             advance();
             if (match(TOK_ASSIGN)) {
                 advance();
-                parseExpr();
+                Ref value = parseExpr();
                 consume(TOK_SEMICOLON, "Lack of ';'");
+                return builder.assign(name, value);
             } else if (match(TOK_LPAREN)) {
-                advance();
-                if (!match(TOK_RPAREN)) {
-                    parseExpr();
-                    while (match(TOK_COMMA)) {
-                        advance();
-                        parseExpr();
-                    }
-                }
-                consume(TOK_RPAREN, "Lack of ')'");
+                Ref call = parseCall(name);
                 consume(TOK_SEMICOLON, "Lack of ';'");
+                return builder.exprStmt(call, line);
             } else {
                 consume(TOK_SEMICOLON, "Lack of ';'");
+                return builder.exprStmt(builder.variable(name), line);
             }
         } else if (match(TOK_SEMICOLON)) {
             advance();
+            return builder.empty(line);
         } else {
             error("Unexpected token");
             advance();
+            return builder.empty(line);
         }
     }
 
-    void parseExpr() {
-        parseLOrExpr();
+    Ref parseExpr() {
+        return parseLOrExpr();
     }
 
     // LOrExpr → LAndExpr ("||" LAndExpr)*
-    void parseLOrExpr() {
-        parseLAndExpr();
+    Ref parseLOrExpr() {
+        Ref lhs = parseLAndExpr();
         while (match(TOK_OR)) {
+            const Token& op = current();
             advance();
-            parseLAndExpr();
+            lhs = builder.binary(op, lhs, parseLAndExpr());
         }
+        return lhs;
     }
 
     // LAndExpr → RelExpr ("&&" RelExpr)*
-    void parseLAndExpr() {
-        parseRelExpr();
+    Ref parseLAndExpr() {
+        Ref lhs = parseRelExpr();
         while (match(TOK_AND)) {
+            const Token& op = current();
             advance();
-            parseRelExpr();
+            lhs = builder.binary(op, lhs, parseRelExpr());
         }
+        return lhs;
     }
 
     // RelExpr → AddExpr (("<" | ">" | ...) AddExpr)*
-    void parseRelExpr() {
-        parseAddExpr();
+    Ref parseRelExpr() {
+        Ref lhs = parseAddExpr();
         while (match(TOK_LT) || match(TOK_LE) || match(TOK_GT) || 
                match(TOK_GE) || match(TOK_EQ) || match(TOK_NE)) {
+            const Token& op = current();
             advance();
-            parseAddExpr();
+            lhs = builder.binary(op, lhs, parseAddExpr());
         }
+        return lhs;
     }
 
     // AddExpr → MulExpr (("+" | "-") MulExpr)*
-    void parseAddExpr() {
-        parseMulExpr();
+    Ref parseAddExpr() {
+        Ref lhs = parseMulExpr();
         while (match(TOK_PLUS) || match(TOK_MINUS)) {
+            const Token& op = current();
             advance();
-            parseMulExpr();
+            lhs = builder.binary(op, lhs, parseMulExpr());
         }
+        return lhs;
     }
 
     // MulExpr → UnaryExpr (("*" | "/" | "%") UnaryExpr)*
-    void parseMulExpr() {
-        parseUnaryExpr();
+    Ref parseMulExpr() {
+        Ref lhs = parseUnaryExpr();
         while (match(TOK_STAR) || match(TOK_DIV) || match(TOK_MOD)) {
+            const Token& op = current();
             advance();
-            parseUnaryExpr();
+            lhs = builder.binary(op, lhs, parseUnaryExpr());
         }
+        return lhs;
     }
 
-    void parseUnaryExpr() {
+    Ref parseUnaryExpr() {
         if (match(TOK_PLUS) || match(TOK_MINUS) || match(TOK_NOT)) {
+            const Token& op = current();
             advance();
-            parseUnaryExpr();
+            return builder.unary(op, parseUnaryExpr());
         } else {
-            parsePrimaryExpr();
+            return parsePrimaryExpr();
         }
     }
 
-    void parsePrimaryExpr() {
+    Ref parsePrimaryExpr() {
         if (match(TOK_ID)) {
+            const Token& name = current();
             advance();
             if (match(TOK_LPAREN)) {
-                advance();
-                if (!match(TOK_RPAREN)) {
-                    parseExpr();
-                    while (match(TOK_COMMA)) {
-                        advance();
-                        parseExpr();
-                    }
-                }
-                consume(TOK_RPAREN, "Lack of ')'");
+                return parseCall(name);
             }
+            return builder.variable(name);
         } else if (match(TOK_NUMBER)) {
+            Ref num = builder.number(current());
             advance();
+            return num;
         } else if (match(TOK_LPAREN)) {
             advance();
-            parseExpr();
+            Ref inner = parseExpr();
             consume(TOK_RPAREN, "Lack of ')'");
+            return inner;
         } else {
             error("Expected expression");
             if (!match(TOK_EOF) && !match(TOK_SEMICOLON)) {
                 advance();
             }
+            return builder.none();
         }
     }
 
 public:
-    Parser(const vector<Token>& toks) : tokens(toks), pos(0), loopDepth(0), hasError(false) {}
+    BasicParser(const vector<Token>& toks, Builder& b)
+        : tokens(toks), pos(0), lexer(nullptr), loopDepth(0), hasError(false), builder(b) {}
+
+    // Streaming parse straight off the lexer, holding one token at a time.
+    // Only for builders that never look at a token after the next advance.
+    BasicParser(Lexer& l, Builder& b)
+        : tokens(1, l.nextToken()), pos(0), lexer(&l), loopDepth(0), hasError(false), builder(b) {
+        static_assert(!Builder::keepsTokens, "streaming parse needs a builder that drops tokens");
+    }
 
     bool parse() {
         parseCompUnit();
@@ -476,31 +767,7420 @@ public:
     map<int, string> getErrors() { return errors; }
 };
 
-int main() {
-    string input, line;
-    while (getline(cin, line)) {
-        input += line + "\n";
-    }
+typedef BasicParser<NullBuilder> Parser;
+typedef BasicParser<AstBuilder> AstParser;
 
-    Lexer lexer(input);
+vector<Token> tokenize(Lexer& lexer) {
     vector<Token> tokens;
-    
     while (true) {
         Token tok = lexer.nextToken();
         tokens.push_back(tok);
         if (tok.type == TOK_EOF) break;
     }
+    return tokens;
+}
 
-    auto lexErrors = lexer.getErrors();
+// Lex and parse one source text, returning its diagnostics keyed by line.
+template <class Builder>
+map<int, string> checkSource(const string& input, Builder& builder) {
+    Lexer lexer(input);
+    vector<Token> tokens = tokenize(lexer);
 
-    Parser parser(tokens);
-    bool success = parser.parse();
-    auto parseErrors = parser.getErrors();
+    map<int, string> allErrors = lexer.getErrors();
 
-    map<int, string> allErrors = lexErrors;
-    for (const auto& e : parseErrors) {
+    BasicParser<Builder> parser(tokens, builder);
+    parser.parse();
+    for (const auto& e : parser.getErrors()) {
         allErrors[e.first] = e.second;
     }
+    return allErrors;
+}
+
+void collectCalls(const Node* n, set<string>& callees) {
+    if (!n) return;
+    if (n->kind == NODE_CALL) callees.insert(n->name);
+    for (const Node* kid : n->kids) collectCalls(kid, callees);
+}
+
+// Whole-program tree shaking: keep only the functions reachable from main
+// through their call sites. Without a main every function is a potential
+// entry point and nothing is dropped.
+void shakeDeadFunctions(Program& prog, vector<string>* dropped) {
+    map<string, vector<int> > byName;
+    for (size_t i = 0; i < prog.funcs.size(); i++) {
+        byName[prog.funcs[i].name].push_back((int)i);
+    }
+    if (byName.find("main") == byName.end()) return;
+
+    vector<bool> live(prog.funcs.size(), false);
+    vector<int> work = byName["main"];
+    for (int f : work) live[f] = true;
+    while (!work.empty()) {
+        int f = work.back();
+        work.pop_back();
+        set<string> callees;
+        collectCalls(prog.funcs[f].body, callees);
+        for (const auto& callee : callees) {
+            auto it = byName.find(callee);
+            if (it == byName.end()) continue;
+            for (int g : it->second) {
+                if (!live[g]) {
+                    live[g] = true;
+                    work.push_back(g);
+                }
+            }
+        }
+    }
+
+    vector<FuncDef> kept;
+    for (size_t i = 0; i < prog.funcs.size(); i++) {
+        if (live[i]) {
+            kept.push_back(prog.funcs[i]);
+        } else if (dropped) {
+            dropped->push_back(prog.funcs[i].name);
+        }
+    }
+    prog.funcs.swap(kept);
+}
+
+string tokenText(TokenType type) {
+    switch (type) {
+        case TOK_PLUS: return "+";
+        case TOK_MINUS: return "-";
+        case TOK_STAR: return "*";
+        case TOK_DIV: return "/";
+        case TOK_MOD: return "%";
+        case TOK_LT: return "<";
+        case TOK_LE: return "<=";
+        case TOK_GT: return ">";
+        case TOK_GE: return ">=";
+        case TOK_EQ: return "==";
+        case TOK_NE: return "!=";
+        case TOK_AND: return "&&";
+        case TOK_OR: return "||";
+        case TOK_NOT: return "!";
+        case TOK_ASSIGN: return "=";
+        case TOK_LPAREN: return "(";
+        case TOK_RPAREN: return ")";
+        case TOK_LBRACE: return "{";
+        case TOK_RBRACE: return "}";
+        case TOK_SEMICOLON: return ";";
+        case TOK_COMMA: return ",";
+        default: return "";
+    }
+}
+
+TokenType negateComparison(TokenType op) {
+    switch (op) {
+        case TOK_LT: return TOK_GE;
+        case TOK_LE: return TOK_GT;
+        case TOK_GT: return TOK_LE;
+        case TOK_GE: return TOK_LT;
+        case TOK_EQ: return TOK_NE;
+        default: return TOK_EQ;
+    }
+}
+
+TokenType swapComparison(TokenType op) {
+    switch (op) {
+        case TOK_LT: return TOK_GT;
+        case TOK_LE: return TOK_GE;
+        case TOK_GT: return TOK_LT;
+        case TOK_GE: return TOK_LE;
+        default: return op;
+    }
+}
+
+int precedence(const Node* n) {
+    if (n->kind == NODE_UNARY) return 6;
+    if (n->kind != NODE_BINARY) return 7;
+    switch (n->op) {
+        case TOK_OR: return 1;
+        case TOK_AND: return 2;
+        case TOK_PLUS: case TOK_MINUS: return 4;
+        case TOK_STAR: case TOK_DIV: case TOK_MOD: return 5;
+        default: return 3;
+    }
+}
+
+void printExpr(ostream& out, const Node* n, int minPrec = 0) {
+    bool paren = precedence(n) < minPrec;
+    if (paren) out << "(";
+    switch (n->kind) {
+        case NODE_NUM: out << n->value; break;
+        case NODE_VAR: out << n->name; break;
+        case NODE_CALL:
+            out << n->name << "(";
+            for (size_t i = 0; i < n->kids.size(); i++) {
+                if (i) out << ", ";
+                printExpr(out, n->kids[i]);
+            }
+            out << ")";
+            break;
+        case NODE_UNARY:
+            out << tokenText(n->op);
+            printExpr(out, n->kids[0], 6);
+            break;
+        case NODE_BINARY:
+            printExpr(out, n->kids[0], precedence(n));
+            out << " " << tokenText(n->op) << " ";
+            printExpr(out, n->kids[1], precedence(n) + 1);
+            break;
+        default: break;
+    }
+    if (paren) out << ")";
+}
+
+void printStmt(ostream& out, const Node* n, int indent) {
+    string pad(indent * 4, ' ');
+    switch (n->kind) {
+        case NODE_DECL:
+            out << pad << "int ";
+            for (size_t i = 0; i < n->kids.size(); i++) {
+                const Node* var = n->kids[i];
+                if (i) out << ", ";
+                out << var->name;
+                if (!var->kids.empty()) {
+                    out << " = ";
+                    printExpr(out, var->kids[0]);
+                }
+            }
+            out << ";\n";
+            break;
+        case NODE_ASSIGN:
+            out << pad << n->name << " = ";
+            printExpr(out, n->kids[0]);
+            out << ";\n";
+            break;
+        case NODE_EXPR:
+            out << pad;
+            printExpr(out, n->kids[0]);
+            out << ";\n";
+            break;
+        case NODE_IF:
+            out << pad << "if (";
+            printExpr(out, n->kids[0]);
+            out << ")\n";
+            printStmt(out, n->kids[1], n->kids[1]->kind == NODE_BLOCK ? indent : indent + 1);
+            if (n->kids.size() > 2) {
+                out << pad << "else\n";
+                printStmt(out, n->kids[2], n->kids[2]->kind == NODE_BLOCK ? indent : indent + 1);
+            }
+            break;
+        case NODE_WHILE:
+            out << pad << "while (";
+            printExpr(out, n->kids[0]);
+            out << ")\n";
+            printStmt(out, n->kids[1], n->kids[1]->kind == NODE_BLOCK ? indent : indent + 1);
+            break;
+        case NODE_BREAK: out << pad << "break;\n"; break;
+        case NODE_CONTINUE: out << pad << "continue;\n"; break;
+        case NODE_RETURN:
+            out << pad << "return";
+            if (!n->kids.empty()) {
+                out << " ";
+                printExpr(out, n->kids[0]);
+            }
+            out << ";\n";
+            break;
+        case NODE_BLOCK:
+            out << pad << "{\n";
+            for (const Node* kid : n->kids) printStmt(out, kid, indent + 1);
+            out << pad << "}\n";
+            break;
+        default:
+            out << pad << ";\n";
+            break;
+    }
+}
+
+void printProgram(ostream& out, const Program& prog) {
+    for (size_t i = 0; i < prog.funcs.size(); i++) {
+        const FuncDef& f = prog.funcs[i];
+        if (i) out << "\n";
+        out << (f.returnsInt ? "int " : "void ") << f.name << "(";
+        for (size_t j = 0; j < f.params.size(); j++) {
+            if (j) out << ", ";
+            out << "int " << f.params[j];
+        }
+        out << ")\n";
+        printStmt(out, f.body, 0);
+    }
+}
+
+// Cross-file view of one compilation unit: what it defines and what it calls.
+struct FuncSig {
+    string name;
+    int arity;
+    bool returnsInt;
+    int line;
+};
+
+struct CallRef {
+    string name;
+    int arity;
+    int line;
+};
+
+struct UnitSummary {
+    vector<FuncSig> defs;
+    vector<CallRef> calls;
+};
+
+struct SourceUnit {
+    string path;
+    bool readable;
+    uint64_t hash;
+    vector<pair<int, string> > diags;
+    UnitSummary summary;
+};
+
+void collectCallRefs(const Node* n, vector<CallRef>& calls) {
+    if (!n) return;
+    if (n->kind == NODE_CALL) {
+        CallRef ref;
+        ref.name = n->name;
+        ref.arity = (int)n->kids.size();
+        ref.line = n->line;
+        calls.push_back(ref);
+    }
+    for (const Node* kid : n->kids) collectCallRefs(kid, calls);
+}
+
+UnitSummary summarize(const Program& prog) {
+    UnitSummary summary;
+    for (const auto& f : prog.funcs) {
+        FuncSig sig;
+        sig.name = f.name;
+        sig.arity = (int)f.params.size();
+        sig.returnsInt = f.returnsInt;
+        sig.line = f.line;
+        summary.defs.push_back(sig);
+        collectCallRefs(f.body, summary.calls);
+    }
+    return summary;
+}
+
+bool readFile(const string& path, string& text) {
+    ifstream in(path.c_str(), ios::in | ios::binary);
+    if (!in) return false;
+    ostringstream buf;
+    buf << in.rdbuf();
+    text = buf.str();
+    return true;
+}
+
+uint64_t hashText(const string& text) {
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : text) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// On-disk signature index: the summary of every cleanly parsed file, keyed
+// by a hash of its contents. Unchanged files are linked from the index
+// without being lexed or parsed again.
+class SignatureIndex {
+private:
+    static const uint32_t MAGIC = 0x49534354;  // "TCSI"
+    static const uint32_t VERSION = 1;
+
+    unordered_map<uint64_t, UnitSummary> entries;
+
+    static void putU32(string& out, uint32_t v) {
+        for (int i = 0; i < 4; i++) out += (char)(v >> (8 * i));
+    }
+
+    static void putU64(string& out, uint64_t v) {
+        putU32(out, (uint32_t)v);
+        putU32(out, (uint32_t)(v >> 32));
+    }
+
+    static void putString(string& out, const string& s) {
+        putU32(out, (uint32_t)s.size());
+        out += s;
+    }
+
+    struct Reader {
+        const string& data;
+        size_t pos;
+        bool ok;
+
+        Reader(const string& d) : data(d), pos(0), ok(true) {}
+
+        uint32_t u32() {
+            if (pos + 4 > data.size()) {
+                ok = false;
+                return 0;
+            }
+            uint32_t v = 0;
+            for (int i = 0; i < 4; i++) v |= (uint32_t)(unsigned char)data[pos + i] << (8 * i);
+            pos += 4;
+            return v;
+        }
+
+        uint64_t u64() {
+            uint64_t lo = u32();
+            return lo | (uint64_t)u32() << 32;
+        }
+
+        string str() {
+            uint32_t n = u32();
+            if (!ok || pos + n > data.size()) {
+                ok = false;
+                return string();
+            }
+            pos += n;
+            return data.substr(pos - n, n);
+        }
+    };
+
+public:
+    const UnitSummary* find(uint64_t hash) const {
+        auto it = entries.find(hash);
+        return it == entries.end() ? nullptr : &it->second;
+    }
+
+    void add(uint64_t hash, const UnitSummary& summary) { entries[hash] = summary; }
+
+    // A missing, stale or corrupt index simply starts out empty.
+    void load(const string& path) {
+        string data;
+        if (!readFile(path, data)) return;
+        Reader in(data);
+        if (in.u32() != MAGIC || in.u32() != VERSION) return;
+        uint32_t count = in.u32();
+        unordered_map<uint64_t, UnitSummary> loaded;
+        for (uint32_t i = 0; i < count && in.ok; i++) {
+            uint64_t hash = in.u64();
+            UnitSummary& summary = loaded[hash];
+            uint32_t ndefs = in.u32();
+            for (uint32_t j = 0; j < ndefs && in.ok; j++) {
+                FuncSig sig;
+                sig.name = in.str();
+                sig.arity = (int)in.u32();
+                sig.returnsInt = in.u32() != 0;
+                sig.line = (int)in.u32();
+                summary.defs.push_back(sig);
+            }
+            uint32_t ncalls = in.u32();
+            for (uint32_t j = 0; j < ncalls && in.ok; j++) {
+                CallRef ref;
+                ref.name = in.str();
+                ref.arity = (int)in.u32();
+                ref.line = (int)in.u32();
+                summary.calls.push_back(ref);
+            }
+        }
+        if (in.ok) entries.swap(loaded);
+    }
+
+    bool save(const string& path) const {
+        string out;
+        putU32(out, MAGIC);
+        putU32(out, VERSION);
+        putU32(out, (uint32_t)entries.size());
+        for (const auto& e : entries) {
+            putU64(out, e.first);
+            putU32(out, (uint32_t)e.second.defs.size());
+            for (const auto& sig : e.second.defs) {
+                putString(out, sig.name);
+                putU32(out, (uint32_t)sig.arity);
+                putU32(out, sig.returnsInt ? 1 : 0);
+                putU32(out, (uint32_t)sig.line);
+            }
+            putU32(out, (uint32_t)e.second.calls.size());
+            for (const auto& ref : e.second.calls) {
+                putString(out, ref.name);
+                putU32(out, (uint32_t)ref.arity);
+                putU32(out, (uint32_t)ref.line);
+            }
+        }
+        string tmp = path + ".tmp";
+        ofstream file(tmp.c_str(), ios::out | ios::binary | ios::trunc);
+        if (!file.write(out.data(), out.size())) return false;
+        file.close();
+        return rename(tmp.c_str(), path.c_str()) == 0;
+    }
+};
+
+void parseUnit(SourceUnit& unit, const SignatureIndex* index) {
+    string text;
+    unit.readable = readFile(unit.path, text);
+    if (!unit.readable) return;
+    unit.hash = hashText(text);
+    if (index) {
+        const UnitSummary* cached = index->find(unit.hash);
+        if (cached) {
+            unit.summary = *cached;
+            return;
+        }
+    }
+    AstBuilder builder;
+    map<int, string> errors = checkSource(text, builder);
+    unit.diags.assign(errors.begin(), errors.end());
+    if (errors.empty()) unit.summary = summarize(builder.program);
+}
+
+// Lex and parse the units on a pool of worker threads, one file at a time
+// per worker.
+void parseUnits(vector<SourceUnit>& units, const SignatureIndex* index) {
+    size_t workers = min<size_t>(max(1u, thread::hardware_concurrency()), units.size());
+    atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t i = next++; i < units.size(); i = next++) {
+            parseUnit(units[i], index);
+        }
+    };
+    vector<thread> pool;
+    for (size_t i = 1; i < workers; i++) pool.push_back(thread(work));
+    work();
+    for (auto& t : pool) t.join();
+}
+
+// Merge the per-file function tables and resolve every call against them.
+void linkUnits(vector<SourceUnit>& units) {
+    struct Definition {
+        size_t unit;
+        const FuncSig* sig;
+    };
+    unordered_map<string, Definition> table;
+    for (size_t u = 0; u < units.size(); u++) {
+        for (const auto& sig : units[u].summary.defs) {
+            Definition def = { u, &sig };
+            auto ins = table.insert(make_pair(sig.name, def));
+            if (!ins.second) {
+                const Definition& first = ins.first->second;
+                units[u].diags.push_back(make_pair(sig.line, "Duplicate definition of '" + sig.name +
+                    "', first defined at " + units[first.unit].path + ":" + to_string(first.sig->line)));
+            }
+        }
+    }
+    for (auto& unit : units) {
+        for (const auto& call : unit.summary.calls) {
+            auto it = table.find(call.name);
+            if (it == table.end()) {
+                unit.diags.push_back(make_pair(call.line, "Undefined function '" + call.name + "'"));
+            } else if (it->second.sig->arity != call.arity) {
+                unit.diags.push_back(make_pair(call.line, "Function '" + call.name + "' expects " +
+                    to_string(it->second.sig->arity) + " arguments, got " + to_string(call.arity)));
+            }
+        }
+    }
+}
+
+// Link syntactically clean units and print the combined verdict and
+// diagnostics. Returns whether the whole program was accepted.
+bool linkAndReport(vector<SourceUnit>& units) {
+    bool syntaxOk = true;
+    for (const auto& unit : units) {
+        if (!unit.readable || !unit.diags.empty()) syntaxOk = false;
+    }
+    if (syntaxOk) linkUnits(units);
+
+    bool clean = true;
+    for (const auto& unit : units) {
+        if (!unit.readable || !unit.diags.empty()) clean = false;
+    }
+    cout << (clean ? "accept" : "reject") << endl;
+    for (auto& unit : units) {
+        if (!unit.readable) {
+            cout << unit.path << ": cannot open file" << endl;
+            continue;
+        }
+        stable_sort(unit.diags.begin(), unit.diags.end(),
+                    [](const pair<int, string>& a, const pair<int, string>& b) { return a.first < b.first; });
+        for (const auto& d : unit.diags) {
+            cout << unit.path << ":" << d.first << " " << d.second << endl;
+        }
+    }
+    return clean;
+}
+
+// Multi-file mode: every file is one compilation unit and they are linked
+// into a single program. Diagnostics are reported as path:line. With an
+// index path, signatures of unchanged files come from the index and the
+// index is rewritten with the current set of clean files.
+int checkFiles(const vector<string>& paths, const string& indexPath) {
+    vector<SourceUnit> units(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) units[i].path = paths[i];
+
+    SignatureIndex index;
+    if (!indexPath.empty()) index.load(indexPath);
+    parseUnits(units, indexPath.empty() ? nullptr : &index);
+
+    if (!indexPath.empty()) {
+        SignatureIndex updated;
+        for (const auto& unit : units) {
+            if (unit.readable && unit.diags.empty()) updated.add(unit.hash, unit.summary);
+        }
+        if (!updated.save(indexPath)) cerr << indexPath << ": cannot write index" << endl;
+    }
+
+    return linkAndReport(units) ? 0 : 1;
+}
+
+bool hasSuffix(const string& s, const string& suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+#ifdef __linux__
+// Register dir and its subdirectories with inotify, collecting the .tc files
+// found along the way.
+void watchTree(int fd, const string& dir, map<int, string>& watches, vector<string>& files) {
+    int wd = inotify_add_watch(fd, dir.c_str(),
+                               IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE);
+    if (wd < 0) return;
+    watches[wd] = dir;
+    DIR* d = opendir(dir.c_str());
+    if (!d) return;
+    while (dirent* entry = readdir(d)) {
+        string name = entry->d_name;
+        if (name == "." || name == "..") continue;
+        string path = dir + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            watchTree(fd, path, watches, files);
+        } else if (hasSuffix(name, ".tc")) {
+            files.push_back(path);
+        }
+    }
+    closedir(d);
+}
+
+// Watch mode: check every .tc file under root once, then re-check only the
+// files inotify reports as written, moved in or removed. Summaries of the
+// other files stay in memory, so each update costs one parse per changed
+// file plus a relink.
+int watchDir(const string& root) {
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        cerr << "inotify unavailable" << endl;
+        return 2;
+    }
+    map<int, string> watches;
+    vector<string> changed;
+    watchTree(fd, root, watches, changed);
+
+    map<string, SourceUnit> units;
+    SignatureIndex memo;
+    vector<char> buf(64 * 1024);
+    set<string> removed;
+    while (true) {
+        typedef chrono::steady_clock Clock;
+        Clock::time_point start = Clock::now();
+
+        vector<SourceUnit> fresh(changed.size());
+        for (size_t i = 0; i < changed.size(); i++) fresh[i].path = changed[i];
+        parseUnits(fresh, &memo);
+        for (auto& unit : fresh) {
+            if (unit.readable && unit.diags.empty()) memo.add(unit.hash, unit.summary);
+            units[unit.path] = unit;
+        }
+        for (const auto& path : removed) units.erase(path);
+
+        vector<SourceUnit> all;
+        for (const auto& u : units) all.push_back(u.second);
+        linkAndReport(all);
+        cout << "-- " << fresh.size() << " file(s) rechecked in "
+             << chrono::duration<double, milli>(Clock::now() - start).count() << " ms" << endl;
+
+        changed.clear();
+        removed.clear();
+        while (changed.empty() && removed.empty()) {
+            ssize_t n = read(fd, buf.data(), buf.size());
+            if (n <= 0) return 1;
+            for (ssize_t off = 0; off < n;) {
+                const inotify_event* ev = (const inotify_event*)(buf.data() + off);
+                off += sizeof(inotify_event) + ev->len;
+                if (!ev->len || !watches.count(ev->wd)) continue;
+                string path = watches[ev->wd] + "/" + ev->name;
+                if (ev->mask & IN_ISDIR) {
+                    if (ev->mask & (IN_CREATE | IN_MOVED_TO)) watchTree(fd, path, watches, changed);
+                } else if (hasSuffix(path, ".tc")) {
+                    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                        removed.insert(path);
+                    } else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                        removed.erase(path);
+                        changed.push_back(path);
+                    }
+                }
+            }
+        }
+        sort(changed.begin(), changed.end());
+        changed.erase(unique(changed.begin(), changed.end()), changed.end());
+    }
+}
+#else
+int watchDir(const string&) {
+    cerr << "--watch needs inotify (Linux only)" << endl;
+    return 2;
+}
+#endif
+
+// Canonical layout for ToyC source: four-space indentation, braces on the
+// line that opens them, one statement per line and single spaces around
+// binary operators. Comments come from the lexer's trivia table and stay
+// where they were, either trailing a line or on their own line; runs of
+// blank lines collapse to one. Tokens are pulled straight from the lexer and
+// appended to one output buffer.
+string formatSource(const string& src) {
+    vector<Trivia> trivia;
+    Lexer lexer(src, &trivia);
+    string out;
+    out.reserve(src.size() + src.size() / 8);
+
+    int indent = 0;
+    bool lineStart = true, pendingNewline = false;
+    bool prevComment = false, prevUnary = false;
+    TokenType prevCode = TOK_EOF;
+    int prevLine = 0;
+
+    auto breakLine = [&](int line) {
+        if (lineStart) return;
+        out += '\n';
+        if (line > prevLine + 1) out += '\n';
+        lineStart = true;
+    };
+
+    size_t seen = 0;
+    while (true) {
+        Token tok = lexer.nextToken();
+
+        // Comments the lexer skipped on its way to tok.
+        for (; seen < trivia.size(); seen++) {
+            const Trivia& c = trivia[seen];
+            bool trailing = !lineStart && c.line == prevLine;
+            if (!trailing) {
+                breakLine(c.line);
+                pendingNewline = false;
+            }
+            if (lineStart) out.append(indent * 4, ' ');
+            else out += ' ';
+            out.append(src, c.begin, c.end - c.begin);
+            lineStart = false;
+            prevLine = c.line + (int)count(src.begin() + c.begin, src.begin() + c.end, '\n');
+            if (src[c.begin + 1] == '/' || !trailing) pendingNewline = true;
+            prevComment = true;
+        }
+        if (tok.type == TOK_EOF) break;
+
+        if (tok.type == TOK_RBRACE) {
+            indent = max(0, indent - 1);
+            pendingNewline = true;
+        }
+        if (tok.type == TOK_ELSE && prevCode == TOK_RBRACE && !prevComment) pendingNewline = false;
+        if (pendingNewline) breakLine(tok.line);
+        pendingNewline = false;
+
+        if (lineStart) {
+            out.append(indent * 4, ' ');
+        } else if (prevComment ||
+                   !(tok.type == TOK_RPAREN || tok.type == TOK_SEMICOLON || tok.type == TOK_COMMA ||
+                     prevCode == TOK_LPAREN || prevUnary ||
+                     (tok.type == TOK_LPAREN && prevCode == TOK_ID))) {
+            out += ' ';
+        }
+
+        if (tok.type == TOK_ID || tok.type == TOK_NUMBER || tok.type <= TOK_RETURN) {
+            out += tok.value;
+        } else {
+            out += tokenText(tok.type);
+        }
+        lineStart = false;
+
+        prevLine = tok.line;
+        prevUnary = (tok.type == TOK_PLUS || tok.type == TOK_MINUS || tok.type == TOK_NOT) &&
+                    prevCode != TOK_ID && prevCode != TOK_NUMBER && prevCode != TOK_RPAREN;
+        prevComment = false;
+        prevCode = tok.type;
+        if (tok.type == TOK_LBRACE) indent++;
+        if (tok.type == TOK_LBRACE || tok.type == TOK_RBRACE || tok.type == TOK_SEMICOLON) {
+            pendingNewline = true;
+        }
+    }
+    if (!lineStart) out += '\n';
+    return out;
+}
+
+bool writeFile(const string& path, const string& text) {
+    string tmp = path + ".tmp";
+    ofstream file(tmp.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!file.write(text.data(), text.size())) return false;
+    file.close();
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// --format: reprint stdin or the given files. Sources that do not pass the
+// syntax check are reported and left alone. In place, a file is rewritten
+// only when formatting changes it.
+int formatFiles(const vector<string>& paths, bool inPlace, const string& stdinText) {
+    vector<string> sources = paths.empty() ? vector<string>(1, "-") : paths;
+    int status = 0;
+    for (const auto& path : sources) {
+        string text = stdinText;
+        if (path != "-" && !readFile(path, text)) {
+            cerr << path << ": cannot open file" << endl;
+            status = 1;
+            continue;
+        }
+        NullBuilder builder;
+        map<int, string> errors = checkSource(text, builder);
+        if (!errors.empty()) {
+            for (const auto& e : errors) cerr << path << ":" << e.first << " " << e.second << endl;
+            status = 1;
+            continue;
+        }
+        string formatted = formatSource(text);
+        if (!inPlace || path == "-") {
+            cout << formatted;
+        } else if (formatted != text) {
+            if (!writeFile(path, formatted)) {
+                cerr << path << ": cannot write file" << endl;
+                status = 1;
+            } else {
+                cout << "formatted " << path << endl;
+            }
+        }
+    }
+    return status;
+}
+
+// Follows function, parameter and block scopes over a token stream, declaring
+// names where parseFuncDef, parseParam and parseStmt would, without keeping
+// tokens or building a tree. Each live local gets a slot number that is
+// unique among the bindings visible at that point; slots of a closed block
+// are reused by its later siblings.
+class ScopeTracker {
+public:
+    enum Role { ROLE_NONE, ROLE_FUNCTION, ROLE_PARAM, ROLE_LOCAL };
+
+    // declOffset is the source offset of the declaring token for params and
+    // locals (and for a function name at its definition).
+    struct Symbol {
+        Role role;
+        bool declaration;
+        int slot;
+        size_t declOffset;
+    };
+
+    ScopeTracker() : depth(0), parenDepth(0), state(TOP), hasPending(false) {}
+
+    // Feed every token in order; the result is meaningful for TOK_ID.
+    // following is the type of the token after tok: a name followed by '('
+    // is a call and resolves to the function even under a same-named local.
+    Symbol next(const Token& tok, TokenType following = TOK_EOF) {
+        Symbol sym = { ROLE_NONE, false, -1, 0 };
+        switch (tok.type) {
+            case TOK_INT:
+            case TOK_VOID:
+                if (depth == 0 && state != PARAMS) state = AFTER_TYPE;
+                else if (state == PARAMS) state = PARAM_NAME;
+                else if (depth > 0) state = DECL_NAME;
+                break;
+            case TOK_ID:
+                if (state == AFTER_TYPE) {
+                    sym.role = ROLE_FUNCTION;
+                    sym.declaration = true;
+                    sym.declOffset = tok.offset;
+                    state = FUNC_NAME;
+                } else if (state == PARAM_NAME) {
+                    sym.role = ROLE_PARAM;
+                    sym.declaration = true;
+                    sym.slot = declare(tok.value, sym.role, tok.offset);
+                    sym.declOffset = tok.offset;
+                    state = PARAMS;
+                } else if (state == DECL_NAME) {
+                    // A local comes into scope after its initializer, as in
+                    // Resolver; until then it only reserves the next slot.
+                    sym.role = ROLE_LOCAL;
+                    sym.declaration = true;
+                    sym.slot = (int)live.size();
+                    sym.declOffset = tok.offset;
+                    pending.name = tok.value;
+                    pending.offset = tok.offset;
+                    hasPending = true;
+                    state = DECL_INIT;
+                } else if (following == TOK_LPAREN) {
+                    sym.role = ROLE_FUNCTION;
+                } else {
+                    auto it = visible.find(tok.value);
+                    if (it != visible.end() && !it->second.empty()) {
+                        const Binding& b = live[it->second.back()];
+                        sym.role = b.role;
+                        sym.slot = b.slot;
+                        sym.declOffset = b.offset;
+                    } else {
+                        sym.role = ROLE_FUNCTION;
+                    }
+                }
+                break;
+            case TOK_LPAREN:
+                if (state == FUNC_NAME) {
+                    live.clear();
+                    visible.clear();
+                    state = PARAMS;
+                } else {
+                    parenDepth++;
+                }
+                break;
+            case TOK_RPAREN:
+                if (state == PARAMS) state = TOP;
+                else if (parenDepth > 0) parenDepth--;
+                break;
+            case TOK_COMMA:
+                if (state == DECL_INIT && parenDepth == 0) {
+                    declarePending();
+                    state = DECL_NAME;
+                }
+                break;
+            case TOK_SEMICOLON:
+                declarePending();
+                if (depth > 0) state = TOP;
+                parenDepth = 0;
+                break;
+            case TOK_LBRACE:
+                declarePending();
+                depth++;
+                marks.push_back(live.size());
+                state = TOP;
+                break;
+            case TOK_RBRACE:
+                declarePending();
+                if (depth > 0) {
+                    depth--;
+                    size_t mark = marks.back();
+                    marks.pop_back();
+                    while (live.size() > mark) {
+                        visible[live.back().name].pop_back();
+                        live.pop_back();
+                    }
+                }
+                state = TOP;
+                break;
+            default:
+                break;
+        }
+        return sym;
+    }
+
+private:
+    enum State { TOP, AFTER_TYPE, FUNC_NAME, PARAMS, PARAM_NAME, DECL_NAME, DECL_INIT };
+
+    struct Binding {
+        string name;
+        Role role;
+        int slot;
+        size_t offset;
+    };
+
+    int depth, parenDepth;
+    State state;
+    vector<Binding> live;
+    vector<size_t> marks;
+    unordered_map<string, vector<size_t> > visible;
+    Binding pending;
+    bool hasPending;
+
+    int declare(const string& name, Role role, size_t offset) {
+        Binding b = { name, role, (int)live.size(), offset };
+        visible[name].push_back(live.size());
+        live.push_back(b);
+        return b.slot;
+    }
+
+    void declarePending() {
+        if (!hasPending) return;
+        declare(pending.name, ROLE_LOCAL, pending.offset);
+        hasPending = false;
+    }
+};
+
+bool isKeyword(const string& id) {
+    return id == "int" || id == "void" || id == "if" || id == "else" || id == "while" ||
+           id == "break" || id == "continue" || id == "return";
+}
+
+// --minify: strip comments and whitespace and rename parameters and locals to
+// the shortest identifiers that cannot clash with a keyword or a function.
+// Input that fails the syntax check, itself a streaming parse, is rejected
+// as in the default mode. Then works in two streaming passes over the lexer,
+// the first only collecting function names, and writes output in
+// fixed-size chunks.
+int minifySource(const string& src, ostream& os) {
+    {
+        Lexer lexer(src);
+        NullBuilder builder;
+        BasicParser<NullBuilder> parser(lexer, builder);
+        parser.parse();
+        map<int, string> errors = lexer.getErrors();
+        for (const auto& e : parser.getErrors()) errors[e.first] = e.second;
+        if (!errors.empty()) {
+            os << "reject" << endl;
+            for (const auto& e : errors) os << e.first << " " << e.second << endl;
+            return 1;
+        }
+    }
+
+    set<string> reserved;
+    {
+        Lexer lexer(src);
+        Token prev;
+        prev.type = TOK_EOF;
+        for (Token tok = lexer.nextToken(); tok.type != TOK_EOF; tok = lexer.nextToken()) {
+            if (tok.type == TOK_LPAREN && prev.type == TOK_ID) reserved.insert(prev.value);
+            prev = tok;
+        }
+    }
+
+    const string first = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_";
+    const string rest = first + "0123456789";
+    vector<string> names;
+    size_t candidate = 0;
+    auto nameFor = [&](int slot) -> const string& {
+        while ((int)names.size() <= slot) {
+            size_t n = candidate++;
+            string id(1, first[n % first.size()]);
+            for (n /= first.size(); n > 0; n = (n - 1) / rest.size()) {
+                id += rest[(n - 1) % rest.size()];
+            }
+            if (!isKeyword(id) && !reserved.count(id)) names.push_back(id);
+        }
+        return names[slot];
+    };
+
+    Lexer lexer(src);
+    ScopeTracker scopes;
+    string out;
+    out.reserve(1 << 16);
+    bool prevWord = false;
+    TokenType prev = TOK_EOF;
+    Token ahead = lexer.nextToken();
+    while (ahead.type != TOK_EOF) {
+        Token tok = ahead;
+        ahead = lexer.nextToken();
+        ScopeTracker::Symbol sym = scopes.next(tok, ahead.type);
+        bool word = tok.type == TOK_ID || tok.type == TOK_NUMBER || tok.type <= TOK_RETURN;
+        bool glue = ((tok.type == TOK_ASSIGN || tok.type == TOK_EQ) &&
+                     (prev == TOK_LT || prev == TOK_GT || prev == TOK_ASSIGN || prev == TOK_NOT)) ||
+                    (tok.type == prev && (tok.type == TOK_MINUS || tok.type == TOK_PLUS));
+        if ((word && prevWord) || glue) out += ' ';
+        if (tok.type == TOK_ID && (sym.role == ScopeTracker::ROLE_PARAM || sym.role == ScopeTracker::ROLE_LOCAL)) {
+            out += nameFor(sym.slot);
+        } else if (word) {
+            out += tok.value;
+        } else {
+            out += tokenText(tok.type);
+        }
+        prevWord = word;
+        prev = tok.type;
+        if (out.size() >= (1 << 16) - 64) {
+            os.write(out.data(), out.size());
+            out.clear();
+        }
+    }
+    out += '\n';
+    os.write(out.data(), out.size());
+    return 0;
+}
+
+// Semantic token types, in the order of the legend sent to LSP clients.
+enum SemanticType {
+    SEM_KEYWORD, SEM_FUNCTION, SEM_PARAMETER, SEM_VARIABLE,
+    SEM_NUMBER, SEM_OPERATOR, SEM_COMMENT
+};
+
+static const char* semanticTypeNames[] = {
+    "keyword", "function", "parameter", "variable", "number", "operator", "comment"
+};
+
+static const uint32_t SEM_MOD_DECLARATION = 1;
+
+// Classify the tokens and comments on lines [firstLine, lastLine] (1-based)
+// and encode them the way LSP textDocument/semanticTokens does: five
+// integers per token, deltaLine, deltaStart, length, type and modifiers,
+// each position relative to the previous token. Scopes have to be followed
+// from the top of the file, but lexing stops one token past lastLine.
+vector<uint32_t> semanticTokens(const string& src, int firstLine, int lastLine) {
+    vector<uint32_t> data;
+    vector<Trivia> trivia;
+    Lexer lexer(src, &trivia);
+    ScopeTracker scopes;
+
+    size_t scanPos = 0, lineStart = 0;
+    int scanLine = 1;
+    uint32_t prevLine = 0, prevStart = 0;
+    auto emit = [&](size_t offset, int line, size_t length, uint32_t type, uint32_t mods) {
+        if (line < firstLine || line > lastLine) return;
+        for (; scanPos < offset; scanPos++) {
+            if (src[scanPos] == '\n') {
+                scanLine++;
+                lineStart = scanPos + 1;
+            }
+        }
+        uint32_t l = (uint32_t)line - 1;
+        uint32_t start = (uint32_t)(offset - lineStart);
+        data.push_back(l - prevLine);
+        data.push_back(l == prevLine ? start - prevStart : start);
+        data.push_back((uint32_t)length);
+        data.push_back(type);
+        data.push_back(mods);
+        prevLine = l;
+        prevStart = start;
+    };
+
+    // One token of lookahead tells calls from uses of a shadowing local;
+    // comments lexed with the lookahead follow tok and wait for the next turn.
+    size_t seen = 0;
+    Token tok = lexer.nextToken();
+    size_t before = trivia.size();
+    while (true) {
+        for (; seen < before; seen++) {
+            // Multi-line comments are reported one line at a time.
+            const Trivia& c = trivia[seen];
+            int line = c.line;
+            size_t begin = c.begin;
+            for (size_t i = c.begin; i <= c.end; i++) {
+                if (i == c.end || src[i] == '\n') {
+                    if (i > begin) emit(begin, line, i - begin, SEM_COMMENT, 0);
+                    line++;
+                    begin = i + 1;
+                }
+            }
+        }
+        if (tok.type == TOK_EOF || tok.line > lastLine) break;
+
+        Token ahead = lexer.nextToken();
+        ScopeTracker::Symbol sym = scopes.next(tok, ahead.type);
+        uint32_t mods = sym.declaration ? SEM_MOD_DECLARATION : 0;
+        if (tok.type == TOK_ID) {
+            uint32_t type = sym.role == ScopeTracker::ROLE_PARAM ? SEM_PARAMETER :
+                            sym.role == ScopeTracker::ROLE_LOCAL ? SEM_VARIABLE : SEM_FUNCTION;
+            emit(tok.offset, tok.line, tok.value.size(), type, mods);
+        } else if (tok.type == TOK_NUMBER) {
+            emit(tok.offset, tok.line, tok.value.size(), SEM_NUMBER, 0);
+        } else if (tok.type <= TOK_RETURN) {
+            emit(tok.offset, tok.line, tok.value.size(), SEM_KEYWORD, 0);
+        } else if (tok.type < TOK_LPAREN) {
+            emit(tok.offset, tok.line, tokenText(tok.type).size(), SEM_OPERATOR, 0);
+        }
+        tok = ahead;
+        before = trivia.size();
+    }
+    return data;
+}
+
+// --semantic-tokens [--range FIRST:LAST]: print the LSP legend and encoded
+// token data for stdin as JSON.
+int printSemanticTokens(const string& src, const string& range) {
+    int firstLine = 1, lastLine = INT_MAX;
+    if (!range.empty()) {
+        size_t colon = range.find(':');
+        firstLine = atoi(range.c_str());
+        if (colon != string::npos) lastLine = atoi(range.c_str() + colon + 1);
+    }
+    vector<uint32_t> data = semanticTokens(src, firstLine, lastLine);
+
+    string out = "{\"legend\":{\"tokenTypes\":[";
+    for (int i = 0; i <= SEM_COMMENT; i++) {
+        if (i) out += ',';
+        out += '"';
+        out += semanticTypeNames[i];
+        out += '"';
+    }
+    out += "],\"tokenModifiers\":[\"declaration\"]},\"data\":[";
+    for (size_t i = 0; i < data.size(); i++) {
+        if (i) out += ',';
+        out += to_string(data[i]);
+    }
+    out += "]}\n";
+    cout << out;
+    return 0;
+}
+
+// Cross-reference index. Every section is an array of fixed-size records,
+// so queries mmap the file and binary-search it in place:
+//   header | files sorted by path | entries sorted by (name, file, offset) |
+//   entry numbers sorted by (file, line, column) | string pool
+struct XrefHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t fileCount;
+    uint32_t entryCount;
+    uint32_t filesOffset;
+    uint32_t entriesOffset;
+    uint32_t byPositionOffset;
+    uint32_t poolOffset;
+    uint32_t poolSize;
+};
+
+struct XrefFile {
+    uint64_t hash;
+    uint32_t path;
+    uint32_t firstPosition;
+    uint32_t positionCount;
+    uint32_t reserved;
+};
+
+// One identifier occurrence. defOffset is where a param or local is declared
+// in the same file; functions are matched by name instead.
+struct XrefEntry {
+    uint32_t name;
+    uint32_t file;
+    uint32_t offset;
+    uint32_t line;
+    uint32_t column;
+    uint32_t role;
+    uint32_t isDef;
+    uint32_t defOffset;
+};
+
+static const uint32_t XREF_MAGIC = 0x52584354;  // "TCXR"
+static const uint32_t XREF_VERSION = 2;
+
+class XrefIndex {
+private:
+    void* base;
+    size_t size;
+
+    bool fits(uint32_t offset, uint32_t count, size_t elem) const {
+        return offset % 4 == 0 && offset <= size && count <= (size - offset) / elem;
+    }
+
+    // Bounds of every section and of every index stored in one, so that a
+    // truncated or damaged file cannot send a query outside the mapping.
+    bool valid() {
+        const XrefHeader& h = *header;
+        if (!fits(h.filesOffset, h.fileCount, sizeof(XrefFile)) ||
+            !fits(h.entriesOffset, h.entryCount, sizeof(XrefEntry)) ||
+            !fits(h.byPositionOffset, h.entryCount, sizeof(uint32_t)) ||
+            h.poolOffset > size || h.poolSize > size - h.poolOffset) {
+            return false;
+        }
+        const char* p = (const char*)base;
+        files = (const XrefFile*)(p + h.filesOffset);
+        entries = (const XrefEntry*)(p + h.entriesOffset);
+        byPosition = (const uint32_t*)(p + h.byPositionOffset);
+        pool = p + h.poolOffset;
+        if (h.poolSize > 0 && pool[h.poolSize - 1] != '\0') return false;
+        for (uint32_t i = 0; i < h.fileCount; i++) {
+            const XrefFile& f = files[i];
+            if (f.path >= h.poolSize || f.firstPosition > h.entryCount ||
+                f.positionCount > h.entryCount - f.firstPosition) {
+                return false;
+            }
+        }
+        for (uint32_t i = 0; i < h.entryCount; i++) {
+            const XrefEntry& e = entries[i];
+            if (e.name >= h.poolSize || e.file >= h.fileCount || e.role > ScopeTracker::ROLE_LOCAL ||
+                byPosition[i] >= h.entryCount) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    const XrefHeader* header;
+    const XrefFile* files;
+    const XrefEntry* entries;
+    const uint32_t* byPosition;
+    const char* pool;
+
+    XrefIndex()
+        : base(nullptr), size(0), header(nullptr), files(nullptr), entries(nullptr),
+          byPosition(nullptr), pool(nullptr) {}
+
+    ~XrefIndex() {
+        if (base) munmap(base, size);
+    }
+
+    bool open(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(XrefHeader)) {
+            close(fd);
+            return false;
+        }
+        size = st.st_size;
+        base = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            base = nullptr;
+            return false;
+        }
+        const char* p = (const char*)base;
+        header = (const XrefHeader*)p;
+        if (header->magic != XREF_MAGIC || header->version != XREF_VERSION || !valid()) {
+            header = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    const char* str(uint32_t off) const { return pool + off; }
+
+    // All occurrences of name, in (file, offset) order.
+    pair<const XrefEntry*, const XrefEntry*> byName(const string& name) const {
+        const XrefEntry* end = entries + header->entryCount;
+        const XrefEntry* lo = lower_bound(entries, end, name, [this](const XrefEntry& e, const string& key) {
+            return strcmp(str(e.name), key.c_str()) < 0;
+        });
+        const XrefEntry* hi = upper_bound(lo, end, name, [this](const string& key, const XrefEntry& e) {
+            return strcmp(key.c_str(), str(e.name)) < 0;
+        });
+        return make_pair(lo, hi);
+    }
+
+    // The identifier covering line:column of a file, if any.
+    const XrefEntry* at(uint32_t file, uint32_t line, uint32_t column) const {
+        const uint32_t* begin = byPosition;
+        const uint32_t* end = byPosition + header->entryCount;
+        const uint32_t* it = upper_bound(begin, end, 0u, [&](uint32_t, uint32_t idx) {
+            const XrefEntry& e = entries[idx];
+            if (e.file != file) return file < e.file;
+            if (e.line != line) return line < e.line;
+            return column < e.column;
+        });
+        if (it == begin) return nullptr;
+        const XrefEntry& e = entries[*(it - 1)];
+        if (e.file != file || e.line != line || column >= e.column + strlen(str(e.name))) return nullptr;
+        return &e;
+    }
+
+    // The file table is sorted by path.
+    int findFile(const string& path) const {
+        const XrefFile* end = files + header->fileCount;
+        const XrefFile* it = lower_bound(files, end, path, [this](const XrefFile& f, const string& key) {
+            return strcmp(str(f.path), key.c_str()) < 0;
+        });
+        return it != end && path == str(it->path) ? (int)(it - files) : -1;
+    }
+};
+
+class XrefWriter {
+private:
+    vector<XrefEntry> entries;
+    vector<XrefFile> files;
+    string pool;
+    unordered_map<string, uint32_t> interned;
+
+    static void align(string& out) {
+        while (out.size() % 8) out += '\0';
+    }
+
+public:
+    uint32_t intern(const string& s) {
+        auto it = interned.find(s);
+        if (it != interned.end()) return it->second;
+        uint32_t off = (uint32_t)pool.size();
+        pool += s;
+        pool += '\0';
+        interned[s] = off;
+        return off;
+    }
+
+    uint32_t addFile(const string& path, uint64_t hash) {
+        XrefFile f = { hash, intern(path), 0, 0, 0 };
+        files.push_back(f);
+        return (uint32_t)files.size() - 1;
+    }
+
+    void add(const XrefEntry& e) { entries.push_back(e); }
+
+    void scan(uint32_t file, const string& text) {
+        vector<size_t> lineStarts(1, 0);
+        for (size_t i = 0; i < text.size(); i++) {
+            if (text[i] == '\n') lineStarts.push_back(i + 1);
+        }
+        Lexer lexer(text);
+        ScopeTracker scopes;
+        Token ahead = lexer.nextToken();
+        while (ahead.type != TOK_EOF) {
+            Token tok = ahead;
+            ahead = lexer.nextToken();
+            ScopeTracker::Symbol sym = scopes.next(tok, ahead.type);
+            if (tok.type != TOK_ID) continue;
+            XrefEntry e;
+            e.name = intern(tok.value);
+            e.file = file;
+            e.offset = (uint32_t)tok.offset;
+            e.line = (uint32_t)tok.line;
+            e.column = (uint32_t)(tok.offset - lineStarts[tok.line - 1] + 1);
+            e.role = sym.role;
+            e.isDef = sym.declaration ? 1 : 0;
+            e.defOffset = sym.role == ScopeTracker::ROLE_FUNCTION ? 0 : (uint32_t)sym.declOffset;
+            entries.push_back(e);
+        }
+    }
+
+    bool save(const string& path) {
+        vector<uint32_t> order(files.size());
+        for (size_t i = 0; i < files.size(); i++) order[i] = (uint32_t)i;
+        sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+            return strcmp(pool.c_str() + files[a].path, pool.c_str() + files[b].path) < 0;
+        });
+        vector<XrefFile> sorted(files.size());
+        vector<uint32_t> renumber(files.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            sorted[i] = files[order[i]];
+            renumber[order[i]] = (uint32_t)i;
+        }
+        files.swap(sorted);
+        for (auto& e : entries) e.file = renumber[e.file];
+
+        sort(entries.begin(), entries.end(), [this](const XrefEntry& a, const XrefEntry& b) {
+            int c = a.name == b.name ? 0 : strcmp(pool.c_str() + a.name, pool.c_str() + b.name);
+            if (c != 0) return c < 0;
+            if (a.file != b.file) return a.file < b.file;
+            return a.offset < b.offset;
+        });
+        vector<uint32_t> byPosition(entries.size());
+        for (size_t i = 0; i < entries.size(); i++) byPosition[i] = (uint32_t)i;
+        sort(byPosition.begin(), byPosition.end(), [this](uint32_t a, uint32_t b) {
+            const XrefEntry& x = entries[a];
+            const XrefEntry& y = entries[b];
+            if (x.file != y.file) return x.file < y.file;
+            return x.offset < y.offset;
+        });
+        for (size_t i = 0; i < byPosition.size(); i++) {
+            XrefFile& f = files[entries[byPosition[i]].file];
+            if (f.positionCount++ == 0) f.firstPosition = (uint32_t)i;
+        }
+
+        XrefHeader h;
+        h.magic = XREF_MAGIC;
+        h.version = XREF_VERSION;
+        h.fileCount = (uint32_t)files.size();
+        h.entryCount = (uint32_t)entries.size();
+        string out((const char*)&h, sizeof(h));
+        align(out);
+        h.filesOffset = (uint32_t)out.size();
+        out.append((const char*)files.data(), files.size() * sizeof(XrefFile));
+        align(out);
+        h.entriesOffset = (uint32_t)out.size();
+        out.append((const char*)entries.data(), entries.size() * sizeof(XrefEntry));
+        align(out);
+        h.byPositionOffset = (uint32_t)out.size();
+        out.append((const char*)byPosition.data(), byPosition.size() * sizeof(uint32_t));
+        align(out);
+        h.poolOffset = (uint32_t)out.size();
+        h.poolSize = (uint32_t)pool.size();
+        out += pool;
+        out.replace(0, sizeof(h), (const char*)&h, sizeof(h));
+        return writeFile(path, out);
+    }
+};
+
+// --xref-build INDEX FILE...: index every identifier occurrence of the files.
+// Files whose contents hash the same as in the existing index keep their old
+// entries; only changed files are lexed again.
+int buildXref(const string& indexPath, const vector<string>& paths) {
+    XrefIndex old;
+    bool haveOld = old.open(indexPath);
+    XrefWriter writer;
+    int status = 0;
+    for (const auto& path : paths) {
+        string text;
+        if (!readFile(path, text)) {
+            cerr << path << ": cannot open file" << endl;
+            status = 1;
+            continue;
+        }
+        uint64_t hash = hashText(text);
+        int oldFile = haveOld ? old.findFile(path) : -1;
+        if (oldFile >= 0 && old.files[oldFile].hash == hash) {
+            uint32_t file = writer.addFile(path, hash);
+            const XrefFile& f = old.files[oldFile];
+            for (uint32_t i = 0; i < f.positionCount; i++) {
+                XrefEntry e = old.entries[old.byPosition[f.firstPosition + i]];
+                e.name = writer.intern(old.str(e.name));
+                e.file = file;
+                writer.add(e);
+            }
+            continue;
+        }
+        NullBuilder builder;
+        map<int, string> errors = checkSource(text, builder);
+        if (!errors.empty()) {
+            for (const auto& e : errors) cerr << path << ":" << e.first << " " << e.second << endl;
+            status = 1;
+            continue;
+        }
+        writer.scan(writer.addFile(path, hash), text);
+    }
+    if (!writer.save(indexPath)) {
+        cerr << indexPath << ": cannot write index" << endl;
+        return 1;
+    }
+    return status;
+}
+
+// --xref INDEX QUERY: QUERY is either an identifier, listing every occurrence
+// of it, or path:line:column, listing the definition of the identifier there
+// followed by its references.
+int queryXref(const string& indexPath, const string& query) {
+    XrefIndex index;
+    if (!index.open(indexPath)) {
+        cerr << indexPath << ": cannot read index" << endl;
+        return 2;
+    }
+    static const char* roles[] = { "none", "function", "param", "local" };
+    auto print = [&](const XrefEntry& e) {
+        cout << index.str(index.files[e.file].path) << ":" << e.line << ":" << e.column << " "
+             << (e.isDef ? "def " : "use ") << roles[e.role] << " " << index.str(e.name) << endl;
+    };
+
+    size_t colon2 = query.rfind(':');
+    size_t colon1 = colon2 == string::npos || colon2 == 0 ? string::npos : query.rfind(':', colon2 - 1);
+    if (colon1 == string::npos) {
+        auto range = index.byName(query);
+        for (const XrefEntry* e = range.first; e != range.second; e++) print(*e);
+        return range.first == range.second ? 1 : 0;
+    }
+
+    int file = index.findFile(query.substr(0, colon1));
+    const XrefEntry* at = file < 0 ? nullptr :
+        index.at((uint32_t)file, (uint32_t)atoi(query.c_str() + colon1 + 1), (uint32_t)atoi(query.c_str() + colon2 + 1));
+    if (!at) {
+        cerr << "no identifier at " << query << endl;
+        return 1;
+    }
+    auto range = index.byName(index.str(at->name));
+    auto same = [&](const XrefEntry& e) {
+        if (at->role == ScopeTracker::ROLE_FUNCTION) return e.role == ScopeTracker::ROLE_FUNCTION;
+        return e.file == at->file && e.role != ScopeTracker::ROLE_FUNCTION && e.defOffset == at->defOffset;
+    };
+    for (int pass = 0; pass < 2; pass++) {
+        for (const XrefEntry* e = range.first; e != range.second; e++) {
+            if (same(*e) && (e->isDef != 0) == (pass == 0)) print(*e);
+        }
+    }
+    return 0;
+}
+
+// Name resolution ahead of execution: gives every param and local its own
+// frame slot, binds calls to function indices and rejects what the grammar
+// lets through but no engine can run.
+class Resolver {
+private:
+    Program& prog;
+    map<int, string> errors;
+    unordered_map<string, int> funcIndex;
+    vector<unordered_map<string, int> > scopes;
+    int frameSize;
+    int loopDepth;
+
+    void error(int line, const string& msg) {
+        if (errors.find(line) == errors.end()) errors[line] = msg;
+    }
+
+    int lookup(const string& name) {
+        for (size_t i = scopes.size(); i-- > 0;) {
+            auto it = scopes[i].find(name);
+            if (it != scopes[i].end()) return it->second;
+        }
+        return -1;
+    }
+
+    void declare(Node* var) {
+        if (scopes.back().count(var->name)) error(var->line, "Redefinition of '" + var->name + "'");
+        var->slot = frameSize++;
+        scopes.back()[var->name] = var->slot;
+    }
+
+    void resolve(Node* n) {
+        switch (n->kind) {
+            case NODE_VAR:
+            case NODE_ASSIGN:
+                n->slot = lookup(n->name);
+                if (n->slot < 0) error(n->line, "Undefined variable '" + n->name + "'");
+                break;
+            case NODE_CALL: {
+                auto it = funcIndex.find(n->name);
+                if (it == funcIndex.end()) {
+                    error(n->line, "Undefined function '" + n->name + "'");
+                } else if (prog.funcs[it->second].params.size() != n->kids.size()) {
+                    error(n->line, "Function '" + n->name + "' expects " +
+                          to_string(prog.funcs[it->second].params.size()) + " arguments, got " +
+                          to_string(n->kids.size()));
+                } else {
+                    n->callee = it->second;
+                }
+                break;
+            }
+            case NODE_DECL:
+                for (Node* var : n->kids) {
+                    if (!var->kids.empty()) resolve(var->kids[0]);
+                    declare(var);
+                }
+                return;
+            case NODE_BLOCK:
+                scopes.push_back(unordered_map<string, int>());
+                for (Node* kid : n->kids) resolve(kid);
+                scopes.pop_back();
+                return;
+            case NODE_WHILE:
+                resolve(n->kids[0]);
+                loopDepth++;
+                resolve(n->kids[1]);
+                loopDepth--;
+                return;
+            case NODE_BREAK:
+            case NODE_CONTINUE:
+                if (loopDepth == 0) error(n->line, "Jump outside of a loop");
+                break;
+            default:
+                break;
+        }
+        for (Node* kid : n->kids) resolve(kid);
+    }
+
+public:
+    Resolver(Program& p) : prog(p), frameSize(0), loopDepth(0) {}
+
+    map<int, string> run() {
+        for (size_t i = 0; i < prog.funcs.size(); i++) {
+            if (!funcIndex.insert(make_pair(prog.funcs[i].name, (int)i)).second) {
+                error(prog.funcs[i].line, "Redefinition of function '" + prog.funcs[i].name + "'");
+            }
+        }
+        if (!funcIndex.count("main")) error(1, "No main function");
+        for (auto& f : prog.funcs) {
+            scopes.assign(1, unordered_map<string, int>());
+            frameSize = 0;
+            for (const auto& param : f.params) {
+                if (scopes.back().count(param)) error(f.line, "Redefinition of '" + param + "'");
+                scopes.back()[param] = frameSize++;
+            }
+            resolve(f.body);
+            f.frameSize = frameSize;
+        }
+        return errors;
+    }
+};
+
+// Loop optimization for the counted-loop idiom
+//     while (i < n) { ...; i = i + c; }
+// where i is assigned only by the final increment, n is invariant and no
+// break or continue leaves the loop. When the body tests i == v or i != v
+// against the constant v that i holds on entry, the first iteration is
+// peeled so the test folds to a constant in both copies. Small bodies are
+// then unrolled: a main loop runs `factor` iterations per test while
+// i + (factor - 1) * c stays within the bound, and the original loop runs
+// the rest. The main loop's bound is computed once, behind a guard that
+// keeps it from wrapping.
+struct LoopStats {
+    int unrolled, peeled;
+};
+
+class LoopOptimizer {
+private:
+    Program& prog;
+    FuncDef* fn;
+    int factor;
+    LoopStats& stats;
+
+    static const int MAX_UNROLLED_NODES = 256;
+
+    struct Counted {
+        int slot;
+        string name;
+        TokenType op;  // i <op> bound
+        const Node* bound;
+        int step;
+    };
+
+    static int size(const Node* n) {
+        int s = 1;
+        for (const Node* kid : n->kids) s += size(kid);
+        return s;
+    }
+
+    static bool assigns(const Node* n, int slot) {
+        if ((n->kind == NODE_ASSIGN || (n->kind == NODE_VAR && !n->kids.empty())) && n->slot == slot) return true;
+        if (n->kind == NODE_DECL) {
+            for (const Node* var : n->kids) {
+                if (var->slot == slot) return true;
+            }
+        }
+        for (const Node* kid : n->kids) {
+            if (assigns(kid, slot)) return true;
+        }
+        return false;
+    }
+
+    // A break or continue of this loop; nested loops keep their own.
+    static bool jumpsOut(const Node* n) {
+        if (n->kind == NODE_BREAK || n->kind == NODE_CONTINUE) return true;
+        if (n->kind == NODE_WHILE) return false;
+        for (const Node* kid : n->kids) {
+            if (jumpsOut(kid)) return true;
+        }
+        return false;
+    }
+
+    // Free of calls and traps, and reads nothing the loop assigns.
+    static bool invariant(const Node* n, const Node* loop) {
+        switch (n->kind) {
+            case NODE_NUM: return true;
+            case NODE_VAR: return !assigns(loop, n->slot);
+            case NODE_UNARY: return n->op != TOK_NOT && invariant(n->kids[0], loop);
+            case NODE_BINARY:
+                return (n->op == TOK_PLUS || n->op == TOK_MINUS || n->op == TOK_STAR) && invariant(n->kids[0], loop) &&
+                       invariant(n->kids[1], loop);
+            default: return false;
+        }
+    }
+
+    static bool match(const Node* loop, Counted& c) {
+        const Node *cond = loop->kids[0], *body = loop->kids[1];
+        if (cond->kind != NODE_BINARY || body->kind != NODE_BLOCK || body->kids.empty()) return false;
+        const Node* inc = body->kids.back();
+        if (inc->kind != NODE_ASSIGN) return false;
+        c.slot = inc->slot;
+        c.name = inc->name;
+        const Node* v = inc->kids[0];
+        if (v->kind != NODE_BINARY || (v->op != TOK_PLUS && v->op != TOK_MINUS)) return false;
+        const Node *a = v->kids[0], *b = v->kids[1];
+        if (v->op == TOK_PLUS && a->kind == NODE_NUM) swap(a, b);
+        if (a->kind != NODE_VAR || a->slot != c.slot || b->kind != NODE_NUM || b->value == INT_MIN) return false;
+        c.step = v->op == TOK_PLUS ? b->value : -b->value;
+
+        c.op = cond->op;
+        const Node* var = cond->kids[0];
+        c.bound = cond->kids[1];
+        if (c.bound->kind == NODE_VAR && c.bound->slot == c.slot) {
+            swap(var, c.bound);
+            c.op = swapComparison(c.op);
+        }
+        if (var->kind != NODE_VAR || var->slot != c.slot) return false;
+        bool up = c.op == TOK_LT || c.op == TOK_LE, down = c.op == TOK_GT || c.op == TOK_GE;
+        if (c.step == 0 || !(c.step > 0 ? up : down)) return false;
+        for (size_t k = 0; k + 1 < body->kids.size(); k++) {
+            if (assigns(body->kids[k], c.slot) || jumpsOut(body->kids[k])) return false;
+        }
+        return invariant(c.bound, loop);
+    }
+
+    // The constant the statement before the loop leaves in slot.
+    static bool entryValue(const Node* prev, int slot, int& value) {
+        if (!prev) return false;
+        if (prev->kind == NODE_ASSIGN && prev->slot == slot && prev->kids[0]->kind == NODE_NUM) {
+            value = prev->kids[0]->value;
+            return true;
+        }
+        if (prev->kind != NODE_DECL) return false;
+        for (const Node* var : prev->kids) {
+            if (var->slot != slot) continue;
+            if (!var->kids.empty() && var->kids[0]->kind != NODE_NUM) return false;
+            value = var->kids.empty() ? 0 : var->kids[0]->value;
+            return true;
+        }
+        return false;
+    }
+
+    // True when i never comes back to its entry value: every increment
+    // stays in range while the condition holds.
+    static bool noWrap(const Counted& c) {
+        bool strict = c.op == TOK_LT || c.op == TOK_GT;
+        if (c.bound->kind != NODE_NUM) return strict && (c.step == 1 || c.step == -1);
+        int64_t last = (int64_t)c.bound->value + (strict ? (c.step > 0 ? -1 : 1) : 0);
+        int64_t next = last + c.step;
+        return next >= INT_MIN && next <= INT_MAX;
+    }
+
+    static bool isTest(const Node* n, int slot, int value) {
+        if (n->kind != NODE_BINARY || (n->op != TOK_EQ && n->op != TOK_NE)) return false;
+        const Node *a = n->kids[0], *b = n->kids[1];
+        if (a->kind == NODE_NUM) swap(a, b);
+        return a->kind == NODE_VAR && a->slot == slot && b->kind == NODE_NUM && b->value == value;
+    }
+
+    static bool tests(const Node* n, int slot, int value) {
+        if (isTest(n, slot, value)) return true;
+        for (const Node* kid : n->kids) {
+            if (tests(kid, slot, value)) return true;
+        }
+        return false;
+    }
+
+    // Replaces the tests of i against value by their outcome when i ==
+    // value holds (first) or never does, and drops the dead arms of ifs
+    // whose condition became constant.
+    Node* fold(Node* n, int slot, int value, bool first) {
+        if (isTest(n, slot, value)) return num((n->op == TOK_EQ) == first, n->line);
+        for (Node*& kid : n->kids) kid = fold(kid, slot, value, first);
+        if (n->kind == NODE_IF && n->kids[0]->kind == NODE_NUM) {
+            if (n->kids[0]->value) return n->kids[1];
+            return n->kids.size() > 2 ? n->kids[2] : prog.newNode(NODE_EMPTY, n->line);
+        }
+        return n;
+    }
+
+    Node* clone(const Node* n) {
+        Node* c = prog.newNode(n->kind, n->line);
+        c->op = n->op;
+        c->value = n->value;
+        c->name = n->name;
+        c->slot = n->slot;
+        c->callee = n->callee;
+        for (const Node* kid : n->kids) c->kids.push_back(clone(kid));
+        return c;
+    }
+
+    Node* num(int value, int line) {
+        Node* n = prog.newNode(NODE_NUM, line);
+        n->value = value;
+        return n;
+    }
+
+    Node* var(int slot, const string& name, int line) {
+        Node* n = prog.newNode(NODE_VAR, line);
+        n->slot = slot;
+        n->name = name;
+        return n;
+    }
+
+    Node* node(NodeKind kind, TokenType op, Node* a, Node* b, int line) {
+        Node* n = prog.newNode(kind, line);
+        n->op = op;
+        n->kids.push_back(a);
+        if (b) n->kids.push_back(b);
+        return n;
+    }
+
+    // The loop running `factor` iterations per test, or null when its
+    // bound would not fit.
+    Node* unrolled(const Counted& c, const Node* body, int line) {
+        int64_t k = (int64_t)(factor - 1) * (c.step > 0 ? c.step : -(int64_t)c.step);
+        if (factor < 2 || k > INT_MAX / 2 || size(body) * factor > MAX_UNROLLED_NODES) return nullptr;
+        Node* block = prog.newNode(NODE_BLOCK, line);
+        for (int u = 0; u < factor; u++) {
+            for (const Node* stmt : body->kids) block->kids.push_back(clone(stmt));
+        }
+        bool up = c.step > 0;
+        if (c.bound->kind == NODE_NUM) {
+            int64_t limit = (int64_t)c.bound->value + (up ? -k : k);
+            if (limit < INT_MIN || limit > INT_MAX) return nullptr;
+            return node(NODE_WHILE, TOK_EOF, node(NODE_BINARY, c.op, var(c.slot, c.name, line), num((int)limit, line), line),
+                        block, line);
+        }
+        // if (n >= INT_MIN + k) { int limit = n - k; while (i < limit) ... }
+        int slot = fn->frameSize++;
+        Node* limit = var(slot, "limit", line);
+        limit->kids.push_back(node(NODE_BINARY, up ? TOK_MINUS : TOK_PLUS, clone(c.bound), num((int)k, line), line));
+        Node* decl = prog.newNode(NODE_DECL, line);
+        decl->kids.push_back(limit);
+        Node* loop = node(NODE_WHILE, TOK_EOF, node(NODE_BINARY, c.op, var(c.slot, c.name, line), var(slot, "limit", line), line),
+                          block, line);
+        Node* guarded = node(NODE_BLOCK, TOK_EOF, decl, loop, line);
+        Node* guard = up ? node(NODE_BINARY, TOK_GE, clone(c.bound), num(INT_MIN + (int)k, line), line)
+                         : node(NODE_BINARY, TOK_LE, clone(c.bound), num(INT_MAX - (int)k, line), line);
+        return node(NODE_IF, TOK_EOF, guard, guarded, line);
+    }
+
+    Node* optimize(Node* loop, const Node* prev) {
+        Counted c;
+        if (!match(loop, c)) return loop;
+        Node* out = prog.newNode(NODE_BLOCK, loop->line);
+        int value;
+        if (entryValue(prev, c.slot, value) && noWrap(c) && tests(loop->kids[1], c.slot, value)) {
+            Node* first = fold(clone(loop->kids[1]), c.slot, value, true);
+            out->kids.push_back(node(NODE_IF, TOK_EOF, clone(loop->kids[0]), first, loop->line));
+            loop->kids[1] = fold(loop->kids[1], c.slot, value, false);
+            stats.peeled++;
+        }
+        Node* main = unrolled(c, loop->kids[1], loop->line);
+        if (main) {
+            out->kids.push_back(main);
+            stats.unrolled++;
+        }
+        if (out->kids.empty()) return loop;
+        out->kids.push_back(loop);
+        return out;
+    }
+
+    void visit(Node*& n, const Node* prev) {
+        if (n->kind == NODE_BLOCK) {
+            for (size_t k = 0; k < n->kids.size(); k++) visit(n->kids[k], k ? n->kids[k - 1] : nullptr);
+            return;
+        }
+        for (Node*& kid : n->kids) visit(kid, nullptr);
+        if (n->kind == NODE_WHILE) n = optimize(n, prev);
+    }
+
+public:
+    LoopOptimizer(Program& p, int f, LoopStats& s) : prog(p), fn(nullptr), factor(f), stats(s) {}
+
+    void run() {
+        for (auto& f : prog.funcs) {
+            fn = &f;
+            visit(f.body, nullptr);
+        }
+    }
+};
+
+// Runtime failure of a ToyC program, such as division by zero.
+struct RuntimeError {
+    string message;
+};
+
+// ToyC integers are 32-bit two's complement and wrap on overflow.
+inline int wrapAdd(int a, int b) { return (int)((unsigned)a + (unsigned)b); }
+inline int wrapSub(int a, int b) { return (int)((unsigned)a - (unsigned)b); }
+inline int wrapMul(int a, int b) { return (int)((unsigned)a * (unsigned)b); }
+inline int wrapNeg(int a) { return (int)(0u - (unsigned)a); }
+
+inline int checkedDiv(int a, int b) {
+    if (b == 0) throw RuntimeError{"division by zero"};
+    if (b == -1) return wrapNeg(a);
+    return a / b;
+}
+
+inline int checkedMod(int a, int b) {
+    if (b == 0) throw RuntimeError{"division by zero"};
+    if (b == -1) return 0;
+    return a % b;
+}
+
+// Every non-short-circuit binary operator.
+inline int applyBinary(TokenType op, int a, int b) {
+    switch (op) {
+        case TOK_PLUS: return wrapAdd(a, b);
+        case TOK_MINUS: return wrapSub(a, b);
+        case TOK_STAR: return wrapMul(a, b);
+        case TOK_DIV: return checkedDiv(a, b);
+        case TOK_MOD: return checkedMod(a, b);
+        case TOK_LT: return a < b;
+        case TOK_LE: return a <= b;
+        case TOK_GT: return a > b;
+        case TOK_GE: return a >= b;
+        case TOK_EQ: return a == b;
+        default: return a != b;
+    }
+}
+
+struct ExecLimits {
+    int maxDepth;
+    // Instruction budget; only the bytecode VM enforces it.
+    uint64_t maxSteps;
+};
+
+enum Flow { FLOW_NORMAL, FLOW_BREAK, FLOW_CONTINUE, FLOW_RETURN };
+
+// Reference engine: walks the resolved AST directly.
+class TreeWalker {
+private:
+    const Program& prog;
+    ExecLimits limits;
+    int depth;
+
+    int eval(const Node* n, int* frame) {
+        switch (n->kind) {
+            case NODE_NUM: return n->value;
+            case NODE_VAR: return frame[n->slot];
+            case NODE_CALL: {
+                int args[16];
+                vector<int> more;
+                int* argv = args;
+                if (n->kids.size() > 16) {
+                    more.resize(n->kids.size());
+                    argv = more.data();
+                }
+                for (size_t i = 0; i < n->kids.size(); i++) argv[i] = eval(n->kids[i], frame);
+                return call(n->callee, argv);
+            }
+            case NODE_UNARY: {
+                int v = eval(n->kids[0], frame);
+                if (n->op == TOK_MINUS) return wrapNeg(v);
+                if (n->op == TOK_NOT) return !v;
+                return v;
+            }
+            case NODE_BINARY:
+                if (n->op == TOK_AND) return eval(n->kids[0], frame) && eval(n->kids[1], frame);
+                if (n->op == TOK_OR) return eval(n->kids[0], frame) || eval(n->kids[1], frame);
+                return applyBinary(n->op, eval(n->kids[0], frame), eval(n->kids[1], frame));
+            default:
+                return 0;
+        }
+    }
+
+    Flow exec(const Node* n, int* frame, int& ret) {
+        switch (n->kind) {
+            case NODE_DECL:
+                for (const Node* var : n->kids) {
+                    frame[var->slot] = var->kids.empty() ? 0 : eval(var->kids[0], frame);
+                }
+                return FLOW_NORMAL;
+            case NODE_ASSIGN:
+                frame[n->slot] = eval(n->kids[0], frame);
+                return FLOW_NORMAL;
+            case NODE_EXPR:
+                eval(n->kids[0], frame);
+                return FLOW_NORMAL;
+            case NODE_IF:
+                if (eval(n->kids[0], frame)) return exec(n->kids[1], frame, ret);
+                if (n->kids.size() > 2) return exec(n->kids[2], frame, ret);
+                return FLOW_NORMAL;
+            case NODE_WHILE:
+                while (eval(n->kids[0], frame)) {
+                    Flow flow = exec(n->kids[1], frame, ret);
+                    if (flow == FLOW_BREAK) break;
+                    if (flow == FLOW_RETURN) return flow;
+                }
+                return FLOW_NORMAL;
+            case NODE_BREAK: return FLOW_BREAK;
+            case NODE_CONTINUE: return FLOW_CONTINUE;
+            case NODE_RETURN:
+                ret = n->kids.empty() ? 0 : eval(n->kids[0], frame);
+                return FLOW_RETURN;
+            case NODE_BLOCK:
+                for (const Node* kid : n->kids) {
+                    Flow flow = exec(kid, frame, ret);
+                    if (flow != FLOW_NORMAL) return flow;
+                }
+                return FLOW_NORMAL;
+            default:
+                return FLOW_NORMAL;
+        }
+    }
+
+public:
+    TreeWalker(const Program& p, const ExecLimits& l) : prog(p), limits(l), depth(0) {}
+
+    int call(int f, const int* args) {
+        const FuncDef& fn = prog.funcs[f];
+        if (++depth > limits.maxDepth) throw RuntimeError{"stack overflow"};
+        vector<int> frame(max(fn.frameSize, 1));
+        copy(args, args + fn.params.size(), frame.begin());
+        int ret = 0;
+        exec(fn.body, frame.data(), ret);
+        depth--;
+        return ret;
+    }
+};
+
+// Closure-compilation engine: every function body is turned once into a tree
+// of pre-bound function objects. Operator choice, frame slots, constants and
+// call targets are fixed when the closures are built, so running them never
+// looks at node kinds again.
+class ClosureEngine {
+private:
+    typedef function<int(int*)> ExprFn;
+    typedef function<Flow(int*, int&)> StmtFn;
+
+    struct Compiled {
+        int arity;
+        int frameSize;
+        StmtFn body;
+    };
+
+    const Program& prog;
+    ExecLimits limits;
+    int depth;
+    vector<Compiled> funcs;
+
+    struct OpAdd { static int apply(int a, int b) { return wrapAdd(a, b); } };
+    struct OpSub { static int apply(int a, int b) { return wrapSub(a, b); } };
+    struct OpMul { static int apply(int a, int b) { return wrapMul(a, b); } };
+    struct OpDiv { static int apply(int a, int b) { return checkedDiv(a, b); } };
+    struct OpMod { static int apply(int a, int b) { return checkedMod(a, b); } };
+    struct OpLt { static int apply(int a, int b) { return a < b; } };
+    struct OpLe { static int apply(int a, int b) { return a <= b; } };
+    struct OpGt { static int apply(int a, int b) { return a > b; } };
+    struct OpGe { static int apply(int a, int b) { return a >= b; } };
+    struct OpEq { static int apply(int a, int b) { return a == b; } };
+    struct OpNe { static int apply(int a, int b) { return a != b; } };
+
+    // Slot/constant operand shapes get their own closures so the common
+    // "i < n" and "i + 1" never go through a nested call.
+    template <class Op>
+    ExprFn binary(const Node* l, const Node* r) {
+        if (l->kind == NODE_VAR && r->kind == NODE_NUM) {
+            int s = l->slot, c = r->value;
+            return [s, c](int* f) { return Op::apply(f[s], c); };
+        }
+        if (l->kind == NODE_VAR && r->kind == NODE_VAR) {
+            int a = l->slot, b = r->slot;
+            return [a, b](int* f) { return Op::apply(f[a], f[b]); };
+        }
+        ExprFn a = compileExpr(l), b = compileExpr(r);
+        return [a, b](int* f) { return Op::apply(a(f), b(f)); };
+    }
+
+    ExprFn compileExpr(const Node* n) {
+        switch (n->kind) {
+            case NODE_NUM: {
+                int v = n->value;
+                return [v](int*) { return v; };
+            }
+            case NODE_VAR: {
+                int s = n->slot;
+                return [s](int* f) { return f[s]; };
+            }
+            case NODE_CALL: {
+                vector<ExprFn> args;
+                for (const Node* kid : n->kids) args.push_back(compileExpr(kid));
+                int callee = n->callee;
+                ClosureEngine* self = this;
+                return [self, callee, args](int* f) {
+                    int buf[16];
+                    vector<int> more;
+                    int* argv = buf;
+                    if (args.size() > 16) {
+                        more.resize(args.size());
+                        argv = more.data();
+                    }
+                    for (size_t i = 0; i < args.size(); i++) argv[i] = args[i](f);
+                    return self->call(callee, argv);
+                };
+            }
+            case NODE_UNARY: {
+                ExprFn v = compileExpr(n->kids[0]);
+                if (n->op == TOK_MINUS) return [v](int* f) { return wrapNeg(v(f)); };
+                if (n->op == TOK_NOT) return [v](int* f) { return (int)!v(f); };
+                return v;
+            }
+            case NODE_BINARY: {
+                const Node* l = n->kids[0];
+                const Node* r = n->kids[1];
+                switch (n->op) {
+                    case TOK_AND: {
+                        ExprFn a = compileExpr(l), b = compileExpr(r);
+                        return [a, b](int* f) { return (int)(a(f) && b(f)); };
+                    }
+                    case TOK_OR: {
+                        ExprFn a = compileExpr(l), b = compileExpr(r);
+                        return [a, b](int* f) { return (int)(a(f) || b(f)); };
+                    }
+                    case TOK_PLUS: return binary<OpAdd>(l, r);
+                    case TOK_MINUS: return binary<OpSub>(l, r);
+                    case TOK_STAR: return binary<OpMul>(l, r);
+                    case TOK_DIV: return binary<OpDiv>(l, r);
+                    case TOK_MOD: return binary<OpMod>(l, r);
+                    case TOK_LT: return binary<OpLt>(l, r);
+                    case TOK_LE: return binary<OpLe>(l, r);
+                    case TOK_GT: return binary<OpGt>(l, r);
+                    case TOK_GE: return binary<OpGe>(l, r);
+                    case TOK_EQ: return binary<OpEq>(l, r);
+                    default: return binary<OpNe>(l, r);
+                }
+            }
+            default:
+                return [](int*) { return 0; };
+        }
+    }
+
+    StmtFn compileStmt(const Node* n) {
+        switch (n->kind) {
+            case NODE_DECL: {
+                vector<StmtFn> parts;
+                for (const Node* var : n->kids) {
+                    int s = var->slot;
+                    if (var->kids.empty()) {
+                        parts.push_back([s](int* f, int&) { f[s] = 0; return FLOW_NORMAL; });
+                    } else {
+                        ExprFn init = compileExpr(var->kids[0]);
+                        parts.push_back([s, init](int* f, int&) { f[s] = init(f); return FLOW_NORMAL; });
+                    }
+                }
+                if (parts.size() == 1) return parts[0];
+                return [parts](int* f, int& ret) {
+                    for (const auto& p : parts) p(f, ret);
+                    return FLOW_NORMAL;
+                };
+            }
+            case NODE_ASSIGN: {
+                int s = n->slot;
+                const Node* v = n->kids[0];
+                // i = i + c, the loop counter update.
+                if (v->kind == NODE_BINARY && v->op == TOK_PLUS && v->kids[0]->kind == NODE_VAR &&
+                    v->kids[0]->slot == s && v->kids[1]->kind == NODE_NUM) {
+                    int c = v->kids[1]->value;
+                    return [s, c](int* f, int&) { f[s] = wrapAdd(f[s], c); return FLOW_NORMAL; };
+                }
+                ExprFn value = compileExpr(v);
+                return [s, value](int* f, int&) { f[s] = value(f); return FLOW_NORMAL; };
+            }
+            case NODE_EXPR: {
+                ExprFn e = compileExpr(n->kids[0]);
+                return [e](int* f, int&) { e(f); return FLOW_NORMAL; };
+            }
+            case NODE_IF: {
+                ExprFn cond = compileExpr(n->kids[0]);
+                StmtFn then = compileStmt(n->kids[1]);
+                if (n->kids.size() < 3) {
+                    return [cond, then](int* f, int& ret) { return cond(f) ? then(f, ret) : FLOW_NORMAL; };
+                }
+                StmtFn els = compileStmt(n->kids[2]);
+                return [cond, then, els](int* f, int& ret) { return cond(f) ? then(f, ret) : els(f, ret); };
+            }
+            case NODE_WHILE: {
+                ExprFn cond = compileExpr(n->kids[0]);
+                StmtFn body = compileStmt(n->kids[1]);
+                return [cond, body](int* f, int& ret) {
+                    while (cond(f)) {
+                        Flow flow = body(f, ret);
+                        if (flow == FLOW_BREAK) break;
+                        if (flow == FLOW_RETURN) return flow;
+                    }
+                    return FLOW_NORMAL;
+                };
+            }
+            case NODE_BREAK: return [](int*, int&) { return FLOW_BREAK; };
+            case NODE_CONTINUE: return [](int*, int&) { return FLOW_CONTINUE; };
+            case NODE_RETURN: {
+                if (n->kids.empty()) return [](int*, int& ret) { ret = 0; return FLOW_RETURN; };
+                ExprFn v = compileExpr(n->kids[0]);
+                return [v](int* f, int& ret) { ret = v(f); return FLOW_RETURN; };
+            }
+            case NODE_BLOCK: {
+                vector<StmtFn> stmts;
+                for (const Node* kid : n->kids) {
+                    if (kid->kind != NODE_EMPTY) stmts.push_back(compileStmt(kid));
+                }
+                if (stmts.size() == 1) return stmts[0];
+                return [stmts](int* f, int& ret) {
+                    for (const auto& s : stmts) {
+                        Flow flow = s(f, ret);
+                        if (flow != FLOW_NORMAL) return flow;
+                    }
+                    return FLOW_NORMAL;
+                };
+            }
+            default:
+                return [](int*, int&) { return FLOW_NORMAL; };
+        }
+    }
+
+public:
+    ClosureEngine(const Program& p, const ExecLimits& l) : prog(p), limits(l), depth(0) {
+        for (const auto& f : prog.funcs) {
+            Compiled c;
+            c.arity = (int)f.params.size();
+            c.frameSize = max(f.frameSize, 1);
+            c.body = compileStmt(f.body);
+            funcs.push_back(c);
+        }
+    }
+
+    int call(int f, const int* args) {
+        const Compiled& fn = funcs[f];
+        if (++depth > limits.maxDepth) throw RuntimeError{"stack overflow"};
+        // Locals start at zero, as in the other engines, even when their
+        // declaration is skipped.
+        int local[32];
+        vector<int> heap;
+        int* frame = local;
+        if (fn.frameSize > 32) {
+            heap.resize(fn.frameSize);
+            frame = heap.data();
+        } else {
+            fill(local + fn.arity, local + fn.frameSize, 0);
+        }
+        copy(args, args + fn.arity, frame);
+        int ret = 0;
+        fn.body(frame, ret);
+        depth--;
+        return ret;
+    }
+};
+
+// Bytecode for the stack VM. Every instruction has the same fixed-size
+// layout so a module is two flat arrays that can be copied or mapped as is.
+enum Opcode {
+    OP_CONST,       // push a
+    OP_LOAD,        // push frame[a]
+    OP_STORE,       // frame[a] = pop
+    OP_POP,
+    OP_NEG,
+    OP_NOT,
+    OP_ARITH,       // generic binary operator a (a TokenType); quickened on first use
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD,
+    OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE,
+    OP_JUMP,        // goto a
+    OP_JZ,          // if pop == 0 goto a
+    OP_LOOP,        // loop back-edge: goto a after checking the step budget
+    OP_CALL,        // call function a with b arguments on the stack
+    OP_RET,         // return pop
+
+    // Superinstructions, fused by fuseSuperinstructions().
+    OP_INC,         // frame[a] += b
+    OP_ADD_LC,      // push frame[a] + b
+    OP_ADD_LL,      // push frame[a] + frame[b]
+    OP_LT_LC_JZ, OP_LE_LC_JZ, OP_GT_LC_JZ, OP_GE_LC_JZ, OP_EQ_LC_JZ, OP_NE_LC_JZ,
+                    // unless frame[a] <op> b, goto c
+    OP_LT_LL_JZ, OP_LE_LL_JZ, OP_GT_LL_JZ, OP_GE_LL_JZ, OP_EQ_LL_JZ, OP_NE_LL_JZ,
+                    // unless frame[a] <op> frame[b], goto c
+    OP_LT_JZ, OP_LE_JZ, OP_GT_JZ, OP_GE_JZ, OP_EQ_JZ, OP_NE_JZ,
+                    // pop y, pop x; unless x <op> y, goto a
+
+    OP_CALL_MEMO,   // OP_CALL through the callee's memo table
+    OP_FORK_TEST,   // goto a unless forking is allowed at this depth
+    OP_FORK,        // call a and b on their arguments in parallel, push both results
+    OP_COUNT
+};
+
+struct Insn {
+    int32_t op;
+    int32_t a, b, c;
+};
+
+struct BcFunc {
+    int32_t entry;
+    int32_t arity;
+    int32_t frameSize;
+    int32_t maxStack;
+};
+
+// Code and function table a VM runs; several VMs may share one image.
+struct BcImage {
+    Insn* code;
+    const BcFunc* funcs;
+    int funcCount;
+};
+
+struct BcModule {
+    vector<Insn> code;
+    vector<BcFunc> funcs;
+    vector<string> names;
+    int mainFunc;
+
+    BcImage image() {
+        BcImage img = { code.data(), funcs.data(), (int)funcs.size() };
+        return img;
+    }
+};
+
+// Opcode of the specialized form of a comparison, counted from OP_LT.
+int comparisonIndex(TokenType op) {
+    switch (op) {
+        case TOK_LT: return 0;
+        case TOK_LE: return 1;
+        case TOK_GT: return 2;
+        case TOK_GE: return 3;
+        case TOK_EQ: return 4;
+        case TOK_NE: return 5;
+        default: return -1;
+    }
+}
+
+int specializedArith(TokenType op) {
+    switch (op) {
+        case TOK_PLUS: return OP_ADD;
+        case TOK_MINUS: return OP_SUB;
+        case TOK_STAR: return OP_MUL;
+        case TOK_DIV: return OP_DIV;
+        case TOK_MOD: return OP_MOD;
+        default: return OP_LT + comparisonIndex(op);
+    }
+}
+
+class BytecodeCompiler {
+private:
+    const Program& prog;
+    BcModule& mod;
+    const vector<bool>* forkable;
+    int depth, maxDepth;
+
+    struct Loop {
+        int start;
+        vector<int> breaks;
+    };
+    vector<Loop> loops;
+
+    int emit(int op, int a = 0, int b = 0, int c = 0) {
+        Insn in = { op, a, b, c };
+        mod.code.push_back(in);
+        return (int)mod.code.size() - 1;
+    }
+
+    void push(int n = 1) {
+        depth += n;
+        maxDepth = max(maxDepth, depth);
+    }
+
+    int here() { return (int)mod.code.size(); }
+
+    bool forks(const Node* n) const {
+        if (!forkable) return false;
+        for (const Node* kid : n->kids) {
+            if (kid->kind != NODE_CALL || !(*forkable)[kid->callee]) return false;
+        }
+        return true;
+    }
+
+    void expr(const Node* n) {
+        switch (n->kind) {
+            case NODE_NUM:
+                emit(OP_CONST, n->value);
+                push();
+                break;
+            case NODE_VAR:
+                emit(OP_LOAD, n->slot);
+                push();
+                break;
+            case NODE_CALL:
+                for (const Node* kid : n->kids) expr(kid);
+                emit(OP_CALL, n->callee, (int)n->kids.size());
+                depth -= (int)n->kids.size();
+                push();
+                break;
+            case NODE_UNARY:
+                expr(n->kids[0]);
+                if (n->op == TOK_MINUS) emit(OP_NEG);
+                else if (n->op == TOK_NOT) emit(OP_NOT);
+                break;
+            case NODE_BINARY:
+                if (n->op == TOK_AND || n->op == TOK_OR) {
+                    // a && b: both must be nonzero; a || b: either is.
+                    bool isAnd = n->op == TOK_AND;
+                    expr(n->kids[0]);
+                    emit(OP_NOT);
+                    if (isAnd) emit(OP_NOT);
+                    int first = emit(OP_JZ);
+                    depth--;
+                    expr(n->kids[1]);
+                    emit(OP_NOT);
+                    if (isAnd) emit(OP_NOT);
+                    int second = emit(OP_JZ);
+                    depth--;
+                    emit(OP_CONST, isAnd ? 1 : 0);
+                    int skip = emit(OP_JUMP);
+                    mod.code[first].a = mod.code[second].a = here();
+                    emit(OP_CONST, isAnd ? 0 : 1);
+                    mod.code[skip].a = here();
+                    push();
+                    break;
+                }
+                if (forks(n)) {
+                    // Both operands are calls to pure functions: a parallel
+                    // path guarded by OP_FORK_TEST, then the sequential one.
+                    int test = emit(OP_FORK_TEST);
+                    int before = depth;
+                    for (const Node* call : n->kids) {
+                        for (const Node* arg : call->kids) expr(arg);
+                    }
+                    emit(OP_FORK, n->kids[0]->callee, n->kids[1]->callee);
+                    depth = before;
+                    push(2);
+                    int join = emit(OP_JUMP);
+                    mod.code[test].a = here();
+                    depth = before;
+                    expr(n->kids[0]);
+                    expr(n->kids[1]);
+                    mod.code[join].a = here();
+                } else {
+                    expr(n->kids[0]);
+                    expr(n->kids[1]);
+                }
+                emit(OP_ARITH, n->op);
+                depth--;
+                break;
+            default:
+                break;
+        }
+    }
+
+    void stmt(const Node* n) {
+        switch (n->kind) {
+            case NODE_DECL:
+                for (const Node* var : n->kids) {
+                    if (var->kids.empty()) {
+                        emit(OP_CONST, 0);
+                        push();
+                    } else {
+                        expr(var->kids[0]);
+                    }
+                    emit(OP_STORE, var->slot);
+                    depth--;
+                }
+                break;
+            case NODE_ASSIGN:
+                expr(n->kids[0]);
+                emit(OP_STORE, n->slot);
+                depth--;
+                break;
+            case NODE_EXPR:
+                expr(n->kids[0]);
+                emit(OP_POP);
+                depth--;
+                break;
+            case NODE_IF: {
+                expr(n->kids[0]);
+                int skipThen = emit(OP_JZ);
+                depth--;
+                stmt(n->kids[1]);
+                if (n->kids.size() > 2) {
+                    int skipElse = emit(OP_JUMP);
+                    mod.code[skipThen].a = here();
+                    stmt(n->kids[2]);
+                    mod.code[skipElse].a = here();
+                } else {
+                    mod.code[skipThen].a = here();
+                }
+                break;
+            }
+            case NODE_WHILE: {
+                Loop loop;
+                loop.start = here();
+                expr(n->kids[0]);
+                loop.breaks.push_back(emit(OP_JZ));
+                depth--;
+                loops.push_back(loop);
+                stmt(n->kids[1]);
+                emit(OP_LOOP, loops.back().start);
+                for (int at : loops.back().breaks) mod.code[at].a = here();
+                loops.pop_back();
+                break;
+            }
+            case NODE_BREAK:
+                loops.back().breaks.push_back(emit(OP_JUMP));
+                break;
+            case NODE_CONTINUE:
+                emit(OP_LOOP, loops.back().start);
+                break;
+            case NODE_RETURN:
+                if (n->kids.empty()) {
+                    emit(OP_CONST, 0);
+                    push();
+                } else {
+                    expr(n->kids[0]);
+                }
+                emit(OP_RET);
+                depth--;
+                break;
+            case NODE_BLOCK:
+                for (const Node* kid : n->kids) stmt(kid);
+                break;
+            default:
+                break;
+        }
+    }
+
+public:
+    BytecodeCompiler(const Program& p, BcModule& m, const vector<bool>* f = nullptr)
+        : prog(p), mod(m), forkable(f), depth(0), maxDepth(0) {}
+
+    void compile() {
+        mod.mainFunc = -1;
+        for (size_t i = 0; i < prog.funcs.size(); i++) {
+            const FuncDef& f = prog.funcs[i];
+            BcFunc bf;
+            bf.entry = here();
+            bf.arity = (int)f.params.size();
+            bf.frameSize = max(f.frameSize, 1);
+            depth = maxDepth = 0;
+            stmt(f.body);
+            emit(OP_CONST, 0);
+            emit(OP_RET);
+            bf.maxStack = max(maxDepth, 1);
+            mod.funcs.push_back(bf);
+            mod.names.push_back(f.name);
+            if (f.name == "main") mod.mainFunc = (int)i;
+        }
+    }
+};
+
+bool isBranch(int op) {
+    return op == OP_JUMP || op == OP_JZ || op == OP_LOOP || op == OP_FORK_TEST || (op >= OP_LT_JZ && op <= OP_NE_JZ);
+}
+
+bool isFusedCompareBranch(int op) {
+    return op >= OP_LT_LC_JZ && op <= OP_NE_LL_JZ;
+}
+
+// Superinstruction selection, guided by --ngrams over bench/ (top static
+// n-grams: LOAD CONST ARITH 23, CONST ARITH JZ 12, LOAD CONST ARITH JZ 10,
+// LOAD CONST ARITH STORE 9):
+//   LOAD CONST|LOAD ARITH(cmp) JZ  -> <cmp>_LC_JZ / <cmp>_LL_JZ
+//   LOAD CONST ARITH(+/-) STORE    -> INC when the slots match
+//   LOAD CONST ARITH(+/-)          -> ADD_LC
+//   LOAD LOAD ARITH(+)             -> ADD_LL
+//   ARITH(cmp) JZ                  -> <cmp>_JZ
+// A window never spans a jump target other than its first instruction.
+void fuseSuperinstructions(BcModule& mod) {
+    const vector<Insn>& in = mod.code;
+    vector<bool> target(in.size() + 1, false);
+    for (const auto& insn : in) {
+        if (isBranch(insn.op)) target[insn.a] = true;
+    }
+    for (const auto& f : mod.funcs) target[f.entry] = true;
+
+    vector<Insn> out;
+    vector<int> remap(in.size() + 1, 0);
+    auto free = [&](size_t from, size_t n) {
+        if (from + n > in.size()) return false;
+        for (size_t k = 1; k < n; k++) {
+            if (target[from + k]) return false;
+        }
+        return true;
+    };
+    for (size_t i = 0; i < in.size();) {
+        remap[i] = (int)out.size();
+        const Insn& x = in[i];
+        if (free(i, 4) && x.op == OP_LOAD && (in[i + 1].op == OP_CONST || in[i + 1].op == OP_LOAD) &&
+            in[i + 2].op == OP_ARITH && comparisonIndex((TokenType)in[i + 2].a) >= 0 && in[i + 3].op == OP_JZ) {
+            int base = in[i + 1].op == OP_CONST ? OP_LT_LC_JZ : OP_LT_LL_JZ;
+            Insn f = { base + comparisonIndex((TokenType)in[i + 2].a), x.a, in[i + 1].a, in[i + 3].a };
+            out.push_back(f);
+            i += 4;
+        } else if (free(i, 4) && x.op == OP_LOAD && in[i + 1].op == OP_CONST && in[i + 2].op == OP_ARITH &&
+                   (in[i + 2].a == TOK_PLUS || in[i + 2].a == TOK_MINUS) &&
+                   in[i + 3].op == OP_STORE && in[i + 3].a == x.a) {
+            int c = in[i + 2].a == TOK_PLUS ? in[i + 1].a : wrapNeg(in[i + 1].a);
+            Insn f = { OP_INC, x.a, c, 0 };
+            out.push_back(f);
+            i += 4;
+        } else if (free(i, 3) && x.op == OP_LOAD && in[i + 1].op == OP_CONST && in[i + 2].op == OP_ARITH &&
+                   (in[i + 2].a == TOK_PLUS || in[i + 2].a == TOK_MINUS)) {
+            int c = in[i + 2].a == TOK_PLUS ? in[i + 1].a : wrapNeg(in[i + 1].a);
+            Insn f = { OP_ADD_LC, x.a, c, 0 };
+            out.push_back(f);
+            i += 3;
+        } else if (free(i, 3) && x.op == OP_LOAD && in[i + 1].op == OP_LOAD && in[i + 2].op == OP_ARITH &&
+                   in[i + 2].a == TOK_PLUS) {
+            Insn f = { OP_ADD_LL, x.a, in[i + 1].a, 0 };
+            out.push_back(f);
+            i += 3;
+        } else if (free(i, 2) && x.op == OP_ARITH && comparisonIndex((TokenType)x.a) >= 0 &&
+                   in[i + 1].op == OP_JZ) {
+            Insn f = { OP_LT_JZ + comparisonIndex((TokenType)x.a), in[i + 1].a, 0, 0 };
+            out.push_back(f);
+            i += 2;
+        } else {
+            out.push_back(x);
+            i++;
+        }
+    }
+    remap[in.size()] = (int)out.size();
+    for (auto& insn : out) {
+        if (isBranch(insn.op)) insn.a = remap[insn.a];
+        else if (isFusedCompareBranch(insn.op)) insn.c = remap[insn.c];
+    }
+    for (auto& f : mod.funcs) f.entry = remap[f.entry];
+    mod.code.swap(out);
+}
+
+const char* opcodeName(int op) {
+    static const char* names[] = {
+        "CONST", "LOAD", "STORE", "POP", "NEG", "NOT", "ARITH",
+        "ADD", "SUB", "MUL", "DIV", "MOD", "LT", "LE", "GT", "GE", "EQ", "NE",
+        "JUMP", "JZ", "LOOP", "CALL", "RET",
+        "INC", "ADD_LC", "ADD_LL",
+        "LT_LC_JZ", "LE_LC_JZ", "GT_LC_JZ", "GE_LC_JZ", "EQ_LC_JZ", "NE_LC_JZ",
+        "LT_LL_JZ", "LE_LL_JZ", "GT_LL_JZ", "GE_LL_JZ", "EQ_LL_JZ", "NE_LL_JZ",
+        "LT_JZ", "LE_JZ", "GT_JZ", "GE_JZ", "EQ_JZ", "NE_JZ",
+        "CALL_MEMO", "FORK_TEST", "FORK",
+    };
+    return op >= 0 && op < OP_COUNT ? names[op] : "?";
+}
+
+// A function is pure when its result depends only on its arguments. ToyC
+// has no globals or pointers, so assignments only ever touch the caller's
+// own frame; impurity can only come from a call that does not resolve to a
+// function of the program, and spreads to every function that reaches one.
+vector<bool> analyzePurity(const Program& prog) {
+    vector<bool> pure(prog.funcs.size(), true);
+    vector<vector<int> > callees(prog.funcs.size());
+    for (size_t i = 0; i < prog.funcs.size(); i++) {
+        vector<const Node*> work(1, prog.funcs[i].body);
+        while (!work.empty()) {
+            const Node* n = work.back();
+            work.pop_back();
+            if (n->kind == NODE_CALL) {
+                if (n->callee < 0) pure[i] = false;
+                else callees[i].push_back(n->callee);
+            }
+            for (const Node* kid : n->kids) work.push_back(kid);
+        }
+    }
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = 0; i < prog.funcs.size(); i++) {
+            for (int c : callees[i]) {
+                if (pure[i] && !pure[c]) {
+                    pure[i] = false;
+                    changed = true;
+                }
+            }
+        }
+    }
+    return pure;
+}
+
+// Functions worth memoizing: pure ones that can reach themselves through
+// the call graph. Non-recursive functions are called a bounded number of
+// times per call of their caller, so a cache there is pure overhead.
+vector<bool> memoCandidates(const Program& prog) {
+    vector<bool> pure = analyzePurity(prog);
+    vector<bool> result(prog.funcs.size(), false);
+    for (size_t i = 0; i < prog.funcs.size(); i++) {
+        if (!pure[i] || prog.funcs[i].params.empty()) continue;
+        vector<bool> seen(prog.funcs.size(), false);
+        vector<const Node*> work(1, prog.funcs[i].body);
+        while (!work.empty() && !result[i]) {
+            const Node* n = work.back();
+            work.pop_back();
+            if (n->kind == NODE_CALL && n->callee >= 0) {
+                if (n->callee == (int)i) result[i] = true;
+                else if (!seen[n->callee]) {
+                    seen[n->callee] = true;
+                    work.push_back(prog.funcs[n->callee].body);
+                }
+            }
+            for (const Node* kid : n->kids) work.push_back(kid);
+        }
+    }
+    return result;
+}
+
+// Bounded open-addressing cache from argument tuples to results. An entry
+// is a filled flag, the arguments and the value. Lookups probe a few
+// consecutive entries; a store that finds them all taken evicts the home
+// entry, so the table never grows past its initial capacity. The lock is
+// only taken once runForkJoin marks the table shared between workers.
+class MemoTable {
+private:
+    static const int PROBES = 4;
+    int arity;
+    size_t mask;
+    vector<int32_t> cells;
+    mutex lock;
+
+    int32_t* entry(size_t i) { return &cells[(i & mask) * (arity + 2)]; }
+
+    size_t home(const int* args) const {
+        uint64_t h = 14695981039346656037ULL;
+        for (int i = 0; i < arity; i++) {
+            h ^= (uint32_t)args[i];
+            h *= 1099511628211ULL;
+        }
+        return (size_t)(h ^ (h >> 32));
+    }
+
+public:
+    uint64_t hits, misses;
+    bool shared;
+
+    MemoTable(int a, size_t capacity)
+        : arity(a), mask(capacity - 1), cells(capacity * (a + 2), 0), hits(0), misses(0), shared(false) {}
+
+    bool find(const int* args, int& value) {
+        unique_lock<mutex> guard(lock, defer_lock);
+        if (shared) guard.lock();
+        size_t h = home(args);
+        for (int p = 0; p < PROBES; p++) {
+            const int32_t* e = entry(h + p);
+            if (!e[0]) break;
+            if (equal(args, args + arity, e + 1)) {
+                value = e[arity + 1];
+                hits++;
+                return true;
+            }
+        }
+        misses++;
+        return false;
+    }
+
+    void store(const int* args, int value) {
+        unique_lock<mutex> guard(lock, defer_lock);
+        if (shared) guard.lock();
+        size_t h = home(args);
+        int32_t* slot = entry(h);
+        for (int p = 0; p < PROBES; p++) {
+            int32_t* e = entry(h + p);
+            if (!e[0] || equal(args, args + arity, e + 1)) {
+                slot = e;
+                break;
+            }
+        }
+        slot[0] = 1;
+        copy(args, args + arity, slot + 1);
+        slot[arity + 1] = value;
+    }
+};
+
+const size_t MEMO_ENTRIES = 1 << 16;
+
+// One table per memoized function, null for the rest; calls to memoized
+// functions are rewritten to OP_CALL_MEMO.
+typedef vector<unique_ptr<MemoTable> > MemoTables;
+
+void enableMemoization(const Program& prog, BcModule& mod, MemoTables& tables) {
+    vector<bool> memoize = memoCandidates(prog);
+    tables.clear();
+    tables.resize(prog.funcs.size());
+    for (size_t i = 0; i < prog.funcs.size(); i++) {
+        if (memoize[i]) tables[i].reset(new MemoTable(mod.funcs[i].arity, MEMO_ENTRIES));
+    }
+    for (auto& insn : mod.code) {
+        if (insn.op == OP_CALL && tables[insn.a]) insn.op = OP_CALL_MEMO;
+    }
+}
+
+// A task of the fork-join scheduler: the right-hand call of a forked pair.
+struct ForkTask {
+    int func;
+    int depth;
+    vector<int> args;
+    int result;
+    string error;
+    atomic<bool> done;
+
+    ForkTask() : func(0), depth(0), result(0), done(false) {}
+};
+
+// Work-stealing queues, one per worker. The owner pushes and reclaims at
+// the back; idle or waiting workers steal the oldest task from the front
+// of someone else's queue, which is the one closest to the root and so
+// the biggest piece of work.
+class ForkScheduler {
+private:
+    struct Queue {
+        mutex lock;
+        deque<ForkTask*> tasks;
+    };
+    vector<unique_ptr<Queue> > queues;
+
+public:
+    int cutoff;
+    atomic<bool> stop;
+    atomic<uint64_t> forked, stolen;
+
+    ForkScheduler(int workers, int c) : cutoff(c), stop(false), forked(0), stolen(0) {
+        for (int i = 0; i < workers; i++) queues.emplace_back(new Queue);
+    }
+
+    int workers() const { return (int)queues.size(); }
+
+    void push(int w, ForkTask* t) {
+        lock_guard<mutex> guard(queues[w]->lock);
+        queues[w]->tasks.push_back(t);
+        forked++;
+    }
+
+    // Takes t back if no one has stolen it yet.
+    bool reclaim(int w, ForkTask* t) {
+        lock_guard<mutex> guard(queues[w]->lock);
+        if (queues[w]->tasks.empty() || queues[w]->tasks.back() != t) return false;
+        queues[w]->tasks.pop_back();
+        return true;
+    }
+
+    ForkTask* steal(int thief) {
+        for (int k = 1; k < workers(); k++) {
+            Queue& q = *queues[(thief + k) % workers()];
+            lock_guard<mutex> guard(q.lock);
+            if (!q.tasks.empty()) {
+                ForkTask* t = q.tasks.front();
+                q.tasks.pop_front();
+                stolen++;
+                return t;
+            }
+        }
+        return nullptr;
+    }
+};
+
+// Stack VM. Frames and operand stacks share one value stack: a call's
+// arguments become the first slots of the callee's frame. Generic OP_ARITH
+// instructions rewrite themselves into the specialized opcode the first
+// time they run, so the code array must be writable; images shared between
+// threads are quickened up front. The value stack is reserved once for the
+// worst case and committed lazily, so pointers into it stay valid while
+// execute() nests for forked calls.
+class VM {
+private:
+    Insn* code;
+    const BcFunc* funcs;
+    ExecLimits limits;
+    MemoTables* memo;
+    ForkScheduler* sched;
+    int worker;
+    int* stack;
+    int* stackEnd;
+    size_t stackBytes;
+    // First free slot above every suspended execute().
+    int* top;
+    // Call depth of the bottom record of the current execute().
+    int depthBase;
+
+    struct CallRecord {
+        const Insn* ret;
+        int* frame;
+        int memoFunc;
+    };
+    vector<CallRecord> calls;
+    // Arguments of memoized calls in flight; a parameter may be reassigned
+    // before the result is known.
+    vector<int> memoArgs;
+
+    // Runs f with its arguments already in frame[0..arity) and returns its
+    // result. Calls made from f push records above those already on calls.
+    int execute(int f, int* frame) {
+        const BcFunc* fn = &funcs[f];
+        fill(frame + fn->arity, frame + fn->frameSize, 0);
+        int* sp = frame + fn->frameSize;
+        const Insn* ip = code + fn->entry;
+        size_t entry = calls.size();
+        int memoFunc = -1;
+        uint64_t count = 0;
+        // Budget checks happen only at back-edges and calls, the only
+        // places a program can run for long without passing either.
+        uint64_t allowed = limits.maxSteps > dispatches ? limits.maxSteps - dispatches : 0;
+
+        try {
+            while (true) {
+                count++;
+                switch (ip->op) {
+                    case OP_CONST: *sp++ = ip->a; ip++; break;
+                    case OP_LOAD: *sp++ = frame[ip->a]; ip++; break;
+                    case OP_STORE: frame[ip->a] = *--sp; ip++; break;
+                    case OP_POP: sp--; ip++; break;
+                    case OP_NEG: sp[-1] = wrapNeg(sp[-1]); ip++; break;
+                    case OP_NOT: sp[-1] = !sp[-1]; ip++; break;
+                    case OP_ARITH:
+                        const_cast<Insn*>(ip)->op = specializedArith((TokenType)ip->a);
+                        break;
+                    case OP_ADD: sp--; sp[-1] = wrapAdd(sp[-1], sp[0]); ip++; break;
+                    case OP_SUB: sp--; sp[-1] = wrapSub(sp[-1], sp[0]); ip++; break;
+                    case OP_MUL: sp--; sp[-1] = wrapMul(sp[-1], sp[0]); ip++; break;
+                    case OP_DIV: sp--; sp[-1] = checkedDiv(sp[-1], sp[0]); ip++; break;
+                    case OP_MOD: sp--; sp[-1] = checkedMod(sp[-1], sp[0]); ip++; break;
+                    case OP_LT: sp--; sp[-1] = sp[-1] < sp[0]; ip++; break;
+                    case OP_LE: sp--; sp[-1] = sp[-1] <= sp[0]; ip++; break;
+                    case OP_GT: sp--; sp[-1] = sp[-1] > sp[0]; ip++; break;
+                    case OP_GE: sp--; sp[-1] = sp[-1] >= sp[0]; ip++; break;
+                    case OP_EQ: sp--; sp[-1] = sp[-1] == sp[0]; ip++; break;
+                    case OP_NE: sp--; sp[-1] = sp[-1] != sp[0]; ip++; break;
+                    case OP_JUMP: ip = code + ip->a; break;
+                    case OP_JZ: ip = *--sp ? ip + 1 : code + ip->a; break;
+                    case OP_LOOP:
+                        if (count > allowed) throw RuntimeError{"step limit exceeded"};
+                        ip = code + ip->a;
+                        break;
+                    case OP_CALL_MEMO: {
+                        int value;
+                        if ((*memo)[ip->a]->find(sp - ip->b, value)) {
+                            sp -= ip->b;
+                            *sp++ = value;
+                            ip++;
+                            break;
+                        }
+                        memoArgs.insert(memoArgs.end(), sp - ip->b, sp);
+                        memoFunc = ip->a;
+                    }
+                    // fall through
+                    case OP_CALL: {
+                        const BcFunc* callee = &funcs[ip->a];
+                        if (count > allowed) throw RuntimeError{"step limit exceeded"};
+                        int depth = depthBase + (int)calls.size();
+                        if (depth >= limits.maxDepth) throw RuntimeError{"stack overflow"};
+                        if (depth >= peakDepth) peakDepth = depth + 1;
+                        int* base = sp - ip->b;
+                        if (base + callee->frameSize + callee->maxStack > stackEnd) throw RuntimeError{"stack overflow"};
+                        CallRecord rec = { ip + 1, frame, memoFunc };
+                        calls.push_back(rec);
+                        memoFunc = -1;
+                        frame = base;
+                        fill(frame + callee->arity, frame + callee->frameSize, 0);
+                        sp = frame + callee->frameSize;
+                        ip = code + callee->entry;
+                        break;
+                    }
+                    case OP_RET: {
+                        int value = sp[-1];
+                        if (calls.size() == entry) {
+                            dispatches += count;
+                            return value;
+                        }
+                        if (calls.back().memoFunc >= 0) {
+                            size_t at = memoArgs.size() - funcs[calls.back().memoFunc].arity;
+                            (*memo)[calls.back().memoFunc]->store(&memoArgs[at], value);
+                            memoArgs.resize(at);
+                        }
+                        sp = frame;
+                        *sp++ = value;
+                        ip = calls.back().ret;
+                        frame = calls.back().frame;
+                        calls.pop_back();
+                        break;
+                    }
+                    case OP_INC: frame[ip->a] = wrapAdd(frame[ip->a], ip->b); ip++; break;
+                    case OP_ADD_LC: *sp++ = wrapAdd(frame[ip->a], ip->b); ip++; break;
+                    case OP_ADD_LL: *sp++ = wrapAdd(frame[ip->a], frame[ip->b]); ip++; break;
+                    case OP_LT_LC_JZ: ip = frame[ip->a] < ip->b ? ip + 1 : code + ip->c; break;
+                    case OP_LE_LC_JZ: ip = frame[ip->a] <= ip->b ? ip + 1 : code + ip->c; break;
+                    case OP_GT_LC_JZ: ip = frame[ip->a] > ip->b ? ip + 1 : code + ip->c; break;
+                    case OP_GE_LC_JZ: ip = frame[ip->a] >= ip->b ? ip + 1 : code + ip->c; break;
+                    case OP_EQ_LC_JZ: ip = frame[ip->a] == ip->b ? ip + 1 : code + ip->c; break;
+                    case OP_NE_LC_JZ: ip = frame[ip->a] != ip->b ? ip + 1 : code + ip->c; break;
+                    case OP_LT_LL_JZ: ip = frame[ip->a] < frame[ip->b] ? ip + 1 : code + ip->c; break;
+                    case OP_LE_LL_JZ: ip = frame[ip->a] <= frame[ip->b] ? ip + 1 : code + ip->c; break;
+                    case OP_GT_LL_JZ: ip = frame[ip->a] > frame[ip->b] ? ip + 1 : code + ip->c; break;
+                    case OP_GE_LL_JZ: ip = frame[ip->a] >= frame[ip->b] ? ip + 1 : code + ip->c; break;
+                    case OP_EQ_LL_JZ: ip = frame[ip->a] == frame[ip->b] ? ip + 1 : code + ip->c; break;
+                    case OP_NE_LL_JZ: ip = frame[ip->a] != frame[ip->b] ? ip + 1 : code + ip->c; break;
+                    case OP_LT_JZ: sp -= 2; ip = sp[0] < sp[1] ? ip + 1 : code + ip->a; break;
+                    case OP_LE_JZ: sp -= 2; ip = sp[0] <= sp[1] ? ip + 1 : code + ip->a; break;
+                    case OP_GT_JZ: sp -= 2; ip = sp[0] > sp[1] ? ip + 1 : code + ip->a; break;
+                    case OP_GE_JZ: sp -= 2; ip = sp[0] >= sp[1] ? ip + 1 : code + ip->a; break;
+                    case OP_EQ_JZ: sp -= 2; ip = sp[0] == sp[1] ? ip + 1 : code + ip->a; break;
+                    case OP_NE_JZ: sp -= 2; ip = sp[0] != sp[1] ? ip + 1 : code + ip->a; break;
+                    case OP_FORK_TEST:
+                        if (!sched || depthBase + (int)calls.size() >= sched->cutoff) ip = code + ip->a;
+                        else ip++;
+                        break;
+                    case OP_FORK: {
+                        int right = funcs[ip->b].arity;
+                        sp -= right;
+                        int* base = sp - funcs[ip->a].arity;
+                        ForkTask task;
+                        task.func = ip->b;
+                        task.depth = depthBase + (int)calls.size() + 1;
+                        task.args.assign(sp, sp + right);
+                        int* savedTop = top;
+                        top = sp;
+                        sched->push(worker, &task);
+                        int left;
+                        try {
+                            left = invoke(ip->a, base, task.depth);
+                        } catch (...) {
+                            join(task);
+                            top = savedTop;
+                            throw;
+                        }
+                        join(task);
+                        top = savedTop;
+                        if (!task.error.empty()) throw RuntimeError{task.error};
+                        sp = base;
+                        *sp++ = left;
+                        *sp++ = task.result;
+                        ip++;
+                        break;
+                    }
+                    default:
+                        throw RuntimeError{"bad opcode"};
+                }
+            }
+        } catch (...) {
+            dispatches += count;
+            throw;
+        }
+    }
+
+    // execute() at call depth `depth`, through the memo table if f has one.
+    int invoke(int f, int* frame, int depth) {
+        int savedBase = depthBase;
+        depthBase = depth - (int)calls.size();
+        int value;
+        try {
+            MemoTable* table = memo && !memo->empty() ? (*memo)[f].get() : nullptr;
+            if (table && table->find(frame, value)) {
+                depthBase = savedBase;
+                return value;
+            }
+            vector<int> args;
+            if (table) args.assign(frame, frame + funcs[f].arity);
+            value = execute(f, frame);
+            if (table) table->store(args.data(), value);
+        } catch (...) {
+            depthBase = savedBase;
+            throw;
+        }
+        depthBase = savedBase;
+        return value;
+    }
+
+    // Waits for a forked task, running it here if it was not stolen and
+    // helping with other queued work while a thief finishes it.
+    void join(ForkTask& task) {
+        if (sched->reclaim(worker, &task)) {
+            runTask(&task);
+            return;
+        }
+        while (!task.done.load(memory_order_acquire)) {
+            ForkTask* other = sched->steal(worker);
+            if (other) runTask(other);
+            else this_thread::yield();
+        }
+    }
+
+public:
+    uint64_t dispatches;
+    int peakDepth;
+
+    VM(const BcImage& image, const ExecLimits& l, MemoTables* m = nullptr, ForkScheduler* s = nullptr,
+       int w = 0)
+        : code(image.code), funcs(image.funcs), limits(l), memo(m), sched(s), worker(w), depthBase(0),
+          dispatches(0), peakDepth(0) {
+        size_t frame = 1;
+        for (int i = 0; i < image.funcCount; i++) {
+            frame = max(frame, (size_t)(image.funcs[i].frameSize + image.funcs[i].maxStack));
+        }
+        // Nested forked work can stack two call chains on one worker.
+        size_t slots = ((size_t)limits.maxDepth + 2) * frame * (s ? 2 : 1);
+        stackBytes = slots * sizeof(int);
+        void* mem = mmap(nullptr, stackBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                         -1, 0);
+        if (mem == MAP_FAILED) throw RuntimeError{"cannot allocate stack"};
+        stack = top = (int*)mem;
+        stackEnd = stack + slots;
+    }
+
+    ~VM() { munmap(stack, stackBytes); }
+
+    int call(int f, const int* args) {
+        calls.clear();
+        memoArgs.clear();
+        depthBase = 0;
+        top = stack;
+        for (int i = 0; i < funcs[f].arity; i++) stack[i] = args[i];
+        return execute(f, stack);
+    }
+
+    // Runs a stolen or reclaimed task above everything in use on this VM
+    // and records its result or failure in the task.
+    void runTask(ForkTask* task) {
+        size_t savedCalls = calls.size(), savedArgs = memoArgs.size();
+        int* frame = top;
+        try {
+            if (frame + funcs[task->func].frameSize + funcs[task->func].maxStack > stackEnd) {
+                throw RuntimeError{"stack overflow"};
+            }
+            copy(task->args.begin(), task->args.end(), frame);
+            task->result = invoke(task->func, frame, task->depth);
+        } catch (const RuntimeError& e) {
+            task->error = e.message;
+            calls.resize(savedCalls);
+            memoArgs.resize(savedArgs);
+        }
+        top = frame;
+        task->done.store(true, memory_order_release);
+    }
+};
+
+// Rewrites every generic instruction up front so that no thread writes the
+// code while others run it.
+void quicken(BcModule& mod) {
+    for (auto& insn : mod.code) {
+        if (insn.op == OP_ARITH) insn.op = specializedArith((TokenType)insn.a);
+    }
+}
+
+void compileModule(const Program& prog, BcModule& mod, bool superinstructions,
+                   const vector<bool>* forkable = nullptr) {
+    BytecodeCompiler(prog, mod, forkable).compile();
+    if (superinstructions) fuseSuperinstructions(mod);
+}
+
+// --ngrams FILE...: static opcode n-gram counts of the unfused bytecode of
+// the given programs, the training data for superinstruction selection.
+int printNgrams(const vector<string>& paths) {
+    map<string, int> counts[3];
+    for (const auto& path : paths) {
+        string text;
+        AstBuilder builder;
+        if (!readFile(path, text) || !checkSource(text, builder).empty() ||
+            !Resolver(builder.program).run().empty()) {
+            cerr << path << ": skipped" << endl;
+            continue;
+        }
+        BcModule mod;
+        compileModule(builder.program, mod, false);
+        for (size_t i = 0; i < mod.code.size(); i++) {
+            string gram = opcodeName(mod.code[i].op);
+            for (size_t n = 2; n <= 4 && i + n <= mod.code.size(); n++) {
+                gram += " ";
+                gram += opcodeName(mod.code[i + n - 1].op);
+                counts[n - 2][gram]++;
+            }
+        }
+    }
+    for (int n = 0; n < 3; n++) {
+        vector<pair<int, string> > ranked;
+        for (const auto& c : counts[n]) ranked.push_back(make_pair(c.second, c.first));
+        sort(ranked.rbegin(), ranked.rend());
+        cout << n + 2 << "-grams:" << endl;
+        for (size_t i = 0; i < ranked.size() && i < 10; i++) {
+            cout << "  " << ranked[i].first << "  " << ranked[i].second << endl;
+        }
+    }
+    return 0;
+}
+
+// Bytecode cache file: a header, the function table and the code, laid out
+// so that a mapping of the file can be run in place. It is valid for one
+// source text (by hash), one bytecode format version and one build of the
+// compiler (by stamp).
+struct BcCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sourceHash;
+    uint64_t compilerStamp;
+    int32_t funcCount;
+    int32_t codeCount;
+    int32_t mainFunc;
+    int32_t reserved;
+};
+
+static const uint32_t BC_MAGIC = 0x42434354;  // "TCCB"
+static const uint32_t BC_VERSION = 2;
+
+// Identity of the bytecode compiler: the build time, so any rebuild with a
+// changed compiler or fusion rule retires old files, plus the opcode table
+// and instruction layout in case the stamp itself is reproducible.
+uint64_t bcCompilerStamp() {
+    static const uint64_t stamp = []() {
+        string id = __DATE__ " " __TIME__;
+        for (int op = 0; op < OP_COUNT; op++) {
+            id += ' ';
+            id += opcodeName(op);
+        }
+        id += ' ' + to_string(sizeof(Insn)) + ' ' + to_string(sizeof(BcFunc));
+        return hashText(id);
+    }();
+    return stamp;
+}
+
+// Cache location: in cacheDir under the source hash and compiler stamp when
+// one is given, otherwise next to the source as NAME.tcb.
+string bcCachePath(const string& source, const string& cacheDir, uint64_t hash) {
+    if (!cacheDir.empty()) {
+        char name[32];
+        snprintf(name, sizeof name, "%016llx.tcb", (unsigned long long)(hash ^ bcCompilerStamp()));
+        return cacheDir + "/" + name;
+    }
+    if (source.empty()) return string();
+    return (hasSuffix(source, ".tc") ? source.substr(0, source.size() - 3) : source) + ".tcb";
+}
+
+bool saveBcCache(const string& path, const BcModule& mod, uint64_t hash) {
+    BcCacheHeader header = { BC_MAGIC, BC_VERSION, hash, bcCompilerStamp(), (int32_t)mod.funcs.size(),
+                             (int32_t)mod.code.size(), mod.mainFunc, 0 };
+    string out((const char*)&header, sizeof header);
+    out.append((const char*)mod.funcs.data(), mod.funcs.size() * sizeof(BcFunc));
+    out.append((const char*)mod.code.data(), mod.code.size() * sizeof(Insn));
+    return writeFile(path, out);
+}
+
+// A mapped cache file. The mapping is private and writable, so quickening
+// rewrites this process's copy of a page and never the file.
+class BcCacheFile {
+private:
+    void* base;
+    size_t size;
+
+    // Functions are laid out in order, so each one's code runs from its
+    // entry to the next; frame slot operands must fall in that function's
+    // frame.
+    bool valid(const BcCacheHeader& h) const {
+        static const int32_t MAX_SLOTS = 1 << 20;
+        if (h.funcCount <= 0 || h.codeCount <= 0 || h.mainFunc < 0 || h.mainFunc >= h.funcCount) return false;
+        if (size != sizeof h + (size_t)h.funcCount * sizeof(BcFunc) + (size_t)h.codeCount * sizeof(Insn)) return false;
+        for (int i = 0; i < h.funcCount; i++) {
+            const BcFunc& f = image.funcs[i];
+            int32_t end = i + 1 < h.funcCount ? image.funcs[i + 1].entry : h.codeCount;
+            if ((i == 0 && f.entry != 0) || f.entry < 0 || f.entry >= end || end > h.codeCount) return false;
+            if (f.arity < 0 || f.frameSize < 1 || f.frameSize > MAX_SLOTS || f.arity > f.frameSize ||
+                f.maxStack < 1 || f.maxStack > MAX_SLOTS) {
+                return false;
+            }
+            auto slot = [&](int32_t s) { return s >= 0 && s < f.frameSize; };
+            for (int k = f.entry; k < end; k++) {
+                const Insn& in = image.code[k];
+                switch (in.op) {
+                    case OP_LOAD: case OP_STORE: case OP_INC: case OP_ADD_LC:
+                        if (!slot(in.a)) return false;
+                        break;
+                    case OP_ADD_LL:
+                        if (!slot(in.a) || !slot(in.b)) return false;
+                        break;
+                    default:
+                        if (in.op >= OP_LT_LC_JZ && in.op <= OP_NE_LC_JZ && !slot(in.a)) return false;
+                        if (in.op >= OP_LT_LL_JZ && in.op <= OP_NE_LL_JZ && (!slot(in.a) || !slot(in.b))) return false;
+                        break;
+                }
+            }
+        }
+        for (int i = 0; i < h.codeCount; i++) {
+            const Insn& in = image.code[i];
+            if (in.op < 0 || in.op >= OP_COUNT) return false;
+            if (isBranch(in.op) && (in.a < 0 || in.a >= h.codeCount)) return false;
+            if (isFusedCompareBranch(in.op) && (in.c < 0 || in.c >= h.codeCount)) return false;
+            if ((in.op == OP_CALL || in.op == OP_CALL_MEMO) &&
+                (in.a < 0 || in.a >= h.funcCount || in.b != image.funcs[in.a].arity)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    BcImage image;
+    int mainFunc;
+
+    BcCacheFile() : base(nullptr), size(0), mainFunc(-1) {}
+
+    ~BcCacheFile() {
+        if (base) munmap(base, size);
+    }
+
+    // False for a missing, stale or damaged file.
+    bool open(const string& path, uint64_t hash) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(BcCacheHeader)) {
+            close(fd);
+            return false;
+        }
+        size = st.st_size;
+        base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            base = nullptr;
+            return false;
+        }
+        const BcCacheHeader& h = *(const BcCacheHeader*)base;
+        if (h.magic != BC_MAGIC || h.version != BC_VERSION || h.sourceHash != hash ||
+            h.compilerStamp != bcCompilerStamp()) {
+            return false;
+        }
+        image.funcs = (const BcFunc*)((char*)base + sizeof h);
+        image.code = (Insn*)((char*)base + sizeof h + (size_t)h.funcCount * sizeof(BcFunc));
+        image.funcCount = h.funcCount;
+        if (!valid(h)) return false;
+        mainFunc = h.mainFunc;
+        return true;
+    }
+};
+
+// Run body on a thread with a large stack, so deep ToyC recursion is bounded
+// by ExecLimits::maxDepth rather than by the host's default stack.
+void runOnLargeStack(const function<void()>& body) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, (size_t)1 << 30);
+    pthread_t tid;
+    auto trampoline = [](void* arg) -> void* {
+        (*(const function<void()>*)arg)();
+        return nullptr;
+    };
+    if (pthread_create(&tid, &attr, trampoline, (void*)&body) != 0) {
+        body();
+    } else {
+        pthread_join(tid, nullptr);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Parse, shake and resolve stdin for execution. Diagnostics go to stderr.
+bool loadProgram(const string& input, AstBuilder& builder) {
+    map<int, string> errors = checkSource(input, builder);
+    if (errors.empty()) {
+        shakeDeadFunctions(builder.program, nullptr);
+        errors = Resolver(builder.program).run();
+    }
+    for (const auto& e : errors) cerr << e.first << " " << e.second << endl;
+    return errors.empty();
+}
+
+int mainIndex(const Program& prog) {
+    for (size_t i = 0; i < prog.funcs.size(); i++) {
+        if (prog.funcs[i].name == "main") return (int)i;
+    }
+    return -1;
+}
+
+struct RunOptions {
+    string engine;
+    ExecLimits limits;
+    bool timing;
+    bool superinstructions;
+    bool memoize;
+    int workers;
+    int forkDepth;
+    string cacheDir;
+    int unroll;
+};
+
+// --unroll N: peel and unroll counted loops (N = 1 only peels) after
+// loading; with --time the counts go to stderr.
+void optimizeLoops(Program& prog, int factor, bool report) {
+    LoopStats stats = { 0, 0 };
+    LoopOptimizer(prog, factor, stats).run();
+    if (report) cerr << "loops: " << stats.unrolled << " unrolled, " << stats.peeled << " peeled" << endl;
+}
+
+// --parallel N: run main on N workers sharing the code and memo tables.
+// Worker 0 is the calling thread; the others steal forked calls until
+// main returns.
+int runForkJoin(BcModule& mod, MemoTables& memo, const RunOptions& opts, uint64_t& dispatches) {
+    quicken(mod);
+    for (auto& table : memo) {
+        if (table) table->shared = true;
+    }
+    ForkScheduler sched(opts.workers, opts.forkDepth);
+    vector<unique_ptr<VM> > vms;
+    for (int w = 0; w < opts.workers; w++) vms.emplace_back(new VM(mod.image(), opts.limits, &memo, &sched, w));
+    vector<thread> helpers;
+    for (int w = 1; w < opts.workers; w++) {
+        helpers.emplace_back([&, w]() {
+            while (!sched.stop.load()) {
+                ForkTask* task = sched.steal(w);
+                if (task) vms[w]->runTask(task);
+                else this_thread::yield();
+            }
+        });
+    }
+    auto finish = [&]() {
+        sched.stop = true;
+        for (auto& t : helpers) t.join();
+        for (const auto& vm : vms) dispatches += vm->dispatches;
+        if (opts.timing) cerr << "forks: " << sched.forked << ", stolen: " << sched.stolen << endl;
+    };
+    int result;
+    try {
+        result = vms[0]->call(mod.mainFunc, nullptr);
+    } catch (...) {
+        finish();
+        throw;
+    }
+    finish();
+    return result;
+}
+
+// --run [FILE]: execute main with the chosen engine and print its return
+// value. Plain VM runs of a file, or of anything with --cache-dir, go
+// through the bytecode cache and skip the front end when it is current.
+int runProgram(const string& input, const string& path, const RunOptions& opts) {
+    const string& engine = opts.engine;
+    const ExecLimits& limits = opts.limits;
+    BcCacheFile cached;
+    string cachePath;
+    uint64_t hash = hashText(input);
+    if (engine == "vm" && !opts.memoize && opts.workers == 0 && opts.superinstructions && opts.unroll == 0) {
+        cachePath = bcCachePath(path, opts.cacheDir, hash);
+    }
+    bool hit = !cachePath.empty() && cached.open(cachePath, hash);
+    if (opts.timing && !cachePath.empty()) cerr << "cache: " << (hit ? "hit " : "miss ") << cachePath << endl;
+    AstBuilder builder;
+    if (!hit && !loadProgram(input, builder)) return 1;
+    if (!hit && opts.unroll > 0) optimizeLoops(builder.program, opts.unroll, opts.timing);
+    const Program& prog = builder.program;
+
+    typedef chrono::steady_clock Clock;
+    int result = 0;
+    string failure;
+    double ms = 0;
+    BcModule mod;
+    runOnLargeStack([&]() {
+        try {
+            Clock::time_point start = Clock::now();
+            if (engine == "walk") {
+                TreeWalker walker(prog, limits);
+                result = walker.call(mainIndex(prog), nullptr);
+            } else if (engine == "vm") {
+                MemoTables memo;
+                BcImage image = cached.image;
+                int mainFunc = cached.mainFunc;
+                if (!hit) {
+                    vector<bool> pure;
+                    if (opts.workers > 0) pure = analyzePurity(prog);
+                    compileModule(prog, mod, opts.superinstructions, opts.workers > 0 ? &pure : nullptr);
+                    if (opts.memoize) enableMemoization(prog, mod, memo);
+                    image = mod.image();
+                    mainFunc = mod.mainFunc;
+                }
+                uint64_t dispatches = 0;
+                if (opts.workers > 0) {
+                    result = runForkJoin(mod, memo, opts, dispatches);
+                } else {
+                    VM vm(image, limits, &memo);
+                    result = vm.call(mainFunc, nullptr);
+                    dispatches = vm.dispatches;
+                }
+                if (opts.timing) {
+                    cerr << "dispatches: " << dispatches << endl;
+                    for (size_t i = 0; i < memo.size(); i++) {
+                        if (!memo[i]) continue;
+                        cerr << "memo " << mod.names[i] << ": " << memo[i]->hits << " hits, "
+                             << memo[i]->misses << " misses" << endl;
+                    }
+                }
+            } else {
+                ClosureEngine closures(prog, limits);
+                result = closures.call(mainIndex(prog), nullptr);
+            }
+            ms = chrono::duration<double, milli>(Clock::now() - start).count();
+        } catch (const RuntimeError& e) {
+            failure = e.message;
+        }
+    });
+    // Saved outside the timed run; by now the code may be quickened, which
+    // a later run would otherwise redo.
+    if (!hit && !cachePath.empty() && !mod.funcs.empty()) saveBcCache(cachePath, mod, hash);
+    if (!failure.empty()) {
+        cerr << "runtime error: " << failure << endl;
+        return 1;
+    }
+    cout << result << endl;
+    if (opts.timing) cerr << engine << ": " << ms << " ms" << endl;
+    return 0;
+}
+
+// --farm FILE...: compile and run every file as a separate program on a
+// thread pool of VMs, each bounded by --max-depth and --budget. One line
+// per program, in argument order, then a summary line.
+int runFarm(const vector<string>& paths, const RunOptions& opts) {
+    struct Job {
+        string status;
+        int value;
+        uint64_t steps;
+        int depth;
+        double ms;
+    };
+    typedef chrono::steady_clock Clock;
+    vector<Job> jobs(paths.size());
+    Clock::time_point start = Clock::now();
+
+    auto runOne = [&](size_t i) {
+        Job& job = jobs[i];
+        job.value = 0;
+        job.steps = 0;
+        job.depth = 0;
+        Clock::time_point begin = Clock::now();
+        string text;
+        AstBuilder builder;
+        map<int, string> errors;
+        if (!readFile(paths[i], text)) {
+            job.status = "cannot open file";
+        } else if (!(errors = checkSource(text, builder)).empty() ||
+                   (shakeDeadFunctions(builder.program, nullptr), !(errors = Resolver(builder.program).run()).empty())) {
+            job.status = "reject " + to_string(errors.begin()->first) + " " + errors.begin()->second;
+        } else {
+            BcModule mod;
+            compileModule(builder.program, mod, opts.superinstructions);
+            try {
+                VM vm(mod.image(), opts.limits);
+                try {
+                    job.value = vm.call(mod.mainFunc, nullptr);
+                    job.status = "ok";
+                } catch (const RuntimeError& e) {
+                    job.status = "runtime error: " + e.message;
+                }
+                job.steps = vm.dispatches;
+                job.depth = vm.peakDepth;
+            } catch (const RuntimeError& e) {
+                job.status = "runtime error: " + e.message;
+            }
+        }
+        job.ms = chrono::duration<double, milli>(Clock::now() - begin).count();
+    };
+
+    size_t workers = min<size_t>(max(1u, thread::hardware_concurrency()), paths.size());
+    atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t i = next++; i < paths.size(); i = next++) runOne(i);
+    };
+    vector<thread> pool;
+    for (size_t i = 1; i < workers; i++) pool.push_back(thread(work));
+    work();
+    for (auto& t : pool) t.join();
+
+    size_t ok = 0;
+    uint64_t steps = 0;
+    for (size_t i = 0; i < paths.size(); i++) {
+        const Job& job = jobs[i];
+        cout << paths[i] << ": " << job.status;
+        if (job.status == "ok") {
+            cout << " " << job.value;
+            ok++;
+        }
+        if (job.status == "ok" || job.status.compare(0, 8, "runtime ") == 0) {
+            cout << " steps=" << job.steps << " depth=" << job.depth;
+        }
+        cout << " time=" << job.ms << "ms" << endl;
+        steps += job.steps;
+    }
+    double total = chrono::duration<double, milli>(Clock::now() - start).count();
+    cout << "farm: " << ok << "/" << paths.size() << " ok, steps=" << steps << ", workers=" << workers
+         << ", wall=" << total << "ms" << endl;
+    return ok == paths.size() ? 0 : 1;
+}
+
+// --emit-c: translate the resolved program to C99. Arithmetic goes through
+// unsigned helpers so it wraps like ToyC, division checks match the
+// interpreters, and every function counts its depth against
+// TC_MAX_DEPTH (the interpreters' default, overridable with -D). C leaves
+// operand order unspecified; since ToyC calls have no side effects this
+// can only change which of two failing operands is reported.
+class CEmitter {
+private:
+    const Program& prog;
+    ostream& out;
+    vector<string> locals;
+
+    static string literal(int v) { return v == INT_MIN ? "INT32_MIN" : to_string(v); }
+
+    void indent(int depth) { out << string(depth * 4, ' '); }
+
+    string expr(const Node* n) {
+        switch (n->kind) {
+            case NODE_NUM: return literal(n->value);
+            case NODE_VAR: return locals[n->slot];
+            case NODE_CALL: {
+                string s = "tc_f_" + n->name + "(";
+                for (size_t i = 0; i < n->kids.size(); i++) s += (i ? ", " : "") + expr(n->kids[i]);
+                return s + ")";
+            }
+            case NODE_UNARY:
+                if (n->op == TOK_MINUS) return "tc_neg(" + expr(n->kids[0]) + ")";
+                if (n->op == TOK_NOT) return "(!" + expr(n->kids[0]) + ")";
+                return expr(n->kids[0]);
+            case NODE_BINARY: {
+                string a = expr(n->kids[0]), b = expr(n->kids[1]);
+                switch (n->op) {
+                    case TOK_PLUS: return "tc_add(" + a + ", " + b + ")";
+                    case TOK_MINUS: return "tc_sub(" + a + ", " + b + ")";
+                    case TOK_STAR: return "tc_mul(" + a + ", " + b + ")";
+                    case TOK_DIV: return "tc_div(" + a + ", " + b + ")";
+                    case TOK_MOD: return "tc_mod(" + a + ", " + b + ")";
+                    default: return "(" + a + " " + tokenText(n->op) + " " + b + ")";
+                }
+            }
+            default:
+                return "0";
+        }
+    }
+
+    void stmt(const Node* n, int depth) {
+        switch (n->kind) {
+            case NODE_DECL:
+                for (const Node* var : n->kids) {
+                    indent(depth);
+                    out << locals[var->slot] << " = " << (var->kids.empty() ? "0" : expr(var->kids[0])) << ";\n";
+                }
+                break;
+            case NODE_ASSIGN:
+                indent(depth);
+                out << locals[n->slot] << " = " << expr(n->kids[0]) << ";\n";
+                break;
+            case NODE_EXPR:
+                indent(depth);
+                out << "(void)" << expr(n->kids[0]) << ";\n";
+                break;
+            case NODE_IF:
+                indent(depth);
+                out << "if (" << expr(n->kids[0]) << ") {\n";
+                stmt(n->kids[1], depth + 1);
+                if (n->kids.size() > 2) {
+                    indent(depth);
+                    out << "} else {\n";
+                    stmt(n->kids[2], depth + 1);
+                }
+                indent(depth);
+                out << "}\n";
+                break;
+            case NODE_WHILE:
+                indent(depth);
+                out << "while (" << expr(n->kids[0]) << ") {\n";
+                stmt(n->kids[1], depth + 1);
+                indent(depth);
+                out << "}\n";
+                break;
+            case NODE_BREAK:
+                indent(depth);
+                out << "break;\n";
+                break;
+            case NODE_CONTINUE:
+                indent(depth);
+                out << "continue;\n";
+                break;
+            case NODE_RETURN:
+                indent(depth);
+                out << "return " << (n->kids.empty() ? "0" : expr(n->kids[0])) << ";\n";
+                break;
+            case NODE_BLOCK:
+                for (const Node* kid : n->kids) stmt(kid, depth);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void nameLocals(const Node* n) {
+        if ((n->kind == NODE_VAR || n->kind == NODE_ASSIGN) && n->slot >= 0 && locals[n->slot].empty()) {
+            locals[n->slot] = n->name + "_" + to_string(n->slot);
+        }
+        for (const Node* kid : n->kids) nameLocals(kid);
+    }
+
+    void signature(const FuncDef& f, const string& prefix) {
+        out << "static int32_t " << prefix << f.name << "(";
+        for (size_t i = 0; i < f.params.size(); i++) {
+            out << (i ? ", " : "") << "int32_t " << f.params[i] << "_" << i;
+        }
+        if (f.params.empty()) out << "void";
+        out << ")";
+    }
+
+public:
+    CEmitter(const Program& p, ostream& o) : prog(p), out(o) {}
+
+    void emit() {
+        out << "/* Generated by parser --emit-c. */\n"
+               "#include <stdint.h>\n"
+               "#include <stdio.h>\n"
+               "#include <stdlib.h>\n"
+               "\n"
+               "#ifndef TC_MAX_DEPTH\n"
+               "#define TC_MAX_DEPTH 100000\n"
+               "#endif\n"
+               "\n"
+               "static int tc_depth;\n"
+               "\n"
+               "static void tc_fail(const char* msg) {\n"
+               "    fflush(stdout);\n"
+               "    fprintf(stderr, \"runtime error: %s\\n\", msg);\n"
+               "    exit(1);\n"
+               "}\n"
+               "\n"
+               "static inline int32_t tc_add(int32_t a, int32_t b) { return (int32_t)((uint32_t)a + (uint32_t)b); }\n"
+               "static inline int32_t tc_sub(int32_t a, int32_t b) { return (int32_t)((uint32_t)a - (uint32_t)b); }\n"
+               "static inline int32_t tc_mul(int32_t a, int32_t b) { return (int32_t)((uint32_t)a * (uint32_t)b); }\n"
+               "static inline int32_t tc_neg(int32_t a) { return (int32_t)(0u - (uint32_t)a); }\n"
+               "\n"
+               "static inline int32_t tc_div(int32_t a, int32_t b) {\n"
+               "    if (b == 0) tc_fail(\"division by zero\");\n"
+               "    return b == -1 ? tc_neg(a) : a / b;\n"
+               "}\n"
+               "\n"
+               "static inline int32_t tc_mod(int32_t a, int32_t b) {\n"
+               "    if (b == 0) tc_fail(\"division by zero\");\n"
+               "    return b == -1 ? 0 : a % b;\n"
+               "}\n"
+               "\n";
+        for (const auto& f : prog.funcs) {
+            signature(f, "tc_f_");
+            out << ";\n";
+        }
+        for (const auto& f : prog.funcs) {
+            locals.assign(max(f.frameSize, 1), string());
+            for (size_t i = 0; i < f.params.size(); i++) locals[i] = f.params[i] + "_" + to_string(i);
+            nameLocals(f.body);
+            out << "\n";
+            signature(f, "tc_b_");
+            out << " {\n";
+            for (int s = (int)f.params.size(); s < f.frameSize; s++) {
+                if (!locals[s].empty()) out << "    int32_t " << locals[s] << " = 0;\n";
+            }
+            stmt(f.body, 1);
+            out << "    return 0;\n}\n\n";
+            signature(f, "tc_f_");
+            out << " {\n"
+                   "    int32_t r;\n"
+                   "    if (++tc_depth > TC_MAX_DEPTH) tc_fail(\"stack overflow\");\n"
+                   "    r = tc_b_" << f.name << "(";
+            for (size_t i = 0; i < f.params.size(); i++) out << (i ? ", " : "") << locals[i];
+            out << ");\n"
+                   "    tc_depth--;\n"
+                   "    return r;\n"
+                   "}\n";
+        }
+        out << "\nint main(void) {\n"
+               "    printf(\"%d\\n\", (int)tc_f_main());\n"
+               "    return 0;\n"
+               "}\n";
+    }
+};
+
+// --emit-llvm: textual LLVM IR (typed pointers, as LLVM 14 reads by
+// default). Every local gets an entry-block alloca for mem2reg to promote;
+// plain add/sub/mul wrap in i32 as ToyC requires, while division goes
+// through helpers that rule out the cases sdiv leaves undefined. Returns
+// funnel through one exit block that also pops the depth counter.
+class LlvmEmitter {
+private:
+    const Program& prog;
+    ostream& out;
+    vector<string> locals;
+    int retSlot;
+    int temps, labels;
+    // Label of the block being filled, and whether it already ends in a
+    // terminator.
+    string current;
+    bool terminated;
+
+    struct Loop {
+        string head, exit;
+    };
+    vector<Loop> loops;
+
+    string temp() { return "%t" + to_string(temps++); }
+    string label() { return "L" + to_string(labels++); }
+
+    void start(const string& name) {
+        if (!terminated) out << "  br label %" << name << "\n";
+        out << name << ":\n";
+        current = name;
+        terminated = false;
+    }
+
+    void jump(const string& target) {
+        out << "  br label %" << target << "\n";
+        terminated = true;
+    }
+
+    string boolToInt(const string& flag) {
+        string t = temp();
+        out << "  " << t << " = zext i1 " << flag << " to i32\n";
+        return t;
+    }
+
+    string truth(const string& value) {
+        string t = temp();
+        out << "  " << t << " = icmp ne i32 " << value << ", 0\n";
+        return t;
+    }
+
+    string expr(const Node* n) {
+        switch (n->kind) {
+            case NODE_NUM:
+                return to_string(n->value);
+            case NODE_VAR: {
+                string t = temp();
+                out << "  " << t << " = load i32, i32* " << locals[n->slot] << "\n";
+                return t;
+            }
+            case NODE_CALL: {
+                vector<string> args;
+                for (const Node* kid : n->kids) args.push_back(expr(kid));
+                string t = temp();
+                out << "  " << t << " = call i32 @tc.f." << n->name << "(";
+                for (size_t i = 0; i < args.size(); i++) out << (i ? ", " : "") << "i32 " << args[i];
+                out << ")\n";
+                return t;
+            }
+            case NODE_UNARY: {
+                string v = expr(n->kids[0]);
+                string t = temp();
+                if (n->op == TOK_MINUS) {
+                    out << "  " << t << " = sub i32 0, " << v << "\n";
+                    return t;
+                }
+                if (n->op != TOK_NOT) return v;
+                out << "  " << t << " = icmp eq i32 " << v << ", 0\n";
+                return boolToInt(t);
+            }
+            case NODE_BINARY: {
+                if (n->op == TOK_AND || n->op == TOK_OR) {
+                    bool isAnd = n->op == TOK_AND;
+                    string lhs = truth(expr(n->kids[0]));
+                    string from = current, rhsLabel = label(), end = label();
+                    out << "  br i1 " << lhs << ", label %" << (isAnd ? rhsLabel : end) << ", label %"
+                        << (isAnd ? end : rhsLabel) << "\n";
+                    terminated = true;
+                    start(rhsLabel);
+                    string rhs = truth(expr(n->kids[1]));
+                    string rhsEnd = current;
+                    start(end);
+                    string t = temp();
+                    out << "  " << t << " = phi i1 [ " << (isAnd ? "false" : "true") << ", %" << from << " ], [ "
+                        << rhs << ", %" << rhsEnd << " ]\n";
+                    return boolToInt(t);
+                }
+                string a = expr(n->kids[0]), b = expr(n->kids[1]);
+                string t = temp();
+                const char* cmp = nullptr;
+                switch (n->op) {
+                    case TOK_PLUS: out << "  " << t << " = add i32 " << a << ", " << b << "\n"; return t;
+                    case TOK_MINUS: out << "  " << t << " = sub i32 " << a << ", " << b << "\n"; return t;
+                    case TOK_STAR: out << "  " << t << " = mul i32 " << a << ", " << b << "\n"; return t;
+                    case TOK_DIV:
+                        out << "  " << t << " = call i32 @tc.div(i32 " << a << ", i32 " << b << ")\n";
+                        return t;
+                    case TOK_MOD:
+                        out << "  " << t << " = call i32 @tc.mod(i32 " << a << ", i32 " << b << ")\n";
+                        return t;
+                    case TOK_LT: cmp = "slt"; break;
+                    case TOK_LE: cmp = "sle"; break;
+                    case TOK_GT: cmp = "sgt"; break;
+                    case TOK_GE: cmp = "sge"; break;
+                    case TOK_EQ: cmp = "eq"; break;
+                    default: cmp = "ne"; break;
+                }
+                out << "  " << t << " = icmp " << cmp << " i32 " << a << ", " << b << "\n";
+                return boolToInt(t);
+            }
+            default:
+                return "0";
+        }
+    }
+
+    void store(const string& v, int slot) { out << "  store i32 " << v << ", i32* " << locals[slot] << "\n"; }
+
+    void stmt(const Node* n) {
+        switch (n->kind) {
+            case NODE_DECL:
+                for (const Node* var : n->kids) store(var->kids.empty() ? "0" : expr(var->kids[0]), var->slot);
+                break;
+            case NODE_ASSIGN:
+                store(expr(n->kids[0]), n->slot);
+                break;
+            case NODE_EXPR:
+                expr(n->kids[0]);
+                break;
+            case NODE_IF: {
+                string cond = truth(expr(n->kids[0]));
+                string thenLabel = label(), elseLabel = label(), end = n->kids.size() > 2 ? label() : elseLabel;
+                out << "  br i1 " << cond << ", label %" << thenLabel << ", label %" << elseLabel << "\n";
+                terminated = true;
+                start(thenLabel);
+                stmt(n->kids[1]);
+                if (n->kids.size() > 2) {
+                    if (!terminated) jump(end);
+                    start(elseLabel);
+                    stmt(n->kids[2]);
+                }
+                start(end);
+                break;
+            }
+            case NODE_WHILE: {
+                Loop loop = { label(), label() };
+                string body = label();
+                start(loop.head);
+                string cond = truth(expr(n->kids[0]));
+                out << "  br i1 " << cond << ", label %" << body << ", label %" << loop.exit << "\n";
+                terminated = true;
+                start(body);
+                loops.push_back(loop);
+                stmt(n->kids[1]);
+                loops.pop_back();
+                if (!terminated) jump(loop.head);
+                start(loop.exit);
+                break;
+            }
+            case NODE_BREAK:
+                jump(loops.back().exit);
+                start(label());
+                break;
+            case NODE_CONTINUE:
+                jump(loops.back().head);
+                start(label());
+                break;
+            case NODE_RETURN:
+                store(n->kids.empty() ? "0" : expr(n->kids[0]), retSlot);
+                jump("exit");
+                start(label());
+                break;
+            case NODE_BLOCK:
+                for (const Node* kid : n->kids) stmt(kid);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void nameLocals(const Node* n) {
+        if ((n->kind == NODE_VAR || n->kind == NODE_ASSIGN) && n->slot >= 0 && locals[n->slot].empty()) {
+            locals[n->slot] = "%" + n->name + "." + to_string(n->slot);
+        }
+        for (const Node* kid : n->kids) nameLocals(kid);
+    }
+
+    void function(const FuncDef& f) {
+        temps = labels = 0;
+        terminated = false;
+        // The slot after the frame holds the return value.
+        retSlot = f.frameSize;
+        locals.assign(f.frameSize + 1, string());
+        for (size_t i = 0; i < f.params.size(); i++) locals[i] = "%" + f.params[i] + "." + to_string(i);
+        nameLocals(f.body);
+        locals[retSlot] = "%retval";
+
+        out << "\ndefine internal i32 @tc.f." << f.name << "(";
+        for (size_t i = 0; i < f.params.size(); i++) out << (i ? ", " : "") << "i32 %arg" << i;
+        out << ") {\nentry:\n";
+        for (const auto& slot : locals) {
+            if (!slot.empty()) out << "  " << slot << " = alloca i32\n";
+        }
+        for (size_t i = 0; i < f.params.size(); i++) store("%arg" + to_string(i), (int)i);
+        for (int s = (int)f.params.size(); s < f.frameSize; s++) {
+            if (!locals[s].empty()) store("0", s);
+        }
+        out << "  %depth = load i32, i32* @tc.depth\n"
+               "  %depth1 = add i32 %depth, 1\n"
+               "  store i32 %depth1, i32* @tc.depth\n"
+               "  %deep = icmp sgt i32 %depth1, 100000\n"
+               "  br i1 %deep, label %overflow, label %body\n"
+               "overflow:\n"
+               "  call void @tc.fail(i8* getelementptr inbounds ([15 x i8], [15 x i8]* @.msg.stack, i64 0, i64 0))\n"
+               "  unreachable\n";
+        terminated = true;
+        start("body");
+        stmt(f.body);
+        store("0", retSlot);
+        jump("exit");
+        out << "exit:\n"
+               "  %depth2 = load i32, i32* @tc.depth\n"
+               "  %depth3 = sub i32 %depth2, 1\n"
+               "  store i32 %depth3, i32* @tc.depth\n"
+               "  %result = load i32, i32* %retval\n"
+               "  ret i32 %result\n"
+               "}\n";
+    }
+
+public:
+    LlvmEmitter(const Program& p, ostream& o) : prog(p), out(o), retSlot(0), temps(0), labels(0), terminated(false) {}
+
+    void emit() {
+        out << "; Generated by parser --emit-llvm.\n"
+               "@tc.depth = internal global i32 0\n"
+               "@.fmt.result = private unnamed_addr constant [4 x i8] c\"%d\\0A\\00\"\n"
+               "@.fmt.error = private unnamed_addr constant [19 x i8] c\"runtime error: %s\\0A\\00\"\n"
+               "@.msg.div = private unnamed_addr constant [17 x i8] c\"division by zero\\00\"\n"
+               "@.msg.stack = private unnamed_addr constant [15 x i8] c\"stack overflow\\00\"\n"
+               "\n"
+               "declare i32 @printf(i8*, ...)\n"
+               "declare i32 @dprintf(i32, i8*, ...)\n"
+               "declare void @exit(i32) noreturn\n"
+               "\n"
+               "define internal void @tc.fail(i8* %msg) noreturn cold {\n"
+               "  %fmt = getelementptr inbounds [19 x i8], [19 x i8]* @.fmt.error, i64 0, i64 0\n"
+               "  call i32 (i32, i8*, ...) @dprintf(i32 2, i8* %fmt, i8* %msg)\n"
+               "  call void @exit(i32 1)\n"
+               "  unreachable\n"
+               "}\n"
+               "\n"
+               "define internal i32 @tc.div(i32 %a, i32 %b) {\n"
+               "entry:\n"
+               "  %zero = icmp eq i32 %b, 0\n"
+               "  br i1 %zero, label %fail, label %nonzero\n"
+               "fail:\n"
+               "  call void @tc.fail(i8* getelementptr inbounds ([17 x i8], [17 x i8]* @.msg.div, i64 0, i64 0))\n"
+               "  unreachable\n"
+               "nonzero:\n"
+               "  %minus1 = icmp eq i32 %b, -1\n"
+               "  br i1 %minus1, label %negate, label %divide\n"
+               "negate:\n"
+               "  %neg = sub i32 0, %a\n"
+               "  ret i32 %neg\n"
+               "divide:\n"
+               "  %q = sdiv i32 %a, %b\n"
+               "  ret i32 %q\n"
+               "}\n"
+               "\n"
+               "define internal i32 @tc.mod(i32 %a, i32 %b) {\n"
+               "entry:\n"
+               "  %zero = icmp eq i32 %b, 0\n"
+               "  br i1 %zero, label %fail, label %nonzero\n"
+               "fail:\n"
+               "  call void @tc.fail(i8* getelementptr inbounds ([17 x i8], [17 x i8]* @.msg.div, i64 0, i64 0))\n"
+               "  unreachable\n"
+               "nonzero:\n"
+               "  %minus1 = icmp eq i32 %b, -1\n"
+               "  br i1 %minus1, label %done, label %divide\n"
+               "done:\n"
+               "  ret i32 0\n"
+               "divide:\n"
+               "  %r = srem i32 %a, %b\n"
+               "  ret i32 %r\n"
+               "}\n";
+        for (const auto& f : prog.funcs) function(f);
+        out << "\ndefine i32 @main() {\n"
+               "  %r = call i32 @tc.f.main()\n"
+               "  %fmt = getelementptr inbounds [4 x i8], [4 x i8]* @.fmt.result, i64 0, i64 0\n"
+               "  call i32 (i8*, ...) @printf(i8* %fmt, i32 %r)\n"
+               "  ret i32 0\n"
+               "}\n";
+    }
+};
+
+// Three-address code: the target-independent input of the native backends.
+// ToyC locals and parameters are virtual registers 0..frameSize-1 (nothing
+// can take their address), temporaries are numbered after them. Branches
+// compare two registers, or a register and an immediate, directly.
+enum TacOp {
+    TAC_CONST,      // dst = imm
+    TAC_COPY,       // dst = a
+    TAC_NEG,        // dst = -a
+    TAC_NOT,        // dst = !a
+    TAC_BINARY,     // dst = a <op> b|imm, op one of + - * / % or a comparison
+    TAC_MULHI,      // dst = high 32 bits of the signed product a * imm
+    TAC_SHL,        // dst = a << imm
+    TAC_SHR,        // dst = a >> imm, arithmetic
+    TAC_SHRU,       // dst = a >> imm, logical
+    TAC_JUMP,       // goto label
+    TAC_BRANCH,     // if a <op> b|imm goto label
+    TAC_CALL,       // dst = func(args)
+    TAC_RET,        // return a
+    TAC_LABEL,
+};
+
+struct TacInsn {
+    TacOp op;
+    TokenType cond;
+    int dst, a, b;
+    bool hasImm;
+    int imm;
+    // Branch target, label id, or callee.
+    int label;
+    vector<int> args;
+};
+
+struct TacFunc {
+    string name;
+    int params;
+    int regs;
+    int labels;
+    vector<TacInsn> code;
+};
+
+bool isComparison(TokenType op) { return comparisonIndex(op) >= 0; }
+
+class TacLowering {
+private:
+    TacFunc& fn;
+    vector<pair<int, int> > loops;  // (head, exit) labels
+
+    TacInsn& add(TacOp op) {
+        TacInsn in;
+        in.op = op;
+        in.cond = TOK_EOF;
+        in.dst = in.a = in.b = -1;
+        in.hasImm = false;
+        in.imm = 0;
+        in.label = -1;
+        fn.code.push_back(in);
+        return fn.code.back();
+    }
+
+    int temp() { return fn.regs++; }
+    int newLabel() { return fn.labels++; }
+
+    void place(int label) { add(TAC_LABEL).label = label; }
+
+    void jump(int label) { add(TAC_JUMP).label = label; }
+
+    // Register holding the value of n; locals are used in place.
+    int value(const Node* n) {
+        if (n->kind == NODE_VAR) return n->slot;
+        int dst = temp();
+        valueInto(n, dst);
+        return dst;
+    }
+
+    void valueInto(const Node* n, int dst) {
+        switch (n->kind) {
+            case NODE_NUM: {
+                TacInsn& in = add(TAC_CONST);
+                in.dst = dst;
+                in.imm = n->value;
+                break;
+            }
+            case NODE_VAR:
+                if (n->slot != dst) {
+                    TacInsn& in = add(TAC_COPY);
+                    in.dst = dst;
+                    in.a = n->slot;
+                }
+                break;
+            case NODE_CALL: {
+                vector<int> args;
+                for (const Node* kid : n->kids) args.push_back(value(kid));
+                TacInsn& in = add(TAC_CALL);
+                in.dst = dst;
+                in.label = n->callee;
+                in.args = args;
+                break;
+            }
+            case NODE_UNARY: {
+                if (n->op == TOK_PLUS) {
+                    valueInto(n->kids[0], dst);
+                    break;
+                }
+                int a = value(n->kids[0]);
+                TacInsn& in = add(n->op == TOK_MINUS ? TAC_NEG : TAC_NOT);
+                in.dst = dst;
+                in.a = a;
+                break;
+            }
+            case NODE_BINARY: {
+                if (n->op == TOK_AND || n->op == TOK_OR) {
+                    int no = newLabel(), end = newLabel();
+                    branch(n, false, no);
+                    TacInsn& one = add(TAC_CONST);
+                    one.dst = dst;
+                    one.imm = 1;
+                    jump(end);
+                    place(no);
+                    TacInsn& zero = add(TAC_CONST);
+                    zero.dst = dst;
+                    zero.imm = 0;
+                    place(end);
+                    break;
+                }
+                binary(TAC_BINARY, n->op, n->kids[0], n->kids[1]).dst = dst;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    // a <op> b with a constant right operand folded into the instruction.
+    // Constant left operands of symmetric operators are moved right.
+    TacInsn& binary(TacOp op, TokenType cond, const Node* l, const Node* r) {
+        bool symmetric = cond == TOK_PLUS || cond == TOK_STAR || isComparison(cond);
+        if (symmetric && l->kind == NODE_NUM && r->kind != NODE_NUM) {
+            swap(l, r);
+            cond = swapComparison(cond);
+        }
+        int a = value(l);
+        int b = r->kind == NODE_NUM ? -1 : value(r);
+        TacInsn& in = add(op);
+        in.cond = cond;
+        in.a = a;
+        if (b < 0) {
+            in.hasImm = true;
+            in.imm = r->value;
+        } else {
+            in.b = b;
+        }
+        return in;
+    }
+
+    // Jumps to label when the truth of n equals `when`, else falls through.
+    void branch(const Node* n, bool when, int label) {
+        if (n->kind == NODE_NUM) {
+            if ((n->value != 0) == when) jump(label);
+            return;
+        }
+        if (n->kind == NODE_UNARY && n->op == TOK_NOT) {
+            branch(n->kids[0], !when, label);
+            return;
+        }
+        if (n->kind == NODE_BINARY && (n->op == TOK_AND || n->op == TOK_OR)) {
+            // The operator decides early when its left operand is false
+            // (for &&) or true (for ||).
+            bool decidesEarly = n->op == TOK_OR;
+            if (decidesEarly == when) {
+                branch(n->kids[0], when, label);
+                branch(n->kids[1], when, label);
+            } else {
+                int skip = newLabel();
+                branch(n->kids[0], !when, skip);
+                branch(n->kids[1], when, label);
+                place(skip);
+            }
+            return;
+        }
+        if (n->kind == NODE_BINARY && isComparison(n->op)) {
+            TokenType cond = when ? n->op : negateComparison(n->op);
+            binary(TAC_BRANCH, cond, n->kids[0], n->kids[1]).label = label;
+            return;
+        }
+        int v = value(n);
+        TacInsn& in = add(TAC_BRANCH);
+        in.cond = when ? TOK_NE : TOK_EQ;
+        in.a = v;
+        in.hasImm = true;
+        in.imm = 0;
+        in.label = label;
+    }
+
+    void stmt(const Node* n) {
+        switch (n->kind) {
+            case NODE_DECL:
+                for (const Node* var : n->kids) {
+                    if (var->kids.empty()) {
+                        TacInsn& in = add(TAC_CONST);
+                        in.dst = var->slot;
+                        in.imm = 0;
+                    } else {
+                        assign(var->slot, var->kids[0]);
+                    }
+                }
+                break;
+            case NODE_ASSIGN:
+                assign(n->slot, n->kids[0]);
+                break;
+            case NODE_EXPR:
+                value(n->kids[0]);
+                break;
+            case NODE_IF: {
+                int elseLabel = newLabel();
+                branch(n->kids[0], false, elseLabel);
+                stmt(n->kids[1]);
+                if (n->kids.size() > 2) {
+                    int end = newLabel();
+                    jump(end);
+                    place(elseLabel);
+                    stmt(n->kids[2]);
+                    place(end);
+                } else {
+                    place(elseLabel);
+                }
+                break;
+            }
+            case NODE_WHILE: {
+                int head = newLabel(), exit = newLabel();
+                place(head);
+                branch(n->kids[0], false, exit);
+                loops.push_back(make_pair(head, exit));
+                stmt(n->kids[1]);
+                loops.pop_back();
+                jump(head);
+                place(exit);
+                break;
+            }
+            case NODE_BREAK:
+                jump(loops.back().second);
+                break;
+            case NODE_CONTINUE:
+                jump(loops.back().first);
+                break;
+            case NODE_RETURN: {
+                int v;
+                if (n->kids.empty()) {
+                    v = temp();
+                    TacInsn& in = add(TAC_CONST);
+                    in.dst = v;
+                    in.imm = 0;
+                } else {
+                    v = value(n->kids[0]);
+                }
+                add(TAC_RET).a = v;
+                break;
+            }
+            case NODE_BLOCK:
+                for (const Node* kid : n->kids) stmt(kid);
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Reading the old value while computing the new one is fine: every
+    // TAC instruction reads its operands before writing dst.
+    void assign(int slot, const Node* value) {
+        if (value->kind == NODE_BINARY && (value->op == TOK_AND || value->op == TOK_OR)) {
+            // The jumping code writes dst before it has read every operand.
+            int t = temp();
+            valueInto(value, t);
+            TacInsn& in = add(TAC_COPY);
+            in.dst = slot;
+            in.a = t;
+            return;
+        }
+        valueInto(value, slot);
+    }
+
+public:
+    TacLowering(TacFunc& f) : fn(f) {}
+
+    void lower(const FuncDef& f) {
+        fn.name = f.name;
+        fn.params = (int)f.params.size();
+        fn.regs = max(f.frameSize, 1);
+        fn.labels = 0;
+        stmt(f.body);
+        int zero = temp();
+        TacInsn& in = add(TAC_CONST);
+        in.dst = zero;
+        in.imm = 0;
+        add(TAC_RET).a = zero;
+    }
+};
+
+// Signed division and remainder by a constant, rewritten to a multiply by
+// a fixed-point reciprocal and shifts (Hacker's Delight, chapter 10), or
+// to shifts alone for powers of two. Both round towards zero like the
+// division they replace, INT_MIN / -1 included; a zero divisor keeps its
+// runtime error and INT_MIN keeps the real division.
+class DivisionByConstant {
+private:
+    TacFunc& fn;
+    vector<TacInsn> out;
+
+    TacInsn& add(TacOp op, int dst, int a) {
+        TacInsn in;
+        in.op = op;
+        in.cond = TOK_EOF;
+        in.dst = dst;
+        in.a = a;
+        in.b = -1;
+        in.hasImm = false;
+        in.imm = 0;
+        in.label = -1;
+        out.push_back(in);
+        return out.back();
+    }
+
+    void immediate(TacOp op, int dst, int a, int imm) {
+        TacInsn& in = add(op, dst, a);
+        in.hasImm = true;
+        in.imm = imm;
+    }
+
+    int shift(TacOp op, int a, int k) {
+        int t = fn.regs++;
+        immediate(op, t, a, k);
+        return t;
+    }
+
+    void binary(TokenType op, int dst, int a, int b) {
+        TacInsn& in = add(TAC_BINARY, dst, a);
+        in.cond = op;
+        in.b = b;
+    }
+
+    // Multiplier m and shift s with n / d == mulhi(m, n) >> s, corrected
+    // by n when the signs of m and d differ, plus one for negative results.
+    static void magic(int d, int& m, int& s) {
+        const uint32_t two31 = 0x80000000u;
+        uint32_t ad = d < 0 ? 0u - (uint32_t)d : (uint32_t)d;
+        uint32_t t = two31 + ((uint32_t)d >> 31);
+        uint32_t anc = t - 1 - t % ad;
+        uint32_t q1 = two31 / anc, r1 = two31 - q1 * anc;
+        uint32_t q2 = two31 / ad, r2 = two31 - q2 * ad;
+        int p = 31;
+        uint32_t delta;
+        do {
+            p++;
+            q1 *= 2;
+            r1 *= 2;
+            if (r1 >= anc) {
+                q1++;
+                r1 -= anc;
+            }
+            q2 *= 2;
+            r2 *= 2;
+            if (r2 >= ad) {
+                q2++;
+                r2 -= ad;
+            }
+            delta = ad - r2;
+        } while (q1 < delta || (q1 == delta && r1 == 0));
+        m = (int)(q2 + 1);
+        if (d < 0) m = (int)(0u - (uint32_t)m);
+        s = p - 32;
+    }
+
+    void rewrite(const TacInsn& in) {
+        int n = in.a, d = in.imm;
+        bool mod = in.cond == TOK_MOD;
+        if (d == 1 || d == -1) {
+            if (mod) immediate(TAC_CONST, in.dst, -1, 0);
+            else add(d == 1 ? TAC_COPY : TAC_NEG, in.dst, n);
+            return;
+        }
+        uint32_t ad = d < 0 ? 0u - (uint32_t)d : (uint32_t)d;
+        if ((ad & (ad - 1)) == 0) {
+            // Negative n is biased by |d| - 1 so the shift truncates
+            // towards zero.
+            int k = 0;
+            while ((1u << k) != ad) k++;
+            int sign = k > 1 ? shift(TAC_SHR, n, k - 1) : n;
+            int bias = shift(TAC_SHRU, sign, 32 - k);
+            int t = fn.regs++;
+            binary(TOK_PLUS, t, n, bias);
+            if (mod) {
+                int q = shift(TAC_SHR, t, k);
+                binary(TOK_MINUS, in.dst, n, shift(TAC_SHL, q, k));
+            } else if (d > 0) {
+                immediate(TAC_SHR, in.dst, t, k);
+            } else {
+                add(TAC_NEG, in.dst, shift(TAC_SHR, t, k));
+            }
+            return;
+        }
+        int m, s;
+        magic(d, m, s);
+        int q = fn.regs++;
+        immediate(TAC_MULHI, q, n, m);
+        if (d > 0 && m < 0) binary(TOK_PLUS, q, q, n);
+        if (d < 0 && m > 0) binary(TOK_MINUS, q, q, n);
+        if (s > 0) q = shift(TAC_SHR, q, s);
+        int sign = shift(TAC_SHRU, q, 31);
+        if (!mod) {
+            binary(TOK_PLUS, in.dst, q, sign);
+            return;
+        }
+        int quotient = fn.regs++;
+        binary(TOK_PLUS, quotient, q, sign);
+        int product = fn.regs++;
+        immediate(TAC_BINARY, product, quotient, d);
+        out.back().cond = TOK_STAR;
+        binary(TOK_MINUS, in.dst, n, product);
+    }
+
+public:
+    DivisionByConstant(TacFunc& f) : fn(f) {}
+
+    void run() {
+        for (const auto& in : fn.code) {
+            if (in.op == TAC_BINARY && (in.cond == TOK_DIV || in.cond == TOK_MOD) && in.hasImm && in.imm != 0 &&
+                in.imm != INT_MIN) {
+                rewrite(in);
+            } else {
+                out.push_back(in);
+            }
+        }
+        fn.code.swap(out);
+    }
+};
+
+vector<TacFunc> lowerToTac(const Program& prog) {
+    vector<TacFunc> funcs(prog.funcs.size());
+    for (size_t i = 0; i < prog.funcs.size(); i++) {
+        TacLowering(funcs[i]).lower(prog.funcs[i]);
+        DivisionByConstant(funcs[i]).run();
+    }
+    return funcs;
+}
+
+// --emit-tac: a readable dump of the three-address code.
+void printTac(const Program& prog, const vector<TacFunc>& funcs, ostream& out) {
+    auto operand = [](const TacInsn& in) { return in.hasImm ? to_string(in.imm) : "r" + to_string(in.b); };
+    for (const auto& f : funcs) {
+        out << f.name << "(" << f.params << " params, " << f.regs << " regs):\n";
+        for (const auto& in : f.code) {
+            switch (in.op) {
+                case TAC_CONST: out << "  r" << in.dst << " = " << in.imm << "\n"; break;
+                case TAC_COPY: out << "  r" << in.dst << " = r" << in.a << "\n"; break;
+                case TAC_NEG: out << "  r" << in.dst << " = -r" << in.a << "\n"; break;
+                case TAC_NOT: out << "  r" << in.dst << " = !r" << in.a << "\n"; break;
+                case TAC_MULHI: out << "  r" << in.dst << " = mulhi r" << in.a << ", " << in.imm << "\n"; break;
+                case TAC_SHL: case TAC_SHR: case TAC_SHRU: {
+                    static const char* names[] = { "<<", ">>", ">>>" };
+                    out << "  r" << in.dst << " = r" << in.a << " " << names[in.op - TAC_SHL] << " " << in.imm << "\n";
+                    break;
+                }
+                case TAC_BINARY:
+                    out << "  r" << in.dst << " = r" << in.a << " " << tokenText(in.cond) << " " << operand(in) << "\n";
+                    break;
+                case TAC_JUMP: out << "  goto L" << in.label << "\n"; break;
+                case TAC_BRANCH:
+                    out << "  if r" << in.a << " " << tokenText(in.cond) << " " << operand(in) << " goto L" << in.label
+                        << "\n";
+                    break;
+                case TAC_CALL:
+                    out << "  r" << in.dst << " = " << prog.funcs[in.label].name << "(";
+                    for (size_t i = 0; i < in.args.size(); i++) out << (i ? ", " : "") << "r" << in.args[i];
+                    out << ")\n";
+                    break;
+                case TAC_RET: out << "  return r" << in.a << "\n"; break;
+                case TAC_LABEL: out << "L" << in.label << ":\n"; break;
+            }
+        }
+    }
+}
+
+// Machine instructions shared by the native backends. Registers below
+// VREG_BASE are physical; the rest are virtual until allocation. What op,
+// cond and label mean is up to the target.
+const int VREG_BASE = 64;
+
+struct MInst {
+    int op;
+    int rd, rn, rm, ra;
+    int imm;
+    TokenType cond;
+    int label;
+};
+
+struct MFunc {
+    string name;
+    vector<MInst> code;
+    int vregs;
+    int labels;
+    // Filled by register allocation.
+    int spillSlots;
+    vector<int> savedRegs;
+    int outgoing;
+};
+
+// Linear-scan register allocation. Live ranges are computed from liveness
+// over the instruction list and treated as one interval each. Ranges that
+// cross a call only get callee-saved registers. A spilled virtual register
+// lives in a frame slot and is reloaded into a scratch register around
+// each instruction that touches it. Target supplies the operand roles,
+// control flow and register classes.
+template <class Target>
+class LinearScan {
+private:
+    MFunc& fn;
+
+    struct Interval {
+        int reg, start, end;
+        bool crossesCall;
+        int phys, slot;
+    };
+
+    static bool isVirtual(int r) { return r >= VREG_BASE; }
+
+    void liveness(vector<Interval>& iv) {
+        const vector<MInst>& code = fn.code;
+        int n = (int)code.size();
+        int nv = fn.vregs;
+        map<int, int> labelAt;
+        for (int i = 0; i < n; i++) {
+            if (Target::isLabel(code[i])) labelAt[code[i].label] = i;
+        }
+        vector<vector<int> > succ(n);
+        for (int i = 0; i < n; i++) {
+            const MInst& in = code[i];
+            if (Target::isBranch(in)) succ[i].push_back(labelAt[in.label]);
+            if (!Target::endsFlow(in) && i + 1 < n) succ[i].push_back(i + 1);
+        }
+        // Backward dataflow over instructions, one bit per vreg, 64 to a word.
+        int words = (nv + 63) / 64;
+        vector<uint64_t> liveIn((size_t)n * words, 0);
+        vector<uint64_t> live(words);
+        int uses[4], defs[2];
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (int i = n - 1; i >= 0; i--) {
+                fill(live.begin(), live.end(), 0);
+                for (int s : succ[i]) {
+                    for (int w = 0; w < words; w++) live[w] |= liveIn[(size_t)s * words + w];
+                }
+                int nd = Target::defs(code[i], defs), nu = Target::uses(code[i], uses);
+                for (int k = 0; k < nd; k++) {
+                    int v = defs[k] - VREG_BASE;
+                    if (v >= 0) live[v / 64] &= ~(1ULL << (v % 64));
+                }
+                for (int k = 0; k < nu; k++) {
+                    int v = uses[k] - VREG_BASE;
+                    if (v >= 0) live[v / 64] |= 1ULL << (v % 64);
+                }
+                uint64_t* in = &liveIn[(size_t)i * words];
+                if (!equal(live.begin(), live.end(), in)) {
+                    copy(live.begin(), live.end(), in);
+                    changed = true;
+                }
+            }
+        }
+        iv.assign(nv, Interval());
+        for (int v = 0; v < nv; v++) {
+            iv[v].reg = v + VREG_BASE;
+            iv[v].start = INT_MAX;
+            iv[v].end = -1;
+            iv[v].crossesCall = false;
+            iv[v].phys = -1;
+            iv[v].slot = -1;
+        }
+        auto touch = [&](int v, int at) {
+            iv[v].start = min(iv[v].start, at);
+            iv[v].end = max(iv[v].end, at);
+        };
+        for (int i = 0; i < n; i++) {
+            for (int w = 0; w < words; w++) {
+                for (uint64_t bits = liveIn[(size_t)i * words + w]; bits; bits &= bits - 1) {
+                    touch(w * 64 + __builtin_ctzll(bits), i);
+                }
+            }
+            int nd = Target::defs(code[i], defs);
+            for (int k = 0; k < nd; k++) {
+                if (isVirtual(defs[k])) touch(defs[k] - VREG_BASE, i);
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            if (!Target::isCall(code[i])) continue;
+            for (auto& t : iv) {
+                if (t.start < i && t.end > i) t.crossesCall = true;
+            }
+        }
+    }
+
+public:
+    LinearScan(MFunc& f) : fn(f) {}
+
+    void run() {
+        vector<Interval> iv;
+        liveness(iv);
+        vector<Interval*> order;
+        for (auto& t : iv) {
+            if (t.end >= 0) order.push_back(&t);
+        }
+        sort(order.begin(), order.end(), [](const Interval* a, const Interval* b) { return a->start < b->start; });
+
+        vector<Interval*> active;
+        set<int> freeRegs;
+        for (int r : Target::callerSaved()) freeRegs.insert(r);
+        for (int r : Target::calleeSaved()) freeRegs.insert(r);
+        set<int> usedCalleeSaved;
+        fn.spillSlots = 0;
+        auto allowed = [](const Interval* t, int r) { return !t->crossesCall || Target::isCalleeSaved(r); };
+
+        for (Interval* cur : order) {
+            for (size_t k = 0; k < active.size();) {
+                if (active[k]->end < cur->start) {
+                    freeRegs.insert(active[k]->phys);
+                    active.erase(active.begin() + k);
+                } else {
+                    k++;
+                }
+            }
+            int pick = -1;
+            // Prefer caller-saved registers, which cost nothing to use.
+            for (int r : Target::callerSaved()) {
+                if (freeRegs.count(r) && allowed(cur, r)) {
+                    pick = r;
+                    break;
+                }
+            }
+            if (pick < 0) {
+                for (int r : Target::calleeSaved()) {
+                    if (freeRegs.count(r)) {
+                        pick = r;
+                        break;
+                    }
+                }
+            }
+            if (pick < 0) {
+                // Spill whichever compatible interval ends last.
+                Interval* victim = cur;
+                for (Interval* a : active) {
+                    if (a->end > victim->end && allowed(cur, a->phys)) victim = a;
+                }
+                if (victim != cur) {
+                    pick = victim->phys;
+                    victim->phys = -1;
+                    victim->slot = fn.spillSlots++;
+                    active.erase(find(active.begin(), active.end(), victim));
+                } else {
+                    cur->slot = fn.spillSlots++;
+                    continue;
+                }
+            } else {
+                freeRegs.erase(pick);
+            }
+            cur->phys = pick;
+            if (Target::isCalleeSaved(pick)) usedCalleeSaved.insert(pick);
+            active.push_back(cur);
+        }
+        fn.savedRegs.assign(usedCalleeSaved.begin(), usedCalleeSaved.end());
+
+        vector<MInst> out;
+        int uses[4], defs[2] = { 0, 0 };
+        for (MInst in : fn.code) {
+            int nu = Target::uses(in, uses), nd = Target::defs(in, defs);
+            map<int, int> reloaded;
+            int scratch = 0;
+            for (int k = 0; k < nu; k++) {
+                if (!isVirtual(uses[k])) continue;
+                const Interval& t = iv[uses[k] - VREG_BASE];
+                if (t.slot >= 0 && !reloaded.count(uses[k])) {
+                    int r = Target::scratch(scratch++);
+                    out.push_back(Target::reload(r, t.slot));
+                    reloaded[uses[k]] = r;
+                }
+            }
+            int spillDef = -1, spillReg = -1;
+            for (int k = 0; k < nd; k++) {
+                if (isVirtual(defs[k]) && iv[defs[k] - VREG_BASE].slot >= 0) {
+                    spillDef = iv[defs[k] - VREG_BASE].slot;
+                    spillReg = Target::scratch(0);
+                }
+            }
+            auto remap = [&](int& r, bool isDef) {
+                if (!isVirtual(r)) return;
+                const Interval& t = iv[r - VREG_BASE];
+                if (t.slot < 0) r = t.phys >= 0 ? t.phys : Target::scratch(0);
+                else if (isDef) r = spillReg;
+                else r = reloaded[r];
+            };
+            Target::mapRegisters(in, remap);
+            out.push_back(in);
+            if (spillDef >= 0) out.push_back(Target::spill(spillReg, spillDef));
+        }
+        fn.code.swap(out);
+    }
+};
+
+// Peephole optimization of allocated code. A rule looks at a window of
+// consecutive instructions and may replace it; windows slide over each
+// function and passes repeat until no rule applies. Rules can ask whether
+// a physical register is dead after an instruction of the window, from
+// liveness recomputed before every pass. Target supplies the rule table
+// and the registers calls and returns use or clobber implicitly.
+struct PeepWindow {
+    const MInst* code;
+    const uint64_t* liveOut;
+
+    const MInst& operator[](int k) const { return code[k]; }
+    bool dead(int k, int r) const { return r < 64 && !(liveOut[k] >> r & 1); }
+};
+
+struct PeepRule {
+    const char* name;
+    int size;
+    // Appends the replacement of the window to out, or returns false.
+    bool (*apply)(const PeepWindow& w, vector<MInst>& out);
+};
+
+struct PeepholeStats {
+    int before, after;
+    map<string, int> fired;
+
+    PeepholeStats() : before(0), after(0) {}
+
+    void report(ostream& out) const {
+        char line[96];
+        snprintf(line, sizeof line, "peephole: %d -> %d instructions (%.1f%% fewer)\n", before, after,
+                 before ? 100.0 * (before - after) / before : 0.0);
+        out << line;
+        for (const auto& f : fired) {
+            snprintf(line, sizeof line, "  %-20s %6d\n", f.first.c_str(), f.second);
+            out << line;
+        }
+    }
+};
+
+template <class Target>
+class Peephole {
+private:
+    MFunc& fn;
+    PeepholeStats& stats;
+    vector<uint64_t> liveOut;
+
+    void liveness() {
+        const vector<MInst>& code = fn.code;
+        int n = (int)code.size();
+        map<int, int> labelAt;
+        for (int i = 0; i < n; i++) {
+            if (Target::isLabel(code[i])) labelAt[code[i].label] = i;
+        }
+        vector<uint64_t> liveIn(n, 0);
+        liveOut.assign(n, 0);
+        int uses[4], defs[2];
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (int i = n - 1; i >= 0; i--) {
+                const MInst& in = code[i];
+                uint64_t out = 0;
+                if (Target::isBranch(in)) out |= liveIn[labelAt[in.label]];
+                if (!Target::endsFlow(in) && i + 1 < n) out |= liveIn[i + 1];
+                uint64_t live = out & ~Target::implicitDefs(in);
+                int nd = Target::defs(in, defs), nu = Target::uses(in, uses);
+                for (int k = 0; k < nd; k++) live &= ~(1ULL << defs[k]);
+                for (int k = 0; k < nu; k++) live |= 1ULL << uses[k];
+                live |= Target::implicitUses(in);
+                liveOut[i] = out;
+                if (live != liveIn[i]) {
+                    liveIn[i] = live;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    bool pass() {
+        liveness();
+        const vector<MInst>& code = fn.code;
+        size_t n = code.size();
+        vector<MInst> out;
+        bool changed = false;
+        for (size_t i = 0; i < n;) {
+            bool matched = false;
+            for (const PeepRule& rule : Target::peepholes()) {
+                if (i + rule.size > n) continue;
+                PeepWindow w = { &code[i], &liveOut[i] };
+                size_t mark = out.size();
+                if (rule.apply(w, out)) {
+                    stats.fired[rule.name]++;
+                    i += rule.size;
+                    matched = changed = true;
+                    break;
+                }
+                out.resize(mark);
+            }
+            if (!matched) out.push_back(code[i++]);
+        }
+        fn.code.swap(out);
+        return changed;
+    }
+
+public:
+    Peephole(MFunc& f, PeepholeStats& s) : fn(f), stats(s) {}
+
+    void run() {
+        stats.before += (int)fn.code.size();
+        while (pass()) {
+        }
+        stats.after += (int)fn.code.size();
+    }
+};
+
+// Peephole rules every target shares, written against the Target traits.
+template <class Target>
+bool peepSelfMove(const PeepWindow& w, vector<MInst>&) {
+    return Target::isMove(w[0]) && w[0].rd == w[0].rn;
+}
+
+// Nothing after a jump or return is reached until the next label.
+template <class Target>
+bool peepUnreachable(const PeepWindow& w, vector<MInst>& out) {
+    if (!Target::endsFlow(w[0]) || Target::isLabel(w[1])) return false;
+    out.push_back(w[0]);
+    return true;
+}
+
+template <class Target>
+bool peepJumpToNext(const PeepWindow& w, vector<MInst>& out) {
+    if (!Target::endsFlow(w[0]) || !Target::isBranch(w[0]) || !Target::isLabel(w[1])) return false;
+    if (w[0].label != w[1].label) return false;
+    out.push_back(w[1]);
+    return true;
+}
+
+// if c goto L1; goto L2; L1:  =>  if !c goto L2; L1:
+template <class Target>
+bool peepBranchOverJump(const PeepWindow& w, vector<MInst>& out) {
+    if (!Target::isCondBranch(w[0]) || !Target::endsFlow(w[1]) || !Target::isBranch(w[1])) return false;
+    if (!Target::isLabel(w[2]) || w[0].label != w[2].label) return false;
+    MInst b = Target::invert(w[0]);
+    b.label = w[1].label;
+    out.push_back(b);
+    out.push_back(w[2]);
+    return true;
+}
+
+// The second of two identical tests falls through whenever it is reached.
+template <class Target>
+bool peepRepeatedTest(const PeepWindow& w, vector<MInst>& out) {
+    const MInst &a = w[0], &b = w[1];
+    if (!Target::isCondBranch(a) || b.op != a.op || b.rn != a.rn || b.rm != a.rm || b.cond != a.cond) return false;
+    out.push_back(a);
+    return true;
+}
+
+// mov t, x; op ..t..  =>  op ..x..  when t dies there.
+template <class Target>
+bool peepCopyForward(const PeepWindow& w, vector<MInst>& out) {
+    if (!Target::isMove(w[0]) || w[0].rd == w[0].rn) return false;
+    int t = w[0].rd, x = w[0].rn;
+    MInst in = w[1];
+    int uses[4];
+    int nu = Target::uses(in, uses);
+    if (find(uses, uses + nu, t) == uses + nu || (Target::implicitUses(in) >> t & 1) || !w.dead(1, t)) return false;
+    Target::mapRegisters(in, [&](int& r, bool isDef) {
+        if (!isDef && r == t) r = x;
+    });
+    out.push_back(in);
+    return true;
+}
+
+// op t, ...; mov d, t  =>  op d, ...  when t dies at the move.
+template <class Target>
+bool peepDefForward(const PeepWindow& w, vector<MInst>& out) {
+    if (!Target::isMove(w[1]) || w[1].rd == w[1].rn) return false;
+    int t = w[1].rn, d = w[1].rd;
+    MInst in = w[0];
+    int defs[2];
+    if (Target::isCall(in) || Target::defs(in, defs) != 1 || defs[0] != t || !w.dead(1, t)) return false;
+    Target::mapRegisters(in, [&](int& r, bool isDef) {
+        if (isDef) r = d;
+    });
+    out.push_back(in);
+    return true;
+}
+
+// A reload straight after the spill of the same slot reads the register
+// that was just stored.
+template <class Target>
+bool peepStoreReload(const PeepWindow& w, vector<MInst>& out) {
+    const MInst &st = w[0], &ld = w[1];
+    if (st.op != Target::spill(0, 0).op || ld.op != Target::reload(0, 0).op || st.imm != ld.imm) return false;
+    out.push_back(st);
+    if (ld.rd != st.rd) out.push_back(Target::move(ld.rd, st.rd));
+    return true;
+}
+
+// AArch64 instruction selection. All ToyC values are 32-bit, so every
+// operation uses w registers; x registers appear only in frame handling.
+enum A64Op {
+    A64_LABEL,
+    A64_MOV,        // rd = rn
+    A64_MOVI,       // rd = imm, expanded to mov/movz/movk
+    A64_ADD, A64_SUB, A64_MUL, A64_SDIV,  // rd = rn <op> rm
+    A64_ADDI, A64_SUBI,                   // rd = rn <op> imm (0..4095)
+    A64_MSUB,       // rd = ra - rn * rm
+    A64_MADD,       // rd = ra + rn * rm
+    A64_MULHI,      // rd = high half of the signed rn * rm, via smull and lsr
+    A64_LSLI, A64_ASRI, A64_LSRI,         // rd = rn <shift> imm (1..31)
+    A64_NEG,        // rd = -rn
+    A64_CMP,        // flags = rn - rm
+    A64_CMPI,       // flags = rn - imm
+    A64_CMNI,       // flags = rn + imm
+    A64_CSET,       // rd = cond ? 1 : 0
+    A64_B,
+    A64_BCOND,
+    A64_CBZ, A64_CBNZ,
+    A64_BL,         // call function `label`
+    A64_LDR,        // rd = spill slot imm
+    A64_STR,        // spill slot imm = rd
+    A64_LDRARG,     // rd = incoming stack argument imm
+    A64_STRARG,     // outgoing stack argument imm = rn
+    A64_RET,        // epilogue and return of w0
+};
+
+// Branch target of the shared division-by-zero stub.
+const int LABEL_DIVZERO = -2;
+
+struct A64Target {
+    static const int SP = 31;
+
+    static int uses(const MInst& in, int* out) {
+        switch (in.op) {
+            case A64_MOV: case A64_ADDI: case A64_SUBI: case A64_NEG: case A64_CMPI: case A64_CMNI:
+            case A64_CBZ: case A64_CBNZ: case A64_STRARG: case A64_LSLI: case A64_ASRI: case A64_LSRI:
+                out[0] = in.rn;
+                return 1;
+            case A64_ADD: case A64_SUB: case A64_MUL: case A64_SDIV: case A64_MULHI: case A64_CMP:
+                out[0] = in.rn;
+                out[1] = in.rm;
+                return 2;
+            case A64_MSUB: case A64_MADD:
+                out[0] = in.rn;
+                out[1] = in.rm;
+                out[2] = in.ra;
+                return 3;
+            case A64_STR:
+                out[0] = in.rd;
+                return 1;
+            default:
+                return 0;
+        }
+    }
+
+    static int defs(const MInst& in, int* out) {
+        switch (in.op) {
+            case A64_MOV: case A64_MOVI: case A64_ADD: case A64_SUB: case A64_MUL: case A64_SDIV: case A64_ADDI:
+            case A64_SUBI: case A64_MSUB: case A64_MADD: case A64_MULHI: case A64_LSLI: case A64_ASRI: case A64_LSRI:
+            case A64_NEG: case A64_CSET: case A64_LDR: case A64_LDRARG:
+                out[0] = in.rd;
+                return 1;
+            default:
+                return 0;
+        }
+    }
+
+    template <class F>
+    static void mapRegisters(MInst& in, F map) {
+        int d[2], u[4];
+        if (in.op == A64_STR) {
+            map(in.rd, false);
+            return;
+        }
+        int nu = uses(in, u);
+        if (nu > 0) map(in.rn, false);
+        if (nu > 1) map(in.rm, false);
+        if (nu > 2) map(in.ra, false);
+        if (defs(in, d) > 0) map(in.rd, true);
+    }
+
+    static bool isLabel(const MInst& in) { return in.op == A64_LABEL; }
+
+    static bool isBranch(const MInst& in) {
+        return (in.op == A64_B || in.op == A64_BCOND || in.op == A64_CBZ || in.op == A64_CBNZ) && in.label >= 0;
+    }
+
+    static bool endsFlow(const MInst& in) { return in.op == A64_B || in.op == A64_RET; }
+
+    static bool isCall(const MInst& in) { return in.op == A64_BL; }
+
+    static bool isCondBranch(const MInst& in) { return in.op == A64_BCOND || in.op == A64_CBZ || in.op == A64_CBNZ; }
+
+    static MInst invert(MInst in) {
+        if (in.op == A64_BCOND) in.cond = negateComparison(in.cond);
+        else in.op = in.op == A64_CBZ ? A64_CBNZ : A64_CBZ;
+        return in;
+    }
+
+    static bool isMove(const MInst& in) { return in.op == A64_MOV; }
+
+    // Calls read the argument registers x0-x7 and clobber x0-x17; the
+    // return reads w0.
+    static uint64_t implicitUses(const MInst& in) { return in.op == A64_BL ? 0xff : in.op == A64_RET ? 1 : 0; }
+    static uint64_t implicitDefs(const MInst& in) { return in.op == A64_BL ? 0x3ffff : 0; }
+
+    static const vector<PeepRule>& peepholes();
+
+    static const vector<int>& callerSaved() {
+        static const vector<int> regs = { 9, 10, 11, 12, 13, 14, 15 };
+        return regs;
+    }
+
+    static const vector<int>& calleeSaved() {
+        static const vector<int> regs = { 19, 20, 21, 22, 23, 24, 25, 26, 27, 28 };
+        return regs;
+    }
+
+    static bool isCalleeSaved(int r) { return r >= 19 && r <= 28; }
+
+    // x16 and x17 (the intra-procedure-call registers) and x8 are never
+    // allocated; spill code and the prologue use them.
+    static int scratch(int i) {
+        static const int regs[] = { 16, 17, 8 };
+        return regs[i];
+    }
+
+    static MInst make(int op, int rd = -1, int rn = -1, int rm = -1, int imm = 0) {
+        MInst in = { op, rd, rn, rm, -1, imm, TOK_EOF, -1 };
+        return in;
+    }
+
+    static MInst move(int rd, int rn) { return make(A64_MOV, rd, rn); }
+    static MInst reload(int r, int slot) { return make(A64_LDR, r, -1, -1, slot); }
+    static MInst spill(int r, int slot) { return make(A64_STR, r, -1, -1, slot); }
+};
+
+// mul t, a, b; add d, t, c  =>  madd d, a, b, c, and sub d, c, t to msub.
+bool a64MultiplyAdd(const PeepWindow& w, vector<MInst>& out) {
+    const MInst &mul = w[0], &op = w[1];
+    int t = mul.rd;
+    if (mul.op != A64_MUL || (op.op != A64_ADD && op.op != A64_SUB) || !w.dead(1, t)) return false;
+    int other;
+    if (op.rm == t && op.rn != t) other = op.rn;
+    else if (op.op == A64_ADD && op.rn == t && op.rm != t) other = op.rm;
+    else return false;
+    MInst in = A64Target::make(op.op == A64_ADD ? A64_MADD : A64_MSUB, op.rd, mul.rn, mul.rm);
+    in.ra = other;
+    out.push_back(in);
+    return true;
+}
+
+// cset t, c; cbz t, L  =>  b.!c L, and cbnz to b.c.
+bool a64CompareBranch(const PeepWindow& w, vector<MInst>& out) {
+    const MInst &set = w[0], &b = w[1];
+    if (set.op != A64_CSET || (b.op != A64_CBZ && b.op != A64_CBNZ) || b.rn != set.rd || b.label < 0) return false;
+    if (!w.dead(1, set.rd)) return false;
+    MInst in = A64Target::make(A64_BCOND);
+    in.cond = b.op == A64_CBNZ ? set.cond : negateComparison(set.cond);
+    in.label = b.label;
+    out.push_back(in);
+    return true;
+}
+
+const vector<PeepRule>& A64Target::peepholes() {
+    static const vector<PeepRule> rules = {
+        { "self-move", 1, peepSelfMove<A64Target> },
+        { "unreachable", 2, peepUnreachable<A64Target> },
+        { "jump-to-next", 2, peepJumpToNext<A64Target> },
+        { "branch-over-jump", 3, peepBranchOverJump<A64Target> },
+        { "repeated-test", 2, peepRepeatedTest<A64Target> },
+        { "store-reload", 2, peepStoreReload<A64Target> },
+        { "copy-forward", 2, peepCopyForward<A64Target> },
+        { "def-forward", 2, peepDefForward<A64Target> },
+        { "multiply-add", 2, a64MultiplyAdd },
+        { "compare-branch", 2, a64CompareBranch },
+    };
+    return rules;
+}
+
+class A64Selector {
+private:
+    const TacFunc& tac;
+    MFunc& fn;
+
+    int vreg(int r) const { return VREG_BASE + r; }
+    int temp() { return VREG_BASE + fn.vregs++; }
+
+    MInst& emit(int op, int rd = -1, int rn = -1, int rm = -1, int imm = 0) {
+        fn.code.push_back(A64Target::make(op, rd, rn, rm, imm));
+        return fn.code.back();
+    }
+
+    int constant(int value) {
+        int t = temp();
+        emit(A64_MOVI, t, -1, -1, value);
+        return t;
+    }
+
+    int rhs(const TacInsn& in) { return in.hasImm ? constant(in.imm) : vreg(in.b); }
+
+    // Sets the flags for a <op> b|imm.
+    void compare(const TacInsn& in) {
+        if (in.hasImm && in.imm >= 0 && in.imm <= 4095) emit(A64_CMPI, -1, vreg(in.a), -1, in.imm);
+        else if (in.hasImm && in.imm < 0 && in.imm >= -4095) emit(A64_CMNI, -1, vreg(in.a), -1, -in.imm);
+        else emit(A64_CMP, -1, vreg(in.a), rhs(in));
+    }
+
+    void addImmediate(int rd, int rn, int imm, bool subtract) {
+        if (imm == INT_MIN) {
+            emit(subtract ? A64_SUB : A64_ADD, rd, rn, constant(imm));
+            return;
+        }
+        if (imm < 0) {
+            imm = -imm;
+            subtract = !subtract;
+        }
+        if (imm <= 4095) emit(subtract ? A64_SUBI : A64_ADDI, rd, rn, -1, imm);
+        else emit(subtract ? A64_SUB : A64_ADD, rd, rn, constant(imm));
+    }
+
+    void binary(const TacInsn& in) {
+        int rd = vreg(in.dst), rn = vreg(in.a);
+        switch (in.cond) {
+            case TOK_PLUS:
+            case TOK_MINUS:
+                if (in.hasImm) addImmediate(rd, rn, in.imm, in.cond == TOK_MINUS);
+                else emit(in.cond == TOK_PLUS ? A64_ADD : A64_SUB, rd, rn, vreg(in.b));
+                break;
+            case TOK_STAR:
+                emit(A64_MUL, rd, rn, rhs(in));
+                break;
+            case TOK_DIV:
+            case TOK_MOD: {
+                // sdiv already gives INT_MIN for INT_MIN / -1 and msub then
+                // gives 0, as ToyC wants; only zero needs a check.
+                int rm = rhs(in);
+                if (!in.hasImm || in.imm == 0) fn.code.push_back(branchTo(A64_CBZ, rm, LABEL_DIVZERO));
+                if (in.cond == TOK_DIV) {
+                    emit(A64_SDIV, rd, rn, rm);
+                } else {
+                    int q = temp();
+                    emit(A64_SDIV, q, rn, rm);
+                    emit(A64_MSUB, rd, q, rm).ra = rn;
+                }
+                break;
+            }
+            default:
+                compare(in);
+                emit(A64_CSET, rd).cond = in.cond;
+                break;
+        }
+    }
+
+    static MInst branchTo(int op, int rn, int label) {
+        MInst in = A64Target::make(op, -1, rn);
+        in.label = label;
+        return in;
+    }
+
+public:
+    A64Selector(const TacFunc& t, MFunc& f) : tac(t), fn(f) {}
+
+    void select() {
+        fn.name = tac.name;
+        fn.vregs = tac.regs;
+        fn.labels = tac.labels;
+        fn.outgoing = 0;
+        for (int i = 0; i < tac.params; i++) {
+            if (i < 8) emit(A64_MOV, vreg(i), i);
+            else emit(A64_LDRARG, vreg(i), -1, -1, i - 8);
+        }
+        for (const auto& in : tac.code) {
+            switch (in.op) {
+                case TAC_CONST: emit(A64_MOVI, vreg(in.dst), -1, -1, in.imm); break;
+                case TAC_COPY: emit(A64_MOV, vreg(in.dst), vreg(in.a)); break;
+                case TAC_NEG: emit(A64_NEG, vreg(in.dst), vreg(in.a)); break;
+                case TAC_MULHI: emit(A64_MULHI, vreg(in.dst), vreg(in.a), constant(in.imm)); break;
+                case TAC_SHL: emit(A64_LSLI, vreg(in.dst), vreg(in.a), -1, in.imm); break;
+                case TAC_SHR: emit(A64_ASRI, vreg(in.dst), vreg(in.a), -1, in.imm); break;
+                case TAC_SHRU: emit(A64_LSRI, vreg(in.dst), vreg(in.a), -1, in.imm); break;
+                case TAC_NOT:
+                    emit(A64_CMPI, -1, vreg(in.a), -1, 0);
+                    emit(A64_CSET, vreg(in.dst)).cond = TOK_EQ;
+                    break;
+                case TAC_BINARY: binary(in); break;
+                case TAC_JUMP: fn.code.push_back(branchTo(A64_B, -1, in.label)); break;
+                case TAC_BRANCH:
+                    if (in.hasImm && in.imm == 0 && (in.cond == TOK_EQ || in.cond == TOK_NE)) {
+                        fn.code.push_back(branchTo(in.cond == TOK_EQ ? A64_CBZ : A64_CBNZ, vreg(in.a), in.label));
+                    } else {
+                        compare(in);
+                        MInst b = branchTo(A64_BCOND, -1, in.label);
+                        b.cond = in.cond;
+                        fn.code.push_back(b);
+                    }
+                    break;
+                case TAC_CALL:
+                    for (size_t i = 0; i < in.args.size(); i++) {
+                        if (i < 8) emit(A64_MOV, (int)i, vreg(in.args[i]));
+                        else emit(A64_STRARG, -1, vreg(in.args[i]), -1, (int)i - 8);
+                    }
+                    fn.outgoing = max(fn.outgoing, (int)in.args.size() - 8);
+                    emit(A64_BL).label = in.label;
+                    emit(A64_MOV, vreg(in.dst), 0);
+                    break;
+                case TAC_RET:
+                    emit(A64_MOV, 0, vreg(in.a));
+                    emit(A64_RET);
+                    break;
+                case TAC_LABEL: emit(A64_LABEL).label = in.label; break;
+            }
+        }
+    }
+};
+
+// Pieces of a 32-bit constant load: a single mov when the value (or its
+// complement) fits 16 bits, else movz of the low half and movk of the high.
+struct A64MovPart {
+    enum Kind { MOVZ, MOVN, MOVK } kind;
+    int imm16;
+    int shift;
+};
+
+vector<A64MovPart> a64MovParts(int value) {
+    uint32_t v = (uint32_t)value;
+    vector<A64MovPart> parts;
+    if ((v >> 16) == 0) {
+        parts.push_back(A64MovPart{ A64MovPart::MOVZ, (int)v, 0 });
+    } else if ((v & 0xffff) == 0) {
+        parts.push_back(A64MovPart{ A64MovPart::MOVZ, (int)(v >> 16), 16 });
+    } else if ((~v >> 16) == 0) {
+        parts.push_back(A64MovPart{ A64MovPart::MOVN, (int)(~v & 0xffff), 0 });
+    } else {
+        parts.push_back(A64MovPart{ A64MovPart::MOVZ, (int)(v & 0xffff), 0 });
+        parts.push_back(A64MovPart{ A64MovPart::MOVK, (int)(v >> 16), 16 });
+    }
+    return parts;
+}
+
+// Frame of an allocated function, from the stack pointer up: outgoing
+// stack arguments, spill slots, saved callee-saved registers. The frame
+// record (x29, x30) sits above it and x29 points at it.
+struct A64Frame {
+    int spillBase, savedBase, size;
+
+    explicit A64Frame(const MFunc& f) {
+        spillBase = 8 * f.outgoing;
+        savedBase = (spillBase + 4 * f.spillSlots + 7) & ~7;
+        size = (savedBase + 8 * (int)f.savedRegs.size() + 15) & ~15;
+    }
+};
+
+const char* a64Cond(TokenType op) {
+    switch (op) {
+        case TOK_LT: return "lt";
+        case TOK_LE: return "le";
+        case TOK_GT: return "gt";
+        case TOK_GE: return "ge";
+        case TOK_EQ: return "eq";
+        default: return "ne";
+    }
+}
+
+// GNU assembler syntax for the whole program, with a freestanding runtime:
+// _start calls main, prints the result with write(2) and exits, so the
+// output links with a bare `ld` and runs under qemu-aarch64.
+class A64AsmWriter {
+private:
+    ostream& out;
+
+    static string w(int r) { return r == A64Target::SP ? "wsp" : "w" + to_string(r); }
+    static string x(int r) { return r == A64Target::SP ? "sp" : "x" + to_string(r); }
+
+    string label(size_t f, int l) const {
+        return l == LABEL_DIVZERO ? string("tc_divzero") : ".L" + to_string(f) + "_" + to_string(l);
+    }
+
+    void frameAdjust(const char* op, int bytes) {
+        for (; bytes > 4095; bytes -= 4095) out << "\t" << op << "\tsp, sp, #4095\n";
+        if (bytes > 0) out << "\t" << op << "\tsp, sp, #" << bytes << "\n";
+    }
+
+    void insn(const vector<MFunc>& funcs, size_t f, const MInst& in, const A64Frame& frame) {
+        const MFunc& fn = funcs[f];
+        switch (in.op) {
+            case A64_LABEL: out << label(f, in.label) << ":\n"; break;
+            case A64_MOV: out << "\tmov\t" << w(in.rd) << ", " << w(in.rn) << "\n"; break;
+            case A64_MOVI:
+                for (const auto& p : a64MovParts(in.imm)) {
+                    const char* name = p.kind == A64MovPart::MOVZ ? "movz" : p.kind == A64MovPart::MOVN ? "movn" : "movk";
+                    out << "\t" << name << "\t" << w(in.rd) << ", #" << p.imm16;
+                    if (p.shift) out << ", lsl #" << p.shift;
+                    out << "\n";
+                }
+                break;
+            case A64_ADD: case A64_SUB: case A64_MUL: case A64_SDIV: {
+                static const char* names[] = { "add", "sub", "mul", "sdiv" };
+                out << "\t" << names[in.op - A64_ADD] << "\t" << w(in.rd) << ", " << w(in.rn) << ", " << w(in.rm)
+                    << "\n";
+                break;
+            }
+            case A64_ADDI: case A64_SUBI:
+                out << "\t" << (in.op == A64_ADDI ? "add" : "sub") << "\t" << w(in.rd) << ", " << w(in.rn) << ", #"
+                    << in.imm << "\n";
+                break;
+            case A64_MSUB: case A64_MADD:
+                out << "\t" << (in.op == A64_MSUB ? "msub" : "madd") << "\t" << w(in.rd) << ", " << w(in.rn) << ", " << w(in.rm) << ", " << w(in.ra) << "\n";
+                break;
+            case A64_MULHI:
+                out << "\tsmull\t" << x(in.rd) << ", " << w(in.rn) << ", " << w(in.rm) << "\n";
+                out << "\tlsr\t" << x(in.rd) << ", " << x(in.rd) << ", #32\n";
+                break;
+            case A64_LSLI: case A64_ASRI: case A64_LSRI: {
+                static const char* names[] = { "lsl", "asr", "lsr" };
+                out << "\t" << names[in.op - A64_LSLI] << "\t" << w(in.rd) << ", " << w(in.rn) << ", #" << in.imm << "\n";
+                break;
+            }
+            case A64_NEG: out << "\tneg\t" << w(in.rd) << ", " << w(in.rn) << "\n"; break;
+            case A64_CMP: out << "\tcmp\t" << w(in.rn) << ", " << w(in.rm) << "\n"; break;
+            case A64_CMPI: out << "\tcmp\t" << w(in.rn) << ", #" << in.imm << "\n"; break;
+            case A64_CMNI: out << "\tcmn\t" << w(in.rn) << ", #" << in.imm << "\n"; break;
+            case A64_CSET: out << "\tcset\t" << w(in.rd) << ", " << a64Cond(in.cond) << "\n"; break;
+            case A64_B: out << "\tb\t" << label(f, in.label) << "\n"; break;
+            case A64_BCOND: out << "\tb." << a64Cond(in.cond) << "\t" << label(f, in.label) << "\n"; break;
+            case A64_CBZ: case A64_CBNZ:
+                out << "\t" << (in.op == A64_CBZ ? "cbz" : "cbnz") << "\t" << w(in.rn) << ", " << label(f, in.label)
+                    << "\n";
+                break;
+            case A64_BL: out << "\tbl\ttc_f_" << funcs[in.label].name << "\n"; break;
+            case A64_LDR: case A64_STR:
+                out << "\t" << (in.op == A64_LDR ? "ldr" : "str") << "\t" << w(in.rd) << ", [sp, #"
+                    << frame.spillBase + 4 * in.imm << "]\n";
+                break;
+            case A64_LDRARG: out << "\tldr\t" << w(in.rd) << ", [x29, #" << 16 + 8 * in.imm << "]\n"; break;
+            case A64_STRARG: out << "\tstr\t" << w(in.rn) << ", [sp, #" << 8 * in.imm << "]\n"; break;
+            case A64_RET:
+                out << "\tadrp\tx16, tc_depth\n"
+                       "\tldr\tw17, [x16, :lo12:tc_depth]\n"
+                       "\tadd\tw17, w17, #1\n"
+                       "\tstr\tw17, [x16, :lo12:tc_depth]\n";
+                for (size_t k = 0; k < fn.savedRegs.size(); k++) {
+                    out << "\tldr\t" << x(fn.savedRegs[k]) << ", [sp, #" << frame.savedBase + 8 * (int)k << "]\n";
+                }
+                out << "\tmov\tsp, x29\n"
+                       "\tldp\tx29, x30, [sp], #16\n"
+                       "\tret\n";
+                break;
+        }
+    }
+
+public:
+    A64AsmWriter(ostream& o) : out(o) {}
+
+    void write(const vector<MFunc>& funcs, int mainFunc) {
+        out << "// Generated by parser --emit-aarch64.\n"
+               "\t.text\n"
+               "\t.globl\t_start\n"
+               "_start:\n"
+               "\tbl\ttc_f_" << funcs[mainFunc].name << "\n"
+               "\tbl\ttc_print\n"
+               "\tmov\tx0, #0\n"
+               "\tmov\tx8, #93\n"
+               "\tsvc\t#0\n";
+        for (size_t f = 0; f < funcs.size(); f++) {
+            const MFunc& fn = funcs[f];
+            A64Frame frame(fn);
+            out << "\n\t.p2align\t2\ntc_f_" << fn.name << ":\n"
+                   "\tstp\tx29, x30, [sp, #-16]!\n"
+                   "\tmov\tx29, sp\n";
+            frameAdjust("sub", frame.size);
+            for (size_t k = 0; k < fn.savedRegs.size(); k++) {
+                out << "\tstr\t" << x(fn.savedRegs[k]) << ", [sp, #" << frame.savedBase + 8 * (int)k << "]\n";
+            }
+            out << "\tadrp\tx16, tc_depth\n"
+                   "\tldr\tw17, [x16, :lo12:tc_depth]\n"
+                   "\tsubs\tw17, w17, #1\n"
+                   "\tstr\tw17, [x16, :lo12:tc_depth]\n"
+                   "\tb.mi\ttc_overflow\n";
+            for (const auto& in : fn.code) insn(funcs, f, in, frame);
+        }
+        out << "\n"
+               "// Prints w0 in decimal and a newline.\n"
+               "tc_print:\n"
+               "\tsub\tsp, sp, #32\n"
+               "\tadd\tx1, sp, #31\n"
+               "\tmov\tw2, #10\n"
+               "\tstrb\tw2, [x1]\n"
+               "\tsxtw\tx4, w0\n"
+               "\tcmp\tx4, #0\n"
+               "\tcneg\tx5, x4, lt\n"
+               "\tmov\tx6, #10\n"
+               "1:\tudiv\tx7, x5, x6\n"
+               "\tmsub\tx9, x7, x6, x5\n"
+               "\tadd\tw9, w9, #48\n"
+               "\tsub\tx1, x1, #1\n"
+               "\tstrb\tw9, [x1]\n"
+               "\tmov\tx5, x7\n"
+               "\tcbnz\tx5, 1b\n"
+               "\ttbz\tx4, #63, 2f\n"
+               "\tmov\tw9, #45\n"
+               "\tsub\tx1, x1, #1\n"
+               "\tstrb\tw9, [x1]\n"
+               "2:\tmov\tx0, #1\n"
+               "\tadd\tx2, sp, #32\n"
+               "\tsub\tx2, x2, x1\n"
+               "\tmov\tx8, #64\n"
+               "\tsvc\t#0\n"
+               "\tadd\tsp, sp, #32\n"
+               "\tret\n"
+               "\n"
+               "tc_divzero:\n"
+               "\tadrp\tx1, tc_msg_divzero\n"
+               "\tadd\tx1, x1, :lo12:tc_msg_divzero\n"
+               "\tmov\tx2, #32\n"
+               "\tb\ttc_fail\n"
+               "tc_overflow:\n"
+               "\tadrp\tx1, tc_msg_overflow\n"
+               "\tadd\tx1, x1, :lo12:tc_msg_overflow\n"
+               "\tmov\tx2, #30\n"
+               "tc_fail:\n"
+               "\tmov\tx0, #2\n"
+               "\tmov\tx8, #64\n"
+               "\tsvc\t#0\n"
+               "\tmov\tx0, #1\n"
+               "\tmov\tx8, #93\n"
+               "\tsvc\t#0\n"
+               "\n"
+               "\t.data\n"
+               "\t.p2align\t2\n"
+               "tc_depth:\n"
+               "\t.word\t100000\n"
+               "tc_msg_divzero:\n"
+               "\t.ascii\t\"runtime error: division by zero\\n\"\n"
+               "tc_msg_overflow:\n"
+               "\t.ascii\t\"runtime error: stack overflow\\n\"\n";
+    }
+};
+
+// Without peephole statistics the peephole pass is skipped.
+vector<MFunc> compileA64(const vector<TacFunc>& tac, PeepholeStats* peephole) {
+    vector<MFunc> funcs(tac.size());
+    for (size_t i = 0; i < tac.size(); i++) {
+        A64Selector(tac[i], funcs[i]).select();
+        LinearScan<A64Target>(funcs[i]).run();
+        if (peephole) Peephole<A64Target>(funcs[i], *peephole).run();
+    }
+    return funcs;
+}
+
+// Condition field of b.cond and the conditional selects.
+int a64CondCode(TokenType op) {
+    switch (op) {
+        case TOK_LT: return 11;
+        case TOK_LE: return 13;
+        case TOK_GT: return 12;
+        case TOK_GE: return 10;
+        case TOK_EQ: return 0;
+        default: return 1;
+    }
+}
+
+#ifdef __linux__
+// --emit-elf: encodes the allocated functions and the same runtime as
+// A64AsmWriter straight to machine code and writes a static executable,
+// with no assembler or linker involved. The headers and code share one
+// read-execute segment and the data gets a read-write one. Every address
+// is fixed before writing, so branches and adrp/lo12 pairs are resolved
+// here and the file carries no relocations; section headers and a symbol
+// table are added for objdump and debuggers.
+class A64ElfWriter {
+private:
+    enum FixupKind { FIX_BRANCH26, FIX_BRANCH19, FIX_BRANCH14, FIX_ADRP, FIX_ADD_LO12, FIX_LDST32_LO12 };
+
+    struct Fixup {
+        size_t at;
+        FixupKind kind;
+        // A label, or a data offset for the adrp/lo12 kinds.
+        int target;
+    };
+
+    struct Symbol {
+        string name;
+        int label;      // code label, or -1 for data
+        int dataOffset;
+    };
+
+    const vector<MFunc>& funcs;
+    int mainFunc;
+    vector<uint32_t> code;
+    vector<int> labelAt;
+    vector<Fixup> fixups;
+    vector<Symbol> symbols;
+    string data;
+    int print, divzero, overflow, fail;
+    int depthData;
+
+    int newLabel() {
+        labelAt.push_back(-1);
+        return (int)labelAt.size() - 1;
+    }
+
+    void place(int label) { labelAt[label] = (int)code.size(); }
+
+    void put(uint32_t word) { code.push_back(word); }
+
+    void put(uint32_t word, FixupKind kind, int target) {
+        fixups.push_back(Fixup{ code.size(), kind, target });
+        code.push_back(word);
+    }
+
+    static uint32_t rrr(uint32_t op, int rd, int rn, int rm) { return op | rm << 16 | rn << 5 | rd; }
+    static uint32_t rri(uint32_t op, int rd, int rn, int imm12) { return op | imm12 << 10 | rn << 5 | rd; }
+
+    void symbol(const string& name, int label) { symbols.push_back(Symbol{ name, label, 0 }); }
+
+    void frameAdjust(uint32_t op, int bytes) {
+        for (; bytes > 4095; bytes -= 4095) put(rri(op, 31, 31, 4095));
+        if (bytes > 0) put(rri(op, 31, 31, bytes));
+    }
+
+    // Calls count down tc_depth and fail once it goes negative.
+    void depth(bool enter) {
+        put(0x90000010, FIX_ADRP, depthData);                   // adrp x16, tc_depth
+        put(0xb9400211, FIX_LDST32_LO12, depthData);            // ldr w17, [x16, :lo12:tc_depth]
+        put(enter ? 0x71000631 : 0x11000631);                   // subs/add w17, w17, #1
+        put(0xb9000211, FIX_LDST32_LO12, depthData);            // str w17, [x16, :lo12:tc_depth]
+        if (enter) put(0x54000004, FIX_BRANCH19, overflow);     // b.mi tc_overflow
+    }
+
+    void insn(const MInst& in, const MFunc& fn, const A64Frame& frame, int localBase) {
+        int target = in.label == LABEL_DIVZERO ? divzero : localBase + in.label;
+        switch (in.op) {
+            case A64_LABEL: place(target); break;
+            case A64_MOV: put(rrr(0x2a0003e0, in.rd, 0, in.rn)); break;
+            case A64_MOVI:
+                for (const auto& p : a64MovParts(in.imm)) {
+                    static const uint32_t ops[] = { 0x52800000, 0x12800000, 0x72800000 };
+                    put(ops[p.kind] | (p.shift / 16) << 21 | p.imm16 << 5 | in.rd);
+                }
+                break;
+            case A64_ADD: put(rrr(0x0b000000, in.rd, in.rn, in.rm)); break;
+            case A64_SUB: put(rrr(0x4b000000, in.rd, in.rn, in.rm)); break;
+            case A64_MUL: put(rrr(0x1b007c00, in.rd, in.rn, in.rm)); break;
+            case A64_SDIV: put(rrr(0x1ac00c00, in.rd, in.rn, in.rm)); break;
+            case A64_ADDI: put(rri(0x11000000, in.rd, in.rn, in.imm)); break;
+            case A64_SUBI: put(rri(0x51000000, in.rd, in.rn, in.imm)); break;
+            case A64_MSUB: put(rrr(0x1b008000, in.rd, in.rn, in.rm) | in.ra << 10); break;
+            case A64_MADD: put(rrr(0x1b000000, in.rd, in.rn, in.rm) | in.ra << 10); break;
+            case A64_MULHI:
+                put(rrr(0x9b207c00, in.rd, in.rn, in.rm));  // smull
+                put(0xd360fc00 | in.rd << 5 | in.rd);       // lsr xd, xd, #32
+                break;
+            // The shifts are the ubfm/sbfm aliases.
+            case A64_LSLI: put(0x53000000 | (32 - in.imm) % 32 << 16 | (31 - in.imm) << 10 | in.rn << 5 | in.rd); break;
+            case A64_ASRI: put(0x13007c00 | in.imm << 16 | in.rn << 5 | in.rd); break;
+            case A64_LSRI: put(0x53007c00 | in.imm << 16 | in.rn << 5 | in.rd); break;
+            case A64_NEG: put(rrr(0x4b0003e0, in.rd, 0, in.rn)); break;
+            case A64_CMP: put(rrr(0x6b00001f, 0, in.rn, in.rm)); break;
+            case A64_CMPI: put(rri(0x7100001f, 0, in.rn, in.imm)); break;
+            case A64_CMNI: put(rri(0x3100001f, 0, in.rn, in.imm)); break;
+            case A64_CSET: put(0x1a9f07e0 | (a64CondCode(in.cond) ^ 1) << 12 | in.rd); break;
+            case A64_B: put(0x14000000, FIX_BRANCH26, target); break;
+            case A64_BCOND: put(0x54000000 | a64CondCode(in.cond), FIX_BRANCH19, target); break;
+            case A64_CBZ: put(0x34000000 | in.rn, FIX_BRANCH19, target); break;
+            case A64_CBNZ: put(0x35000000 | in.rn, FIX_BRANCH19, target); break;
+            case A64_BL: put(0x94000000, FIX_BRANCH26, in.label); break;
+            case A64_LDR: put(rri(0xb9400000, in.rd, 31, (frame.spillBase + 4 * in.imm) / 4)); break;
+            case A64_STR: put(rri(0xb9000000, in.rd, 31, (frame.spillBase + 4 * in.imm) / 4)); break;
+            case A64_LDRARG: put(rri(0xb9400000, in.rd, 29, (16 + 8 * in.imm) / 4)); break;
+            case A64_STRARG: put(rri(0xb9000000, in.rn, 31, 2 * in.imm)); break;
+            case A64_RET:
+                depth(false);
+                for (size_t k = 0; k < fn.savedRegs.size(); k++) {
+                    put(rri(0xf9400000, fn.savedRegs[k], 31, frame.savedBase / 8 + (int)k));  // ldr xN, [sp, #off]
+                }
+                put(0x910003bf);  // mov sp, x29
+                put(0xa8c17bfd);  // ldp x29, x30, [sp], #16
+                put(0xd65f03c0);  // ret
+                break;
+        }
+    }
+
+    void function(size_t f) {
+        const MFunc& fn = funcs[f];
+        A64Frame frame(fn);
+        int localBase = (int)labelAt.size();
+        for (int l = 0; l < fn.labels; l++) newLabel();
+        place((int)f);
+        put(0xa9bf7bfd);  // stp x29, x30, [sp, #-16]!
+        put(0x910003fd);  // mov x29, sp
+        frameAdjust(0xd1000000, frame.size);
+        for (size_t k = 0; k < fn.savedRegs.size(); k++) {
+            put(rri(0xf9000000, fn.savedRegs[k], 31, frame.savedBase / 8 + (int)k));  // str xN, [sp, #off]
+        }
+        depth(true);
+        for (const auto& in : fn.code) insn(in, fn, frame, localBase);
+    }
+
+    // Laid out like A64AsmWriter's output: _start, the functions, then
+    // the rest of the runtime.
+    void start(int label) {
+        place(label);
+        put(0x94000000, FIX_BRANCH26, mainFunc);  // bl tc_f_main
+        put(0x94000000, FIX_BRANCH26, print);     // bl tc_print
+        put(0xd2800000);                          // mov x0, #0
+        put(0xd2800ba8);                          // mov x8, #93
+        put(0xd4000001);                          // svc #0
+    }
+
+    void runtime() {
+        int msgDivzero = 4, msgOverflow = msgDivzero + 32;
+        int digit = newLabel(), positive = newLabel();
+        place(print);
+        put(0xd10083ff);  // sub sp, sp, #32
+        put(0x91007fe1);  // add x1, sp, #31
+        put(0x52800142);  // mov w2, #10
+        put(0x39000022);  // strb w2, [x1]
+        put(0x93407c04);  // sxtw x4, w0
+        put(0xf100009f);  // cmp x4, #0
+        put(0xda84a485);  // cneg x5, x4, lt
+        put(0xd2800146);  // mov x6, #10
+        place(digit);
+        put(0x9ac608a7);  // udiv x7, x5, x6
+        put(0x9b0694e9);  // msub x9, x7, x6, x5
+        put(0x1100c129);  // add w9, w9, #48
+        put(0xd1000421);  // sub x1, x1, #1
+        put(0x39000029);  // strb w9, [x1]
+        put(0xaa0703e5);  // mov x5, x7
+        put(0xb5000005, FIX_BRANCH19, digit);     // cbnz x5, digit
+        put(0xb6f80004, FIX_BRANCH14, positive);  // tbz x4, #63, positive
+        put(0x528005a9);  // mov w9, #45
+        put(0xd1000421);  // sub x1, x1, #1
+        put(0x39000029);  // strb w9, [x1]
+        place(positive);
+        put(0xd2800020);  // mov x0, #1
+        put(0x910083e2);  // add x2, sp, #32
+        put(0xcb010042);  // sub x2, x2, x1
+        put(0xd2800808);  // mov x8, #64
+        put(0xd4000001);  // svc #0
+        put(0x910083ff);  // add sp, sp, #32
+        put(0xd65f03c0);  // ret
+
+        place(divzero);
+        put(0x90000001, FIX_ADRP, msgDivzero);      // adrp x1, tc_msg_divzero
+        put(0x91000021, FIX_ADD_LO12, msgDivzero);  // add x1, x1, :lo12:tc_msg_divzero
+        put(0xd2800402);                            // mov x2, #32
+        put(0x14000000, FIX_BRANCH26, fail);        // b tc_fail
+        place(overflow);
+        put(0x90000001, FIX_ADRP, msgOverflow);
+        put(0x91000021, FIX_ADD_LO12, msgOverflow);
+        put(0xd28003c2);  // mov x2, #30
+        place(fail);
+        put(0xd2800040);  // mov x0, #2
+        put(0xd2800808);  // mov x8, #64
+        put(0xd4000001);  // svc #0
+        put(0xd2800020);  // mov x0, #1
+        put(0xd2800ba8);  // mov x8, #93
+        put(0xd4000001);  // svc #0
+    }
+
+    // Patches every fixup once the code and data addresses are known.
+    bool resolve(uint64_t textAddr, uint64_t dataAddr) {
+        for (const auto& fx : fixups) {
+            uint64_t pc = textAddr + 4 * fx.at;
+            bool isData = fx.kind == FIX_ADRP || fx.kind == FIX_ADD_LO12 || fx.kind == FIX_LDST32_LO12;
+            uint64_t target = isData ? dataAddr + fx.target : textAddr + 4 * (uint64_t)labelAt[fx.target];
+            int64_t delta = (int64_t)(target - pc) / 4;
+            uint32_t& word = code[fx.at];
+            switch (fx.kind) {
+                case FIX_BRANCH26:
+                    if (delta < -(1 << 25) || delta >= (1 << 25)) return false;
+                    word |= (uint32_t)delta & 0x3ffffff;
+                    break;
+                case FIX_BRANCH19:
+                    if (delta < -(1 << 18) || delta >= (1 << 18)) return false;
+                    word |= ((uint32_t)delta & 0x7ffff) << 5;
+                    break;
+                case FIX_BRANCH14:
+                    if (delta < -(1 << 13) || delta >= (1 << 13)) return false;
+                    word |= ((uint32_t)delta & 0x3fff) << 5;
+                    break;
+                case FIX_ADRP: {
+                    int64_t pages = (int64_t)(target >> 12) - (int64_t)(pc >> 12);
+                    word |= ((uint32_t)pages & 3) << 29 | (((uint32_t)pages >> 2) & 0x7ffff) << 5;
+                    break;
+                }
+                case FIX_ADD_LO12: word |= (uint32_t)(target & 0xfff) << 10; break;
+                case FIX_LDST32_LO12: word |= (uint32_t)((target & 0xfff) >> 2) << 10; break;
+            }
+        }
+        return true;
+    }
+
+public:
+    A64ElfWriter(const vector<MFunc>& f, int m) : funcs(f), mainFunc(m) {}
+
+    bool write(const string& path) {
+        // Labels 0..n-1 are the functions themselves.
+        for (size_t f = 0; f < funcs.size(); f++) {
+            newLabel();
+            symbol("tc_f_" + funcs[f].name, (int)f);
+        }
+        int entry = newLabel();
+        print = newLabel();
+        divzero = newLabel();
+        overflow = newLabel();
+        fail = newLabel();
+        symbol("tc_print", print);
+        symbol("tc_divzero", divzero);
+        symbol("tc_overflow", overflow);
+        symbol("tc_fail", fail);
+        depthData = 0;
+        data.assign("\xa0\x86\x01\x00", 4);  // 100000
+        data += "runtime error: division by zero\n";
+        data += "runtime error: stack overflow\n";
+        symbols.push_back(Symbol{ "tc_depth", -1, 0 });
+        start(entry);
+        for (size_t f = 0; f < funcs.size(); f++) function(f);
+        runtime();
+
+        const uint64_t base = 0x400000, align = 0x10000;
+        uint64_t textOff = sizeof(Elf64_Ehdr) + 2 * sizeof(Elf64_Phdr);
+        uint64_t textSize = 4 * code.size();
+        uint64_t dataOff = (textOff + textSize + 7) & ~7ULL;
+        // Same offset within a page as in the file, on the page after the code.
+        uint64_t dataAddr = base + ((dataOff + align - 1) & ~(align - 1)) + (dataOff & (align - 1));
+        if (!resolve(base + textOff, dataAddr)) {
+            cerr << "program too large for direct branches" << endl;
+            return false;
+        }
+
+        string strtab(1, '\0'), shstrtab(1, '\0');
+        vector<Elf64_Sym> syms(1, Elf64_Sym());
+        auto addSymbol = [&](const string& name, unsigned char bind, unsigned char type, uint16_t section,
+                             uint64_t value) {
+            Elf64_Sym s = Elf64_Sym();
+            s.st_name = (uint32_t)strtab.size();
+            s.st_info = ELF64_ST_INFO(bind, type);
+            s.st_shndx = section;
+            s.st_value = value;
+            strtab += name + '\0';
+            syms.push_back(s);
+        };
+        for (const auto& s : symbols) {
+            if (s.label >= 0) addSymbol(s.name, STB_LOCAL, STT_FUNC, 1, base + textOff + 4 * labelAt[s.label]);
+            else addSymbol(s.name, STB_LOCAL, STT_OBJECT, 2, dataAddr + s.dataOffset);
+        }
+        size_t firstGlobal = syms.size();
+        addSymbol("_start", STB_GLOBAL, STT_FUNC, 1, base + textOff + 4 * labelAt[entry]);
+
+        uint64_t symOff = (dataOff + data.size() + 7) & ~7ULL;
+        uint64_t symSize = syms.size() * sizeof(Elf64_Sym);
+        uint64_t strOff = symOff + symSize;
+        uint64_t shstrOff = strOff + strtab.size();
+        const char* names[] = { ".text", ".data", ".symtab", ".strtab", ".shstrtab" };
+        vector<uint32_t> nameAt;
+        for (const char* n : names) {
+            nameAt.push_back((uint32_t)shstrtab.size());
+            shstrtab += string(n) + '\0';
+        }
+        uint64_t shOff = (shstrOff + shstrtab.size() + 7) & ~7ULL;
+
+        Elf64_Ehdr eh = Elf64_Ehdr();
+        memcpy(eh.e_ident, ELFMAG, SELFMAG);
+        eh.e_ident[EI_CLASS] = ELFCLASS64;
+        eh.e_ident[EI_DATA] = ELFDATA2LSB;
+        eh.e_ident[EI_VERSION] = EV_CURRENT;
+        eh.e_ident[EI_OSABI] = ELFOSABI_NONE;
+        eh.e_type = ET_EXEC;
+        eh.e_machine = EM_AARCH64;
+        eh.e_version = EV_CURRENT;
+        eh.e_entry = base + textOff + 4 * labelAt[entry];
+        eh.e_phoff = sizeof(Elf64_Ehdr);
+        eh.e_shoff = shOff;
+        eh.e_ehsize = sizeof(Elf64_Ehdr);
+        eh.e_phentsize = sizeof(Elf64_Phdr);
+        eh.e_phnum = 2;
+        eh.e_shentsize = sizeof(Elf64_Shdr);
+        eh.e_shnum = 6;
+        eh.e_shstrndx = 5;
+
+        Elf64_Phdr ph[2] = { Elf64_Phdr(), Elf64_Phdr() };
+        ph[0].p_type = PT_LOAD;
+        ph[0].p_flags = PF_R | PF_X;
+        ph[0].p_vaddr = ph[0].p_paddr = base;
+        ph[0].p_filesz = ph[0].p_memsz = textOff + textSize;
+        ph[0].p_align = align;
+        ph[1].p_type = PT_LOAD;
+        ph[1].p_flags = PF_R | PF_W;
+        ph[1].p_offset = dataOff;
+        ph[1].p_vaddr = ph[1].p_paddr = dataAddr;
+        ph[1].p_filesz = ph[1].p_memsz = data.size();
+        ph[1].p_align = align;
+
+        Elf64_Shdr sh[6];
+        memset(sh, 0, sizeof sh);
+        auto section = [&](int i, uint32_t type, uint64_t flags, uint64_t addr, uint64_t off, uint64_t size) {
+            sh[i].sh_name = nameAt[i - 1];
+            sh[i].sh_type = type;
+            sh[i].sh_flags = flags;
+            sh[i].sh_addr = addr;
+            sh[i].sh_offset = off;
+            sh[i].sh_size = size;
+            sh[i].sh_addralign = 1;
+        };
+        section(1, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, base + textOff, textOff, textSize);
+        sh[1].sh_addralign = 4;
+        section(2, SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, dataAddr, dataOff, data.size());
+        sh[2].sh_addralign = 4;
+        section(3, SHT_SYMTAB, 0, 0, symOff, symSize);
+        sh[3].sh_link = 4;
+        sh[3].sh_info = (uint32_t)firstGlobal;
+        sh[3].sh_entsize = sizeof(Elf64_Sym);
+        sh[3].sh_addralign = 8;
+        section(4, SHT_STRTAB, 0, 0, strOff, strtab.size());
+        section(5, SHT_STRTAB, 0, 0, shstrOff, shstrtab.size());
+
+        string image(shOff + sizeof sh, '\0');
+        memcpy(&image[0], &eh, sizeof eh);
+        memcpy(&image[eh.e_phoff], ph, sizeof ph);
+        memcpy(&image[textOff], code.data(), textSize);
+        memcpy(&image[dataOff], data.data(), data.size());
+        memcpy(&image[symOff], syms.data(), symSize);
+        memcpy(&image[strOff], strtab.data(), strtab.size());
+        memcpy(&image[shstrOff], shstrtab.data(), shstrtab.size());
+        memcpy(&image[shOff], sh, sizeof sh);
+
+        if (!writeFile(path, image) || chmod(path.c_str(), 0755) != 0) {
+            cerr << path << ": cannot write file" << endl;
+            return false;
+        }
+        return true;
+    }
+};
+#else
+class A64ElfWriter {
+public:
+    A64ElfWriter(const vector<MFunc>&, int) {}
+
+    bool write(const string&) {
+        cerr << "--emit-elf needs <elf.h> (Linux only)" << endl;
+        return false;
+    }
+};
+#endif
+
+// RV32IM backend. Instructions are described by a table of formats and
+// fixed encoding bits, which the encoder, the printer and the simulator's
+// decoder all use. Pseudo-instructions exist only until frame expansion.
+enum RvOp {
+    RV_LABEL,
+    RV_LUI, RV_AUIPC, RV_JAL, RV_JALR,
+    RV_BEQ, RV_BNE, RV_BLT, RV_BGE, RV_BLTU, RV_BGEU,
+    RV_LB, RV_LW, RV_LBU, RV_SB, RV_SW,
+    RV_ADDI, RV_SLTI, RV_SLTIU, RV_XORI, RV_ORI, RV_ANDI, RV_SLLI, RV_SRLI, RV_SRAI,
+    RV_ADD, RV_SUB, RV_SLL, RV_SLT, RV_SLTU, RV_XOR, RV_SRL, RV_SRA, RV_OR, RV_AND,
+    RV_MUL, RV_MULH, RV_MULHSU, RV_MULHU, RV_DIV, RV_DIVU, RV_REM, RV_REMU,
+    RV_ECALL,
+    RV_LI,          // rd = imm
+    RV_J,           // goto label
+    RV_CALL,        // call function `label`
+    RV_RET,         // epilogue and return of a0
+    RV_LOADSLOT,    // rd = spill slot imm
+    RV_STORESLOT,   // spill slot imm = rd
+    RV_LOADARG,     // rd = incoming stack argument imm
+    RV_STOREARG,    // outgoing stack argument imm = rn
+    RV_OP_COUNT
+};
+
+struct RvOpInfo {
+    const char* name;
+    // R, I (register-immediate), H (shift by immediate), L (load), S, B,
+    // U, J, X (ecall), P (pseudo).
+    char format;
+    uint32_t bits;
+};
+
+const RvOpInfo& rvInfo(int op) {
+    static const RvOpInfo table[RV_OP_COUNT] = {
+        { "", 'P', 0 },
+        { "lui", 'U', 0x37 }, { "auipc", 'U', 0x17 }, { "jal", 'J', 0x6f }, { "jalr", 'L', 0x67 },
+        { "beq", 'B', 0x0063 }, { "bne", 'B', 0x1063 }, { "blt", 'B', 0x4063 },
+        { "bge", 'B', 0x5063 }, { "bltu", 'B', 0x6063 }, { "bgeu", 'B', 0x7063 },
+        { "lb", 'L', 0x0003 }, { "lw", 'L', 0x2003 }, { "lbu", 'L', 0x4003 },
+        { "sb", 'S', 0x0023 }, { "sw", 'S', 0x2023 },
+        { "addi", 'I', 0x0013 }, { "slti", 'I', 0x2013 }, { "sltiu", 'I', 0x3013 }, { "xori", 'I', 0x4013 },
+        { "ori", 'I', 0x6013 }, { "andi", 'I', 0x7013 },
+        { "slli", 'H', 0x00001013 }, { "srli", 'H', 0x00005013 }, { "srai", 'H', 0x40005013 },
+        { "add", 'R', 0x00000033 }, { "sub", 'R', 0x40000033 }, { "sll", 'R', 0x00001033 },
+        { "slt", 'R', 0x00002033 }, { "sltu", 'R', 0x00003033 }, { "xor", 'R', 0x00004033 },
+        { "srl", 'R', 0x00005033 }, { "sra", 'R', 0x40005033 }, { "or", 'R', 0x00006033 },
+        { "and", 'R', 0x00007033 },
+        { "mul", 'R', 0x02000033 }, { "mulh", 'R', 0x02001033 }, { "mulhsu", 'R', 0x02002033 },
+        { "mulhu", 'R', 0x02003033 }, { "div", 'R', 0x02004033 }, { "divu", 'R', 0x02005033 },
+        { "rem", 'R', 0x02006033 }, { "remu", 'R', 0x02007033 },
+        { "ecall", 'X', 0x00000073 },
+        { "li", 'P', 0 }, { "j", 'P', 0 }, { "call", 'P', 0 }, { "ret", 'P', 0 },
+        { "loadslot", 'P', 0 }, { "storeslot", 'P', 0 }, { "loadarg", 'P', 0 }, { "storearg", 'P', 0 },
+    };
+    return table[op];
+}
+
+bool rvIsBranch(int op) { return op >= RV_BEQ && op <= RV_BGEU; }
+
+bool fitsImm12(int v) { return v >= -2048 && v <= 2047; }
+
+const char* rvRegName(int r) {
+    static const char* names[] = { "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "s0", "s1", "a0",
+                                   "a1", "a2", "a3", "a4", "a5", "a6", "a7", "s2", "s3", "s4", "s5",
+                                   "s6", "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6" };
+    return names[r];
+}
+
+enum RvReg { RV_ZERO = 0, RV_RA = 1, RV_SP = 2, RV_GP = 3, RV_S0 = 8, RV_A0 = 10, RV_A1 = 11, RV_A2 = 12,
+             RV_A7 = 17, RV_T6 = 31 };
+
+struct Rv32Target {
+    static int uses(const MInst& in, int* out) {
+        switch (in.op) {
+            case RV_STORESLOT: out[0] = in.rd; return 1;
+            case RV_STOREARG: out[0] = in.rn; return 1;
+            case RV_LI: case RV_J: case RV_CALL: case RV_RET: case RV_LOADSLOT: case RV_LOADARG: case RV_LABEL:
+                return 0;
+            default: break;
+        }
+        switch (rvInfo(in.op).format) {
+            case 'R': case 'S': case 'B':
+                out[0] = in.rn;
+                out[1] = in.rm;
+                return 2;
+            case 'I': case 'H': case 'L':
+                out[0] = in.rn;
+                return 1;
+            default:
+                return 0;
+        }
+    }
+
+    static int defs(const MInst& in, int* out) {
+        char format = rvInfo(in.op).format;
+        if (in.op == RV_LI || in.op == RV_LOADSLOT || in.op == RV_LOADARG || format == 'R' || format == 'I' ||
+            format == 'H' || format == 'L' || format == 'U') {
+            out[0] = in.rd;
+            return 1;
+        }
+        return 0;
+    }
+
+    template <class F>
+    static void mapRegisters(MInst& in, F map) {
+        int d[2], u[4];
+        if (in.op == RV_STORESLOT) {
+            map(in.rd, false);
+            return;
+        }
+        if (in.op == RV_STOREARG) {
+            map(in.rn, false);
+            return;
+        }
+        int nu = uses(in, u);
+        if (nu > 0) map(in.rn, false);
+        if (nu > 1) map(in.rm, false);
+        if (defs(in, d) > 0) map(in.rd, true);
+    }
+
+    static bool isLabel(const MInst& in) { return in.op == RV_LABEL; }
+
+    static bool isBranch(const MInst& in) { return (rvIsBranch(in.op) || in.op == RV_J) && in.label >= 0; }
+
+    static bool endsFlow(const MInst& in) { return in.op == RV_J || in.op == RV_RET; }
+
+    static bool isCall(const MInst& in) { return in.op == RV_CALL; }
+
+    static bool isCondBranch(const MInst& in) { return rvIsBranch(in.op); }
+
+    // beq/bne, blt/bge and bltu/bgeu are adjacent pairs.
+    static MInst invert(MInst in) {
+        in.op = RV_BEQ + ((in.op - RV_BEQ) ^ 1);
+        return in;
+    }
+
+    static bool isMove(const MInst& in) { return in.op == RV_ADDI && in.imm == 0; }
+
+    // Calls read a0-a7 and clobber ra, t0-t6 and a0-a7; the return reads a0.
+    static uint64_t implicitUses(const MInst& in) {
+        return in.op == RV_CALL ? 0xffULL << RV_A0 : in.op == RV_RET ? 1ULL << RV_A0 : 0;
+    }
+    static uint64_t implicitDefs(const MInst& in) {
+        return in.op == RV_CALL ? 1ULL << RV_RA | 0xe0 | 0xffULL << RV_A0 | 0xfULL << 28 : 0;
+    }
+
+    static const vector<PeepRule>& peepholes();
+
+    static const vector<int>& callerSaved() {
+        static const vector<int> regs = { 5, 6, 7 };
+        return regs;
+    }
+
+    static const vector<int>& calleeSaved() {
+        static const vector<int> regs = { 9, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27 };
+        return regs;
+    }
+
+    static bool isCalleeSaved(int r) { return r == 9 || (r >= 18 && r <= 27); }
+
+    // t3-t5 carry spilled values; t6 is kept for address and frame
+    // arithmetic after allocation.
+    static int scratch(int i) {
+        static const int regs[] = { 29, 30, 28 };
+        return regs[i];
+    }
+
+    static MInst make(int op, int rd = -1, int rn = -1, int rm = -1, int imm = 0) {
+        MInst in = { op, rd, rn, rm, -1, imm, TOK_EOF, -1 };
+        return in;
+    }
+
+    static MInst move(int rd, int rn) { return make(RV_ADDI, rd, rn); }
+    static MInst reload(int r, int slot) { return make(RV_LOADSLOT, r, -1, -1, slot); }
+    static MInst spill(int r, int slot) { return make(RV_STORESLOT, r, -1, -1, slot); }
+};
+
+// A set-on-condition whose only reader is a branch on zero becomes the
+// branch itself: slt t, a, b; bne t, zero, L  =>  blt a, b, L, and the
+// same for sltu/sltiu against zero. `negated` covers the xori t, t, 1
+// that selection puts after slt for >= and <=.
+bool rvFoldCompare(const PeepWindow& w, int size, bool negated, vector<MInst>& out) {
+    const MInst &set = w[0], &b = w[size - 1];
+    int t = set.rd;
+    if ((b.op != RV_BEQ && b.op != RV_BNE) || b.label < 0 || t == RV_ZERO || !w.dead(size - 1, t)) return false;
+    if (!((b.rn == t && b.rm == RV_ZERO) || (b.rn == RV_ZERO && b.rm == t))) return false;
+    bool taken = (b.op == RV_BNE) != negated;  // branch when set's condition holds
+    MInst in = b;
+    if (set.op == RV_SLT || (set.op == RV_SLTI && set.imm == 0)) {
+        in.op = taken ? RV_BLT : RV_BGE;
+        in.rn = set.rn;
+        in.rm = set.op == RV_SLT ? set.rm : RV_ZERO;
+    } else if (set.op == RV_SLTU && set.rn == RV_ZERO && !negated) {
+        in.op = taken ? RV_BNE : RV_BEQ;
+        in.rn = set.rm;
+        in.rm = RV_ZERO;
+    } else if (set.op == RV_SLTIU && set.imm == 1 && !negated) {
+        in.op = taken ? RV_BEQ : RV_BNE;
+        in.rn = set.rn;
+        in.rm = RV_ZERO;
+    } else {
+        return false;
+    }
+    out.push_back(in);
+    return true;
+}
+
+bool rvCompareBranch(const PeepWindow& w, vector<MInst>& out) { return rvFoldCompare(w, 2, false, out); }
+
+bool rvNegatedCompareBranch(const PeepWindow& w, vector<MInst>& out) {
+    const MInst& x = w[1];
+    if (x.op != RV_XORI || x.imm != 1 || x.rd != w[0].rd || x.rn != w[0].rd) return false;
+    return rvFoldCompare(w, 3, true, out);
+}
+
+const vector<PeepRule>& Rv32Target::peepholes() {
+    static const vector<PeepRule> rules = {
+        { "self-move", 1, peepSelfMove<Rv32Target> },
+        { "unreachable", 2, peepUnreachable<Rv32Target> },
+        { "jump-to-next", 2, peepJumpToNext<Rv32Target> },
+        { "branch-over-jump", 3, peepBranchOverJump<Rv32Target> },
+        { "repeated-test", 2, peepRepeatedTest<Rv32Target> },
+        { "store-reload", 2, peepStoreReload<Rv32Target> },
+        { "copy-forward", 2, peepCopyForward<Rv32Target> },
+        { "def-forward", 2, peepDefForward<Rv32Target> },
+        { "compare-branch", 3, rvNegatedCompareBranch },
+        { "compare-branch", 2, rvCompareBranch },
+    };
+    return rules;
+}
+
+class Rv32Selector {
+private:
+    const TacFunc& tac;
+    MFunc& fn;
+
+    int vreg(int r) const { return VREG_BASE + r; }
+    int temp() { return VREG_BASE + fn.vregs++; }
+
+    MInst& emit(int op, int rd = -1, int rn = -1, int rm = -1, int imm = 0) {
+        fn.code.push_back(Rv32Target::make(op, rd, rn, rm, imm));
+        return fn.code.back();
+    }
+
+    int constant(int value) {
+        if (value == 0) return RV_ZERO;
+        int t = temp();
+        emit(RV_LI, t, -1, -1, value);
+        return t;
+    }
+
+    int rhs(const TacInsn& in) { return in.hasImm ? constant(in.imm) : vreg(in.b); }
+
+    void compare(TokenType op, int rd, int a, const TacInsn& in) {
+        bool imm = in.hasImm;
+        int v = in.imm;
+        switch (op) {
+            case TOK_LT:
+                if (imm && fitsImm12(v)) emit(RV_SLTI, rd, a, -1, v);
+                else emit(RV_SLT, rd, a, rhs(in));
+                break;
+            case TOK_GE:
+                compare(TOK_LT, rd, a, in);
+                emit(RV_XORI, rd, rd, -1, 1);
+                break;
+            case TOK_LE:
+                if (imm && v != INT_MAX && fitsImm12(v + 1)) {
+                    emit(RV_SLTI, rd, a, -1, v + 1);
+                    break;
+                }
+                emit(RV_SLT, rd, rhs(in), a);
+                emit(RV_XORI, rd, rd, -1, 1);
+                break;
+            case TOK_GT:
+                emit(RV_SLT, rd, rhs(in), a);
+                break;
+            default: {
+                // a == b exactly when a - b (or a ^ b) is zero.
+                int diff = a;
+                if (!imm || v != 0) {
+                    diff = temp();
+                    if (imm && v != INT_MIN && fitsImm12(-v)) emit(RV_ADDI, diff, a, -1, -v);
+                    else emit(RV_XOR, diff, a, rhs(in));
+                }
+                if (op == TOK_EQ) emit(RV_SLTIU, rd, diff, -1, 1);
+                else emit(RV_SLTU, rd, RV_ZERO, diff);
+                break;
+            }
+        }
+    }
+
+    void binary(const TacInsn& in) {
+        int rd = vreg(in.dst), rn = vreg(in.a);
+        switch (in.cond) {
+            case TOK_PLUS:
+                if (in.hasImm && fitsImm12(in.imm)) emit(RV_ADDI, rd, rn, -1, in.imm);
+                else emit(RV_ADD, rd, rn, rhs(in));
+                break;
+            case TOK_MINUS:
+                if (in.hasImm && in.imm != INT_MIN && fitsImm12(-in.imm)) emit(RV_ADDI, rd, rn, -1, -in.imm);
+                else emit(RV_SUB, rd, rn, rhs(in));
+                break;
+            case TOK_STAR:
+                emit(RV_MUL, rd, rn, rhs(in));
+                break;
+            case TOK_DIV:
+            case TOK_MOD: {
+                // div and rem already give INT_MIN and 0 for INT_MIN / -1;
+                // only zero needs a check.
+                int rm = rhs(in);
+                if (!in.hasImm || in.imm == 0) emit(RV_BEQ, -1, rm, RV_ZERO).label = LABEL_DIVZERO;
+                emit(in.cond == TOK_DIV ? RV_DIV : RV_REM, rd, rn, rm);
+                break;
+            }
+            default:
+                compare(in.cond, rd, rn, in);
+                break;
+        }
+    }
+
+    void branch(const TacInsn& in) {
+        int a = vreg(in.a), b = in.hasImm ? constant(in.imm) : vreg(in.b);
+        int op;
+        switch (in.cond) {
+            case TOK_LT: op = RV_BLT; break;
+            case TOK_GE: op = RV_BGE; break;
+            case TOK_GT: op = RV_BLT; swap(a, b); break;
+            case TOK_LE: op = RV_BGE; swap(a, b); break;
+            case TOK_EQ: op = RV_BEQ; break;
+            default: op = RV_BNE; break;
+        }
+        emit(op, -1, a, b).label = in.label;
+    }
+
+public:
+    Rv32Selector(const TacFunc& t, MFunc& f) : tac(t), fn(f) {}
+
+    void select() {
+        fn.name = tac.name;
+        fn.vregs = tac.regs;
+        fn.labels = tac.labels;
+        fn.outgoing = 0;
+        for (int i = 0; i < tac.params; i++) {
+            if (i < 8) emit(RV_ADDI, vreg(i), RV_A0 + i, -1, 0);
+            else emit(RV_LOADARG, vreg(i), -1, -1, i - 8);
+        }
+        for (const auto& in : tac.code) {
+            switch (in.op) {
+                case TAC_CONST: emit(RV_LI, vreg(in.dst), -1, -1, in.imm); break;
+                case TAC_COPY: emit(RV_ADDI, vreg(in.dst), vreg(in.a), -1, 0); break;
+                case TAC_NEG: emit(RV_SUB, vreg(in.dst), RV_ZERO, vreg(in.a)); break;
+                case TAC_MULHI: emit(RV_MULH, vreg(in.dst), vreg(in.a), constant(in.imm)); break;
+                case TAC_SHL: emit(RV_SLLI, vreg(in.dst), vreg(in.a), -1, in.imm); break;
+                case TAC_SHR: emit(RV_SRAI, vreg(in.dst), vreg(in.a), -1, in.imm); break;
+                case TAC_SHRU: emit(RV_SRLI, vreg(in.dst), vreg(in.a), -1, in.imm); break;
+                case TAC_NOT: emit(RV_SLTIU, vreg(in.dst), vreg(in.a), -1, 1); break;
+                case TAC_BINARY: binary(in); break;
+                case TAC_JUMP: emit(RV_J).label = in.label; break;
+                case TAC_BRANCH: branch(in); break;
+                case TAC_CALL:
+                    for (size_t i = 0; i < in.args.size(); i++) {
+                        if (i < 8) emit(RV_ADDI, RV_A0 + (int)i, vreg(in.args[i]), -1, 0);
+                        else emit(RV_STOREARG, -1, vreg(in.args[i]), -1, (int)i - 8);
+                    }
+                    fn.outgoing = max(fn.outgoing, (int)in.args.size() - 8);
+                    emit(RV_CALL).label = in.label;
+                    emit(RV_ADDI, vreg(in.dst), RV_A0, -1, 0);
+                    break;
+                case TAC_RET:
+                    emit(RV_ADDI, RV_A0, vreg(in.a), -1, 0);
+                    emit(RV_RET);
+                    break;
+                case TAC_LABEL: emit(RV_LABEL).label = in.label; break;
+            }
+        }
+    }
+};
+
+// Cost model of the RV32 simulator: an in-order, single-issue pipeline
+// with a register scoreboard (latency = cycles until a result can be
+// used), a flat penalty for taken branches and jumps, and a direct-mapped
+// data cache. Presets are chosen by name; any field can then be set with
+// name=value, e.g. --rv-model inorder,mul=4,lines=0.
+struct RvModel {
+    string name;
+    int load, mul, div;
+    int branch;
+    int lines, lineBytes, miss;
+};
+
+bool parseRvModel(const string& spec, RvModel& m) {
+    static const RvModel presets[] = {
+        { "ideal", 1, 1, 1, 0, 0, 32, 0 },
+        { "inorder", 2, 3, 34, 2, 64, 32, 20 },
+        { "embedded", 2, 1, 16, 1, 0, 32, 0 },
+    };
+    stringstream in(spec);
+    string item;
+    bool first = true;
+    while (getline(in, item, ',')) {
+        size_t eq = item.find('=');
+        if (first && eq == string::npos) {
+            bool found = false;
+            for (const auto& p : presets) {
+                if (p.name == item) {
+                    m = p;
+                    found = true;
+                }
+            }
+            if (!found) return false;
+        } else {
+            if (first) m = presets[1];
+            if (eq == string::npos) return false;
+            string key = item.substr(0, eq);
+            int value = atoi(item.c_str() + eq + 1);
+            if (key == "load") m.load = value;
+            else if (key == "mul") m.mul = value;
+            else if (key == "div") m.div = value;
+            else if (key == "branch") m.branch = value;
+            else if (key == "lines") m.lines = value;
+            else if (key == "line") m.lineBytes = max(4, value);
+            else if (key == "miss") m.miss = value;
+            else return false;
+        }
+        first = false;
+    }
+    if (first) m = presets[1];
+    return true;
+}
+
+// List scheduling for an in-order RV32 pipeline. Every stretch of code
+// between labels, branches, calls and returns becomes a dependence DAG:
+// reads after writes wait for the producer's latency from the cost model,
+// writes after reads and writes, and accesses to the same stack slot, keep
+// their order. Instructions are then issued one per cycle, preferring the
+// ready one with the longest latency-weighted path to the end of the
+// block. Before allocation only true dependences and the few physical
+// registers constrain the order; afterwards the reuse of registers does
+// too, but no live range grows.
+enum RvSchedule { SCHEDULE_NONE, SCHEDULE_PRE, SCHEDULE_POST };
+
+class Rv32Scheduler {
+private:
+    MFunc& fn;
+    const RvModel& model;
+
+    struct Node {
+        vector<pair<int, int> > succs;  // (node, latency)
+        int preds, height, earliest;
+    };
+
+    int latency(const MInst& in) const {
+        switch (in.op) {
+            case RV_LW: case RV_LB: case RV_LBU: case RV_LOADSLOT: case RV_LOADARG: return model.load;
+            case RV_MUL: case RV_MULH: case RV_MULHSU: case RV_MULHU: return model.mul;
+            case RV_DIV: case RV_DIVU: case RV_REM: case RV_REMU: return model.div;
+            default: return 1;
+        }
+    }
+
+    static bool isBarrier(const MInst& in) {
+        return in.op == RV_LABEL || rvIsBranch(in.op) || in.op == RV_J || in.op == RV_CALL || in.op == RV_RET;
+    }
+
+    // Stack memory an instruction touches: (kind, index), kind 0 for spill
+    // slots, 1 for outgoing and 2 for incoming arguments; kind -1 if none.
+    static pair<int, int> memory(const MInst& in) {
+        switch (in.op) {
+            case RV_LOADSLOT: case RV_STORESLOT: return make_pair(0, in.imm);
+            case RV_STOREARG: return make_pair(1, in.imm);
+            case RV_LOADARG: return make_pair(2, in.imm);
+            default: return make_pair(-1, 0);
+        }
+    }
+
+    void block(size_t begin, size_t end) {
+        int n = (int)(end - begin);
+        if (n < 2) return;
+        const MInst* code = &fn.code[begin];
+        vector<Node> nodes(n);
+        map<int, int> lastDef;
+        map<int, vector<int> > readers;
+        map<pair<int, int>, int> lastStore;
+        map<pair<int, int>, vector<int> > loads;
+        auto edge = [&](int from, int to, int lat) { nodes[from].succs.push_back(make_pair(to, lat)); };
+        int uses[4], defs[2];
+        for (int i = 0; i < n; i++) {
+            nodes[i].preds = 0;
+            nodes[i].earliest = 0;
+            int nu = Rv32Target::uses(code[i], uses), nd = Rv32Target::defs(code[i], defs);
+            for (int k = 0; k < nu; k++) {
+                if (uses[k] == RV_ZERO) continue;
+                auto d = lastDef.find(uses[k]);
+                if (d != lastDef.end()) edge(d->second, i, latency(code[d->second]));
+                readers[uses[k]].push_back(i);
+            }
+            for (int k = 0; k < nd; k++) {
+                auto d = lastDef.find(defs[k]);
+                if (d != lastDef.end()) edge(d->second, i, 1);
+                for (int r : readers[defs[k]]) {
+                    if (r != i) edge(r, i, 0);
+                }
+                readers[defs[k]].clear();
+                lastDef[defs[k]] = i;
+            }
+            pair<int, int> mem = memory(code[i]);
+            if (mem.first < 0) continue;
+            auto st = lastStore.find(mem);
+            if (st != lastStore.end()) edge(st->second, i, 1);
+            if (code[i].op == RV_STORESLOT || code[i].op == RV_STOREARG) {
+                for (int l : loads[mem]) edge(l, i, 0);
+                loads[mem].clear();
+                lastStore[mem] = i;
+            } else {
+                loads[mem].push_back(i);
+            }
+        }
+        for (int i = n - 1; i >= 0; i--) {
+            nodes[i].height = latency(code[i]);
+            for (const auto& s : nodes[i].succs) {
+                nodes[i].height = max(nodes[i].height, s.second + nodes[s.first].height);
+                nodes[s.first].preds++;
+            }
+        }
+        vector<int> ready;
+        for (int i = 0; i < n; i++) {
+            if (nodes[i].preds == 0) ready.push_back(i);
+        }
+        vector<MInst> order;
+        for (int cycle = 0; !ready.empty();) {
+            // The highest node that can issue now, else the one that can
+            // issue soonest; ties keep the original order.
+            size_t best = 0;
+            for (size_t k = 1; k < ready.size(); k++) {
+                const Node &a = nodes[ready[k]], &b = nodes[ready[best]];
+                bool aNow = a.earliest <= cycle, bNow = b.earliest <= cycle;
+                bool better;
+                if (aNow != bNow) better = aNow;
+                else if (!aNow && a.earliest != b.earliest) better = a.earliest < b.earliest;
+                else if (a.height != b.height) better = a.height > b.height;
+                else better = ready[k] < ready[best];
+                if (better) best = k;
+            }
+            int i = ready[best];
+            ready.erase(ready.begin() + best);
+            cycle = max(cycle, nodes[i].earliest) + 1;
+            order.push_back(code[i]);
+            for (const auto& s : nodes[i].succs) {
+                Node& t = nodes[s.first];
+                t.earliest = max(t.earliest, cycle - 1 + s.second);
+                if (--t.preds == 0) ready.push_back(s.first);
+            }
+        }
+        copy(order.begin(), order.end(), fn.code.begin() + begin);
+    }
+
+public:
+    Rv32Scheduler(MFunc& f, const RvModel& m) : fn(f), model(m) {}
+
+    void run() {
+        size_t start = 0;
+        for (size_t i = 0; i <= fn.code.size(); i++) {
+            if (i == fn.code.size() || isBarrier(fn.code[i])) {
+                block(start, i);
+                start = i + 1;
+            }
+        }
+    }
+};
+
+vector<MFunc> compileRv32(const vector<TacFunc>& tac, PeepholeStats* peephole, RvSchedule schedule,
+                          const RvModel& model) {
+    vector<MFunc> funcs(tac.size());
+    for (size_t i = 0; i < tac.size(); i++) {
+        Rv32Selector(tac[i], funcs[i]).select();
+        if (schedule == SCHEDULE_PRE) Rv32Scheduler(funcs[i], model).run();
+        LinearScan<Rv32Target>(funcs[i]).run();
+        if (peephole) Peephole<Rv32Target>(funcs[i], *peephole).run();
+        if (schedule == SCHEDULE_POST) Rv32Scheduler(funcs[i], model).run();
+    }
+    return funcs;
+}
+
+// A linked RV32 program: code at textBase, data (the depth counter, then
+// the runtime's messages) at dataBase, addressed through gp.
+struct RvImage {
+    uint32_t textBase, dataBase, entry;
+    vector<uint32_t> code;
+    string data;
+    // Start address of each function, then of the runtime, ascending.
+    vector<uint32_t> funcStart;
+    vector<string> funcNames;
+};
+
+// Frame of an allocated function, from sp up: outgoing stack arguments,
+// spill slots, callee-saved registers, then s0 and ra. s0 is set to the
+// incoming sp, so stack arguments are at 0(s0), 4(s0), ...
+struct Rv32Frame {
+    int spillBase, savedBase, size;
+
+    explicit Rv32Frame(const MFunc& f) {
+        spillBase = 4 * f.outgoing;
+        savedBase = spillBase + 4 * f.spillSlots;
+        size = (savedBase + 4 * (int)f.savedRegs.size() + 8 + 15) & ~15;
+    }
+};
+
+// Expands the allocated functions and the runtime into one list of real
+// instructions with whole-program labels, relaxes branches that do not
+// reach, and then encodes or prints it.
+class Rv32Assembler {
+private:
+    const vector<MFunc>& funcs;
+    int mainFunc;
+    vector<MInst> code;
+    vector<string> labelNames;
+    int dataLabel, print, divzero, overflow, fail;
+    vector<int> funcEnd;
+    string data;
+
+    int newLabel(const string& name) {
+        labelNames.push_back(name.empty() ? ".L" + to_string(labelNames.size()) : name);
+        return (int)labelNames.size() - 1;
+    }
+
+    MInst& emit(int op, int rd = 0, int rn = 0, int rm = 0, int imm = 0) {
+        code.push_back(Rv32Target::make(op, rd, rn, rm, imm));
+        return code.back();
+    }
+
+    void place(int label) { emit(RV_LABEL).label = label; }
+
+    void li(int rd, int value) {
+        if (fitsImm12(value)) {
+            emit(RV_ADDI, rd, RV_ZERO, 0, value);
+            return;
+        }
+        int lo = (int)((uint32_t)value << 20) >> 20;
+        emit(RV_LUI, rd, 0, 0, (int)(((uint32_t)value - (uint32_t)lo) >> 12));
+        if (lo) emit(RV_ADDI, rd, rd, 0, lo);
+    }
+
+    // Load or store of reg at sp + offset, through t6 when out of range.
+    void frameAccess(int op, int reg, int offset) {
+        int base = RV_SP;
+        if (!fitsImm12(offset)) {
+            li(RV_T6, offset);
+            emit(RV_ADD, RV_T6, RV_T6, RV_SP);
+            base = RV_T6;
+            offset = 0;
+        }
+        if (op == RV_SW) emit(RV_SW, 0, base, reg, offset);
+        else emit(op, reg, base, 0, offset);
+    }
+
+    void adjustSp(int bytes) {
+        if (fitsImm12(bytes)) {
+            emit(RV_ADDI, RV_SP, RV_SP, 0, bytes);
+        } else {
+            li(RV_T6, bytes);
+            emit(RV_ADD, RV_SP, RV_SP, RV_T6);
+        }
+    }
+
+    void depth(int delta, int overflowStub) {
+        emit(RV_LW, RV_T6, RV_GP, 0, 0);
+        emit(RV_ADDI, RV_T6, RV_T6, 0, delta);
+        emit(RV_SW, 0, RV_GP, RV_T6, 0);
+        if (overflowStub >= 0) emit(RV_BLT, 0, RV_T6, RV_ZERO).label = overflowStub;
+    }
+
+    void function(size_t f) {
+        const MFunc& fn = funcs[f];
+        Rv32Frame frame(fn);
+        int localBase = (int)labelNames.size();
+        for (int l = 0; l < fn.labels; l++) newLabel("");
+        int dzStub = newLabel(""), ovStub = newLabel("");
+        bool divides = false;
+
+        place((int)f);
+        adjustSp(-frame.size);
+        frameAccess(RV_SW, RV_RA, frame.size - 4);
+        frameAccess(RV_SW, RV_S0, frame.size - 8);
+        for (size_t k = 0; k < fn.savedRegs.size(); k++) {
+            frameAccess(RV_SW, fn.savedRegs[k], frame.savedBase + 4 * (int)k);
+        }
+        if (fitsImm12(frame.size)) {
+            emit(RV_ADDI, RV_S0, RV_SP, 0, frame.size);
+        } else {
+            li(RV_T6, frame.size);
+            emit(RV_ADD, RV_S0, RV_SP, RV_T6);
+        }
+        depth(-1, ovStub);
+        for (MInst in : fn.code) {
+            switch (in.op) {
+                case RV_LABEL: place(localBase + in.label); break;
+                case RV_LI: li(in.rd, in.imm); break;
+                case RV_J: emit(RV_JAL, RV_ZERO).label = localBase + in.label; break;
+                case RV_CALL: emit(RV_JAL, RV_RA).label = in.label; break;
+                case RV_LOADSLOT: frameAccess(RV_LW, in.rd, frame.spillBase + 4 * in.imm); break;
+                case RV_STORESLOT: frameAccess(RV_SW, in.rd, frame.spillBase + 4 * in.imm); break;
+                case RV_LOADARG: emit(RV_LW, in.rd, RV_S0, 0, 4 * in.imm); break;
+                case RV_STOREARG: emit(RV_SW, 0, RV_SP, in.rn, 4 * in.imm); break;
+                case RV_RET:
+                    depth(1, -1);
+                    for (size_t k = 0; k < fn.savedRegs.size(); k++) {
+                        frameAccess(RV_LW, fn.savedRegs[k], frame.savedBase + 4 * (int)k);
+                    }
+                    frameAccess(RV_LW, RV_RA, frame.size - 4);
+                    frameAccess(RV_LW, RV_S0, frame.size - 8);
+                    adjustSp(frame.size);
+                    emit(RV_JALR, RV_ZERO, RV_RA, 0, 0);
+                    break;
+                default:
+                    if (rvIsBranch(in.op)) {
+                        divides |= in.label == LABEL_DIVZERO;
+                        in.label = in.label == LABEL_DIVZERO ? dzStub : localBase + in.label;
+                    }
+                    code.push_back(in);
+                    break;
+            }
+        }
+        // Out-of-line jumps to the shared error handlers keep the checks
+        // themselves short forward branches.
+        if (divides) {
+            place(dzStub);
+            emit(RV_JAL, RV_ZERO).label = divzero;
+        }
+        place(ovStub);
+        emit(RV_JAL, RV_ZERO).label = overflow;
+    }
+
+    void runtime() {
+        int digit = newLabel(""), positive = newLabel("");
+        place(print);
+        emit(RV_ADDI, RV_SP, RV_SP, 0, -16);
+        emit(RV_ADDI, RV_A1, RV_SP, 0, 15);
+        emit(RV_ADDI, 5, RV_ZERO, 0, 10);  // t0 = 10
+        emit(RV_SB, 0, RV_A1, 5, 0);
+        emit(RV_SRAI, 7, RV_A0, 0, 31);    // t2 = sign mask
+        emit(RV_XOR, 6, RV_A0, 7);         // t1 = |a0|, as unsigned
+        emit(RV_SUB, 6, 6, 7);
+        place(digit);
+        emit(RV_REMU, 28, 6, 5);
+        emit(RV_DIVU, 6, 6, 5);
+        emit(RV_ADDI, 28, 28, 0, 48);
+        emit(RV_ADDI, RV_A1, RV_A1, 0, -1);
+        emit(RV_SB, 0, RV_A1, 28, 0);
+        emit(RV_BNE, 0, 6, RV_ZERO).label = digit;
+        emit(RV_BGE, 0, RV_A0, RV_ZERO).label = positive;
+        emit(RV_ADDI, 28, RV_ZERO, 0, 45);
+        emit(RV_ADDI, RV_A1, RV_A1, 0, -1);
+        emit(RV_SB, 0, RV_A1, 28, 0);
+        place(positive);
+        emit(RV_ADDI, RV_A2, RV_SP, 0, 16);
+        emit(RV_SUB, RV_A2, RV_A2, RV_A1);
+        emit(RV_ADDI, RV_A0, RV_ZERO, 0, 1);
+        emit(RV_ADDI, RV_A7, RV_ZERO, 0, 64);
+        emit(RV_ECALL);
+        emit(RV_ADDI, RV_SP, RV_SP, 0, 16);
+        emit(RV_JALR, RV_ZERO, RV_RA, 0, 0);
+
+        place(divzero);
+        emit(RV_ADDI, RV_A1, RV_GP, 0, 4);
+        emit(RV_ADDI, RV_A2, RV_ZERO, 0, 32);
+        emit(RV_JAL, RV_ZERO).label = fail;
+        place(overflow);
+        emit(RV_ADDI, RV_A1, RV_GP, 0, 36);
+        emit(RV_ADDI, RV_A2, RV_ZERO, 0, 30);
+        place(fail);
+        emit(RV_ADDI, RV_A0, RV_ZERO, 0, 2);
+        emit(RV_ADDI, RV_A7, RV_ZERO, 0, 64);
+        emit(RV_ECALL);
+        emit(RV_ADDI, RV_A0, RV_ZERO, 0, 1);
+        emit(RV_ADDI, RV_A7, RV_ZERO, 0, 93);
+        emit(RV_ECALL);
+    }
+
+    static int invert(int op) {
+        switch (op) {
+            case RV_BEQ: return RV_BNE;
+            case RV_BNE: return RV_BEQ;
+            case RV_BLT: return RV_BGE;
+            case RV_BGE: return RV_BLT;
+            case RV_BLTU: return RV_BGEU;
+            default: return RV_BLTU;
+        }
+    }
+
+    // Address of every label, given the current instruction list.
+    vector<uint32_t> layout(uint32_t textBase, vector<uint32_t>* at) const {
+        vector<uint32_t> labels(labelNames.size(), 0);
+        uint32_t pc = textBase;
+        for (const auto& in : code) {
+            if (at) at->push_back(pc);
+            if (in.op == RV_LABEL) labels[in.label] = pc;
+            else pc += 4;
+        }
+        return labels;
+    }
+
+    // Branches reach 4 KiB and jal 1 MiB. Anything further is rewritten as
+    // an inverted branch over a jal, or auipc and jalr, until it all fits.
+    void relax(uint32_t textBase) {
+        for (bool changed = true; changed;) {
+            changed = false;
+            vector<uint32_t> at;
+            vector<uint32_t> labels = layout(textBase, &at);
+            vector<MInst> out;
+            for (size_t i = 0; i < code.size(); i++) {
+                const MInst& in = code[i];
+                int64_t delta = in.label >= 0 ? (int64_t)labels[in.label] - at[i] : 0;
+                if (rvIsBranch(in.op) && in.label >= 0 && (delta < -4096 || delta > 4094)) {
+                    int skip = newLabel("");
+                    MInst b = in;
+                    b.op = invert(in.op);
+                    b.label = skip;
+                    out.push_back(b);
+                    MInst j = Rv32Target::make(RV_JAL, RV_ZERO, 0, 0);
+                    j.label = in.label;
+                    out.push_back(j);
+                    MInst l = Rv32Target::make(RV_LABEL);
+                    l.label = skip;
+                    out.push_back(l);
+                    changed = true;
+                } else if (in.op == RV_JAL && in.label >= 0 && (delta < -(1 << 20) || delta >= (1 << 20))) {
+                    int link = in.rd == RV_RA ? RV_RA : RV_T6;
+                    MInst hi = Rv32Target::make(RV_AUIPC, link, 0, 0);
+                    hi.label = in.label;
+                    out.push_back(hi);
+                    MInst lo = Rv32Target::make(RV_JALR, in.rd, link, 0);
+                    lo.label = in.label;
+                    out.push_back(lo);
+                    changed = true;
+                } else {
+                    out.push_back(in);
+                }
+            }
+            code.swap(out);
+        }
+    }
+
+    static uint32_t encode(const MInst& in, uint32_t pc, int64_t target, uint32_t dataBase) {
+        const RvOpInfo& info = rvInfo(in.op);
+        uint32_t w = info.bits;
+        uint32_t rd = in.rd & 31, rs1 = in.rn & 31, rs2 = in.rm & 31;
+        int32_t imm = in.imm;
+        int32_t delta = (int32_t)(target - pc);
+        switch (info.format) {
+            case 'R': return w | rs2 << 20 | rs1 << 15 | rd << 7;
+            case 'I': case 'L':
+                if (in.op == RV_ADDI && in.label >= 0) imm = (int32_t)(dataBase << 20) >> 20;
+                // The jalr of an auipc pair is relative to the auipc.
+                if (in.op == RV_JALR && in.label >= 0) imm = (int32_t)((uint32_t)(delta + 4) << 20) >> 20;
+                return w | ((uint32_t)imm & 0xfff) << 20 | rs1 << 15 | rd << 7;
+            case 'H': return w | (uint32_t)(imm & 31) << 20 | rs1 << 15 | rd << 7;
+            case 'S':
+                return w | ((uint32_t)imm >> 5 & 0x7f) << 25 | rs2 << 20 | rs1 << 15 | ((uint32_t)imm & 31) << 7;
+            case 'B': {
+                uint32_t d = (uint32_t)delta;
+                return w | (d >> 12 & 1) << 31 | (d >> 5 & 0x3f) << 25 | rs2 << 20 | rs1 << 15 | (d >> 1 & 15) << 8 |
+                       (d >> 11 & 1) << 7;
+            }
+            case 'U': {
+                uint32_t value = (uint32_t)imm << 12;
+                if (in.op == RV_LUI && in.label >= 0) value = dataBase + 0x800;
+                if (in.op == RV_AUIPC) value = (uint32_t)delta + 0x800;
+                return w | (value & 0xfffff000) | rd << 7;
+            }
+            case 'J': {
+                uint32_t d = (uint32_t)delta;
+                return w | (d >> 20 & 1) << 31 | (d >> 1 & 0x3ff) << 21 | (d >> 11 & 1) << 20 | (d >> 12 & 0xff) << 12 |
+                       rd << 7;
+            }
+            default: return w;
+        }
+    }
+
+public:
+    Rv32Assembler(const vector<MFunc>& f, int m) : funcs(f), mainFunc(m) {
+        for (size_t i = 0; i < funcs.size(); i++) newLabel("tc_f_" + funcs[i].name);
+        int start = newLabel("_start");
+        dataLabel = newLabel("tc_data");
+        print = newLabel("tc_print");
+        divzero = newLabel("tc_divzero");
+        overflow = newLabel("tc_overflow");
+        fail = newLabel("tc_fail");
+        data.assign("\xa0\x86\x01\x00", 4);  // 100000
+        data += "runtime error: division by zero\n";
+        data += "runtime error: stack overflow\n";
+
+        place(start);
+        emit(RV_LUI, RV_GP).label = dataLabel;
+        emit(RV_ADDI, RV_GP, RV_GP).label = dataLabel;
+        emit(RV_JAL, RV_RA).label = mainFunc;
+        emit(RV_JAL, RV_RA).label = print;
+        emit(RV_ADDI, RV_A0, RV_ZERO, 0, 0);
+        emit(RV_ADDI, RV_A7, RV_ZERO, 0, 93);
+        emit(RV_ECALL);
+        for (size_t i = 0; i < funcs.size(); i++) function(i);
+        runtime();
+    }
+
+    RvImage link() {
+        RvImage image;
+        image.textBase = 0x10000;
+        relax(image.textBase);
+        vector<uint32_t> at;
+        vector<uint32_t> labels = layout(image.textBase, &at);
+        uint32_t textEnd = image.textBase;
+        for (const auto& in : code) textEnd += in.op == RV_LABEL ? 0 : 4;
+        image.dataBase = (textEnd + 0xfff) & ~0xfffu;
+        image.entry = labels[funcs.size()];
+        image.data = data;
+        for (size_t i = 0; i < code.size(); i++) {
+            const MInst& in = code[i];
+            if (in.op == RV_LABEL) continue;
+            int64_t target = in.label >= 0 ? labels[in.label] : 0;
+            image.code.push_back(encode(in, at[i], target, image.dataBase));
+        }
+        for (size_t i = 0; i < funcs.size(); i++) {
+            image.funcStart.push_back(labels[i]);
+            image.funcNames.push_back(funcs[i].name);
+        }
+        image.funcStart.push_back(labels[print]);
+        image.funcNames.push_back("(runtime)");
+        return image;
+    }
+
+    // GNU assembler syntax, with the same instructions as link() encodes.
+    void write(ostream& out) {
+        relax(0x10000);
+        out << "# Generated by parser --emit-riscv.\n"
+               "\t.text\n"
+               "\t.globl\t_start\n";
+        for (size_t i = 0; i < code.size(); i++) {
+            const MInst& in = code[i];
+            const RvOpInfo& info = rvInfo(in.op);
+            if (in.op == RV_LABEL) {
+                out << labelNames[in.label] << ":\n";
+                continue;
+            }
+            if (in.op == RV_AUIPC) {
+                // A relaxed far jump; the assembler expands these back to
+                // the same auipc and jalr pair.
+                if (in.rd == RV_RA) out << "\tcall\t" << labelNames[in.label] << "\n";
+                else out << "\tjump\t" << labelNames[in.label] << ", " << rvRegName(in.rd) << "\n";
+                continue;
+            }
+            if (in.op == RV_JALR && in.label >= 0) continue;
+            out << "\t" << info.name;
+            switch (info.format) {
+                case 'R':
+                    out << "\t" << rvRegName(in.rd) << ", " << rvRegName(in.rn) << ", " << rvRegName(in.rm);
+                    break;
+                case 'I': case 'H':
+                    out << "\t" << rvRegName(in.rd) << ", " << rvRegName(in.rn) << ", ";
+                    if (in.label >= 0) out << "%lo(" << labelNames[in.label] << ")";
+                    else out << in.imm;
+                    break;
+                case 'L':
+                    out << "\t" << rvRegName(in.rd) << ", " << in.imm << "(" << rvRegName(in.rn) << ")";
+                    break;
+                case 'S':
+                    out << "\t" << rvRegName(in.rm) << ", " << in.imm << "(" << rvRegName(in.rn) << ")";
+                    break;
+                case 'B':
+                    out << "\t" << rvRegName(in.rn) << ", " << rvRegName(in.rm) << ", " << labelNames[in.label];
+                    break;
+                case 'U':
+                    out << "\t" << rvRegName(in.rd) << ", ";
+                    if (in.label >= 0) out << "%hi(" << labelNames[in.label] << ")";
+                    else out << in.imm;
+                    break;
+                case 'J': out << "\t" << rvRegName(in.rd) << ", " << labelNames[in.label]; break;
+                default: break;
+            }
+            out << "\n";
+        }
+        out << "\n\t.data\n"
+               "\t.p2align\t2\n"
+               "tc_data:\n"
+               "\t.word\t100000\n"
+               "\t.ascii\t\"runtime error: division by zero\\n\"\n"
+               "\t.ascii\t\"runtime error: stack overflow\\n\"\n";
+    }
+};
+
+// --sim-riscv: runs an RvImage. Every code word is decoded once up front
+// into a dispatch cache entry (operation, registers, immediate, owning
+// function), so the execution loop is a switch over pre-decoded entries.
+class Rv32Sim {
+private:
+    struct Decoded {
+        uint8_t op, rd, rs1, rs2;
+        int32_t imm;
+        int func;
+    };
+
+    struct Counters {
+        uint64_t insns, cycles, loads, stores, branches, taken, jumps;
+    };
+
+    const RvImage& image;
+    const RvModel& model;
+    vector<uint8_t> mem;
+    vector<Decoded> decoded;
+    vector<Counters> counters;
+    vector<uint32_t> cacheTags;
+    uint32_t x[32];
+    uint64_t ready[32];
+    uint64_t cycle;
+
+    static bool decode(uint32_t w, Decoded& d) {
+        d.rd = w >> 7 & 31;
+        d.rs1 = w >> 15 & 31;
+        d.rs2 = w >> 20 & 31;
+        for (int op = RV_LUI; op <= RV_ECALL; op++) {
+            const RvOpInfo& info = rvInfo(op);
+            uint32_t mask;
+            switch (info.format) {
+                case 'R': case 'H': mask = 0xfe00707f; break;
+                case 'U': case 'J': mask = 0x7f; break;
+                case 'X': mask = 0xffffffff; break;
+                default: mask = 0x707f; break;
+            }
+            if ((w & mask) != info.bits) continue;
+            d.op = (uint8_t)op;
+            switch (info.format) {
+                case 'I': case 'L': d.imm = (int32_t)w >> 20; break;
+                case 'H': d.imm = w >> 20 & 31; break;
+                case 'S': d.imm = ((int32_t)w >> 25) << 5 | (w >> 7 & 31); break;
+                case 'B':
+                    d.imm = ((int32_t)w >> 31) << 12 | (w >> 7 & 1) << 11 | (w >> 25 & 0x3f) << 5 | (w >> 8 & 15) << 1;
+                    break;
+                case 'U': d.imm = (int32_t)(w & 0xfffff000); break;
+                case 'J':
+                    d.imm = ((int32_t)w >> 31) << 20 | (w >> 12 & 0xff) << 12 | (w >> 20 & 1) << 11 | (w >> 21 & 0x3ff) << 1;
+                    break;
+                default: d.imm = 0; break;
+            }
+            // Operands a format does not read must not stall on the scoreboard.
+            if (info.format != 'R' && info.format != 'S' && info.format != 'B') d.rs2 = 0;
+            if (info.format == 'U' || info.format == 'J' || info.format == 'X') d.rs1 = 0;
+            if (info.format == 'S' || info.format == 'B' || info.format == 'X') d.rd = 0;
+            return true;
+        }
+        return false;
+    }
+
+    uint8_t* at(uint32_t addr, uint32_t size) {
+        if ((uint64_t)addr + size > mem.size() || addr < image.textBase) {
+            throw RuntimeError{ "simulator: bad address " + to_string(addr) };
+        }
+        return &mem[addr];
+    }
+
+    // Extra cycles of a data access under the cache model.
+    int access(uint32_t addr) {
+        if (model.lines <= 0) return 0;
+        uint32_t line = addr / model.lineBytes;
+        uint32_t& tag = cacheTags[line % model.lines];
+        if (tag == line) return 0;
+        tag = line;
+        return model.miss;
+    }
+
+public:
+    Rv32Sim(const RvImage& i, const RvModel& m) : image(i), model(m) {
+        size_t stack = 16 << 20;
+        mem.assign(image.dataBase + image.data.size() + stack, 0);
+        memcpy(&mem[image.textBase], image.code.data(), 4 * image.code.size());
+        memcpy(&mem[image.dataBase], image.data.data(), image.data.size());
+        decoded.resize(image.code.size());
+        size_t func = 0;
+        for (size_t k = 0; k < image.code.size(); k++) {
+            uint32_t pc = image.textBase + 4 * (uint32_t)k;
+            while (func + 1 < image.funcStart.size() && pc >= image.funcStart[func + 1]) func++;
+            if (!decode(image.code[k], decoded[k])) decoded[k].op = RV_OP_COUNT;
+            decoded[k].func = pc < image.funcStart[0] ? (int)image.funcStart.size() - 1 : (int)func;
+        }
+        counters.assign(image.funcStart.size(), Counters());
+        cacheTags.assign(max(model.lines, 0), UINT32_MAX);
+    }
+
+    // Runs from the entry point until exit and returns the exit status,
+    // with the program's output appended to out and err.
+    int run(uint64_t maxInsns, string& out, string& err) {
+        memset(x, 0, sizeof x);
+        memset(ready, 0, sizeof ready);
+        cycle = 0;
+        x[RV_SP] = (uint32_t)mem.size() - 16;
+        uint32_t pc = image.entry;
+        uint64_t retired = 0;
+        for (;;) {
+            uint32_t index = (pc - image.textBase) / 4;
+            if (pc < image.textBase || index >= decoded.size() || (pc & 3)) {
+                throw RuntimeError{ "simulator: bad jump to " + to_string(pc) };
+            }
+            if (++retired > maxInsns) throw RuntimeError{ "step limit exceeded" };
+            const Decoded& d = decoded[index];
+            Counters& c = counters[d.func];
+            uint64_t before = cycle;
+            uint64_t issue = max(cycle, max(ready[d.rs1], ready[d.rs2]));
+            cycle = issue + 1;
+            int latency = 1;
+            uint32_t a = x[d.rs1], b = x[d.rs2], r = 0;
+            uint32_t next = pc + 4;
+            bool taken = false;
+            switch (d.op) {
+                case RV_LUI: r = (uint32_t)d.imm; break;
+                case RV_AUIPC: r = pc + (uint32_t)d.imm; break;
+                case RV_JAL: r = next; next = pc + d.imm; taken = true; break;
+                case RV_JALR: r = next; next = (a + d.imm) & ~1u; taken = true; break;
+                case RV_BEQ: taken = a == b; break;
+                case RV_BNE: taken = a != b; break;
+                case RV_BLT: taken = (int32_t)a < (int32_t)b; break;
+                case RV_BGE: taken = (int32_t)a >= (int32_t)b; break;
+                case RV_BLTU: taken = a < b; break;
+                case RV_BGEU: taken = a >= b; break;
+                case RV_LB: case RV_LW: case RV_LBU: {
+                    uint32_t addr = a + d.imm;
+                    if (d.op == RV_LW) memcpy(&r, at(addr, 4), 4);
+                    else r = d.op == RV_LB ? (uint32_t)(int8_t)*at(addr, 1) : *at(addr, 1);
+                    latency = model.load + access(addr);
+                    c.loads++;
+                    break;
+                }
+                case RV_SB: case RV_SW: {
+                    uint32_t addr = a + d.imm;
+                    if (d.op == RV_SW) memcpy(at(addr, 4), &b, 4);
+                    else *at(addr, 1) = (uint8_t)b;
+                    cycle += access(addr);
+                    c.stores++;
+                    break;
+                }
+                case RV_ADDI: r = a + d.imm; break;
+                case RV_SLTI: r = (int32_t)a < d.imm; break;
+                case RV_SLTIU: r = a < (uint32_t)d.imm; break;
+                case RV_XORI: r = a ^ d.imm; break;
+                case RV_ORI: r = a | d.imm; break;
+                case RV_ANDI: r = a & d.imm; break;
+                case RV_SLLI: r = a << d.imm; break;
+                case RV_SRLI: r = a >> d.imm; break;
+                case RV_SRAI: r = (uint32_t)((int32_t)a >> d.imm); break;
+                case RV_ADD: r = a + b; break;
+                case RV_SUB: r = a - b; break;
+                case RV_SLL: r = a << (b & 31); break;
+                case RV_SLT: r = (int32_t)a < (int32_t)b; break;
+                case RV_SLTU: r = a < b; break;
+                case RV_XOR: r = a ^ b; break;
+                case RV_SRL: r = a >> (b & 31); break;
+                case RV_SRA: r = (uint32_t)((int32_t)a >> (b & 31)); break;
+                case RV_OR: r = a | b; break;
+                case RV_AND: r = a & b; break;
+                case RV_MUL: r = a * b; latency = model.mul; break;
+                case RV_MULH: r = (uint32_t)((int64_t)(int32_t)a * (int32_t)b >> 32); latency = model.mul; break;
+                case RV_MULHSU: r = (uint32_t)((int64_t)(int32_t)a * (uint64_t)b >> 32); latency = model.mul; break;
+                case RV_MULHU: r = (uint32_t)((uint64_t)a * b >> 32); latency = model.mul; break;
+                case RV_DIV:
+                    r = b == 0 ? UINT32_MAX : (a == 0x80000000u && b == UINT32_MAX) ? a : (uint32_t)((int32_t)a / (int32_t)b);
+                    latency = model.div;
+                    break;
+                case RV_DIVU: r = b == 0 ? UINT32_MAX : a / b; latency = model.div; break;
+                case RV_REM:
+                    r = b == 0 ? a : (a == 0x80000000u && b == UINT32_MAX) ? 0 : (uint32_t)((int32_t)a % (int32_t)b);
+                    latency = model.div;
+                    break;
+                case RV_REMU: r = b == 0 ? a : a % b; latency = model.div; break;
+                case RV_ECALL:
+                    if (x[RV_A7] == 64) {
+                        string text((const char*)at(x[RV_A1], x[RV_A2]), x[RV_A2]);
+                        (x[RV_A0] == 2 ? err : out) += text;
+                        x[RV_A0] = x[RV_A2];
+                        break;
+                    }
+                    if (x[RV_A7] == 93) {
+                        c.insns++;
+                        c.cycles += cycle - before;
+                        return (int)x[RV_A0];
+                    }
+                    throw RuntimeError{ "simulator: unknown ecall " + to_string(x[RV_A7]) };
+                default:
+                    throw RuntimeError{ "simulator: illegal instruction at " + to_string(pc) };
+            }
+            if (rvIsBranch(d.op)) {
+                c.branches++;
+                if (taken) {
+                    next = pc + d.imm;
+                    c.taken++;
+                }
+            } else if (taken) {
+                c.jumps++;
+            }
+            if (taken) cycle += model.branch;
+            if (d.rd) {
+                x[d.rd] = r;
+                ready[d.rd] = issue + latency;
+            }
+            c.insns++;
+            c.cycles += cycle - before;
+            pc = next;
+        }
+    }
+
+    void report(ostream& out) const {
+        char line[160];
+        snprintf(line, sizeof line, "%-20s %12s %12s %10s %10s %10s %10s %10s\n", "function", "insns", "cycles",
+                 "loads", "stores", "branches", "taken", "jumps");
+        out << line;
+        Counters total = Counters();
+        for (size_t i = 0; i < counters.size(); i++) {
+            const Counters& c = counters[i];
+            total.insns += c.insns;
+            total.cycles += c.cycles;
+            total.loads += c.loads;
+            total.stores += c.stores;
+            total.branches += c.branches;
+            total.taken += c.taken;
+            total.jumps += c.jumps;
+            if (c.insns == 0) continue;
+            snprintf(line, sizeof line, "%-20s %12llu %12llu %10llu %10llu %10llu %10llu %10llu\n",
+                     image.funcNames[i].c_str(), (unsigned long long)c.insns, (unsigned long long)c.cycles,
+                     (unsigned long long)c.loads, (unsigned long long)c.stores, (unsigned long long)c.branches,
+                     (unsigned long long)c.taken, (unsigned long long)c.jumps);
+            out << line;
+        }
+        snprintf(line, sizeof line, "%-20s %12llu %12llu %10llu %10llu %10llu %10llu %10llu\n", "total",
+                 (unsigned long long)total.insns, (unsigned long long)total.cycles, (unsigned long long)total.loads,
+                 (unsigned long long)total.stores, (unsigned long long)total.branches,
+                 (unsigned long long)total.taken, (unsigned long long)total.jumps);
+        out << line;
+        snprintf(line, sizeof line, "model %s: %.3f cycles per instruction\n", model.name.c_str(),
+                 total.insns ? (double)total.cycles / total.insns : 0.0);
+        out << line;
+    }
+};
+
+int simulateRv32(const RvImage& image, const RvModel& model, uint64_t maxInsns) {
+    Rv32Sim sim(image, model);
+    string out, err;
+    int status;
+    try {
+        status = sim.run(maxInsns, out, err);
+    } catch (const RuntimeError& e) {
+        err += "runtime error: " + e.message + "\n";
+        status = 1;
+    }
+    cout << out << flush;
+    cerr << err;
+    sim.report(cerr);
+    return status;
+}
+
+// Times the lexer alone, with and without the trivia table, and lexing plus
+// parsing with both parser instantiations, all on the same input.
+void runBenchmark(const string& input, int iterations) {
+    typedef chrono::steady_clock Clock;
+    size_t sink = 0;
+    auto timeIt = [&](const char* label, const function<void()>& body) {
+        Clock::time_point start = Clock::now();
+        for (int i = 0; i < iterations; i++) body();
+        double ms = chrono::duration<double, milli>(Clock::now() - start).count();
+        cout << label << ms / iterations << " ms/iter" << endl;
+    };
+
+    timeIt("lex:        ", [&]() {
+        Lexer lexer(input);
+        sink += tokenize(lexer).size();
+    });
+    timeIt("lex+trivia: ", [&]() {
+        vector<Trivia> trivia;
+        Lexer lexer(input, &trivia);
+        sink += tokenize(lexer).size() + trivia.size();
+    });
+    timeIt("check:      ", [&]() {
+        NullBuilder builder;
+        sink += checkSource(input, builder).size();
+    });
+    timeIt("ast:        ", [&]() {
+        AstBuilder builder;
+        sink += checkSource(input, builder).size();
+        sink += builder.program.nodes.size();
+    });
+    if (sink == 0) cout << endl;
+}
+
+int main(int argc, char** argv) {
+    bool shake = false;
+    int benchIterations = 0;
+    vector<string> files;
+    string indexPath, watchRoot, xrefBuild, xrefIndex, xrefQuery;
+    bool format = false, inPlace = false, minify = false, semantic = false;
+    string range;
+    bool run = false, ngrams = false, farm = false, emitC = false, emitLlvm = false;
+    bool emitTac = false, emitA64 = false, emitRv = false, simRv = false;
+    bool peephole = true, peepholeStats = false;
+    RvSchedule schedule = SCHEDULE_NONE;
+    string elfPath;
+    RvModel rvModel;
+    parseRvModel("inorder", rvModel);
+    RunOptions runOpts;
+    runOpts.engine = "vm";
+    runOpts.limits.maxDepth = 100000;
+    runOpts.limits.maxSteps = UINT64_MAX;
+    runOpts.timing = false;
+    runOpts.superinstructions = true;
+    runOpts.memoize = false;
+    runOpts.workers = 0;
+    runOpts.forkDepth = 12;
+    runOpts.unroll = 0;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (!arg.empty() && arg[0] != '-') {
+            files.push_back(arg);
+        } else if (arg == "--shake") {
+            shake = true;
+        } else if (arg == "--index" && i + 1 < argc) {
+            indexPath = argv[++i];
+        } else if (arg == "--format") {
+            format = true;
+        } else if (arg == "--semantic-tokens") {
+            semantic = true;
+        } else if (arg == "--range" && i + 1 < argc) {
+            range = argv[++i];
+        } else if (arg == "--run") {
+            run = true;
+        } else if (arg == "--engine" && i + 1 < argc) {
+            runOpts.engine = argv[++i];
+        } else if (arg == "--max-depth" && i + 1 < argc) {
+            runOpts.limits.maxDepth = atoi(argv[++i]);
+        } else if (arg == "--no-super") {
+            runOpts.superinstructions = false;
+        } else if (arg == "--memoize") {
+            runOpts.memoize = true;
+        } else if (arg == "--parallel" && i + 1 < argc) {
+            runOpts.workers = max(1, atoi(argv[++i]));
+        } else if (arg == "--fork-depth" && i + 1 < argc) {
+            runOpts.forkDepth = atoi(argv[++i]);
+        } else if (arg == "--budget" && i + 1 < argc) {
+            runOpts.limits.maxSteps = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--unroll" && i + 1 < argc) {
+            runOpts.unroll = atoi(argv[++i]);
+        } else if (arg == "--cache-dir" && i + 1 < argc) {
+            runOpts.cacheDir = argv[++i];
+        } else if (arg == "--emit-c") {
+            emitC = true;
+        } else if (arg == "--emit-llvm") {
+            emitLlvm = true;
+        } else if (arg == "--emit-tac") {
+            emitTac = true;
+        } else if (arg == "--emit-aarch64") {
+            emitA64 = true;
+        } else if (arg == "--emit-elf" && i + 1 < argc) {
+            elfPath = argv[++i];
+        } else if (arg == "--emit-riscv") {
+            emitRv = true;
+        } else if (arg == "--sim-riscv") {
+            simRv = true;
+        } else if (arg == "--no-peephole") {
+            peephole = false;
+        } else if (arg == "--peephole-stats") {
+            peepholeStats = true;
+        } else if (arg == "--schedule" && i + 1 < argc) {
+            string when = argv[++i];
+            if (when == "none") schedule = SCHEDULE_NONE;
+            else if (when == "pre") schedule = SCHEDULE_PRE;
+            else if (when == "post") schedule = SCHEDULE_POST;
+            else {
+                cerr << "bad --schedule: " << when << endl;
+                return 2;
+            }
+        } else if (arg == "--rv-model" && i + 1 < argc) {
+            if (!parseRvModel(argv[++i], rvModel)) {
+                cerr << "bad --rv-model: " << argv[i] << endl;
+                return 2;
+            }
+        } else if (arg == "--farm") {
+            farm = true;
+        } else if (arg == "--ngrams") {
+            ngrams = true;
+        } else if (arg == "--time") {
+            runOpts.timing = true;
+        } else if (arg == "--minify") {
+            minify = true;
+        } else if (arg == "-i" || arg == "--in-place") {
+            inPlace = true;
+        } else if (arg == "--xref-build" && i + 1 < argc) {
+            xrefBuild = argv[++i];
+        } else if (arg == "--xref" && i + 2 < argc) {
+            xrefIndex = argv[++i];
+            xrefQuery = argv[++i];
+        } else if (arg == "--watch" && i + 1 < argc) {
+            watchRoot = argv[++i];
+        } else if (arg == "--bench" && i + 1 < argc) {
+            benchIterations = atoi(argv[++i]);
+        } else {
+            cerr << "unknown option: " << arg << endl;
+            return 2;
+        }
+    }
+
+    if (!watchRoot.empty()) {
+        return watchDir(watchRoot);
+    }
+    if (!xrefBuild.empty()) {
+        return buildXref(xrefBuild, files);
+    }
+    if (!xrefIndex.empty()) {
+        return queryXref(xrefIndex, xrefQuery);
+    }
+    if (ngrams) {
+        return printNgrams(files);
+    }
+    if (farm) {
+        return runFarm(files, runOpts);
+    }
+    if (run && !files.empty()) {
+        string text;
+        if (!readFile(files[0], text)) {
+            cerr << files[0] << ": cannot open file" << endl;
+            return 1;
+        }
+        return runProgram(text, files[0], runOpts);
+    }
+    if (format && !files.empty()) {
+        return formatFiles(files, inPlace, "");
+    }
+    if (minify && !files.empty()) {
+        string text;
+        if (files.size() > 1) {
+            cerr << "--minify takes one file" << endl;
+            return 2;
+        }
+        if (!readFile(files[0], text)) {
+            cerr << files[0] << ": cannot open file" << endl;
+            return 1;
+        }
+        return minifySource(text, cout);
+    }
+    if (semantic && !files.empty()) {
+        string text;
+        if (files.size() > 1) {
+            cerr << "--semantic-tokens takes one file" << endl;
+            return 2;
+        }
+        if (!readFile(files[0], text)) {
+            cerr << files[0] << ": cannot open file" << endl;
+            return 1;
+        }
+        return printSemanticTokens(text, range);
+    }
+    if (!files.empty()) {
+        return checkFiles(files, indexPath);
+    }
+
+    string input, line;
+    while (getline(cin, line)) {
+        input += line + "\n";
+    }
+
+    if (format) {
+        return formatFiles(files, false, input);
+    }
+    if (minify) {
+        return minifySource(input, cout);
+    }
+    if (semantic) {
+        return printSemanticTokens(input, range);
+    }
+    if (run) {
+        return runProgram(input, "", runOpts);
+    }
+    if (emitC || emitLlvm) {
+        AstBuilder builder;
+        if (!loadProgram(input, builder)) return 1;
+        if (runOpts.unroll > 0) optimizeLoops(builder.program, runOpts.unroll, runOpts.timing);
+        if (emitC) CEmitter(builder.program, cout).emit();
+        else LlvmEmitter(builder.program, cout).emit();
+        return 0;
+    }
+    if (emitTac || emitA64 || !elfPath.empty() || emitRv || simRv) {
+        AstBuilder builder;
+        if (!loadProgram(input, builder)) return 1;
+        if (runOpts.unroll > 0) optimizeLoops(builder.program, runOpts.unroll, runOpts.timing);
+        vector<TacFunc> tac = lowerToTac(builder.program);
+        if (emitTac) {
+            printTac(builder.program, tac, cout);
+            return 0;
+        }
+        PeepholeStats stats;
+        PeepholeStats* peep = peephole ? &stats : nullptr;
+        vector<MFunc> funcs = emitRv || simRv ? compileRv32(tac, peep, schedule, rvModel) : compileA64(tac, peep);
+        if (peepholeStats) stats.report(cerr);
+        if (emitRv || simRv) {
+            Rv32Assembler rv(funcs, mainIndex(builder.program));
+            if (simRv) return simulateRv32(rv.link(), rvModel, runOpts.limits.maxSteps);
+            rv.write(cout);
+            return 0;
+        }
+        if (!elfPath.empty()) return A64ElfWriter(funcs, mainIndex(builder.program)).write(elfPath) ? 0 : 1;
+        A64AsmWriter(cout).write(funcs, mainIndex(builder.program));
+        return 0;
+    }
+
+    if (benchIterations > 0) {
+        runBenchmark(input, benchIterations);
+        return 0;
+    }
+
+    map<int, string> allErrors;
+    if (shake) {
+        AstBuilder builder;
+        allErrors = checkSource(input, builder);
+        if (allErrors.empty()) {
+            vector<string> dropped;
+            size_t total = builder.program.funcs.size();
+            shakeDeadFunctions(builder.program, &dropped);
+            printProgram(cout, builder.program);
+            cerr << "removed " << dropped.size() << " of " << total << " functions" << endl;
+            return 0;
+        }
+    } else {
+        NullBuilder builder;
+        allErrors = checkSource(input, builder);
+    }
 
     if (allErrors.empty()) {
         cout << "accept" << endl;
@@ -512,4 +8192,4 @@ int main() {
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,62 @@
+#!/bin/sh
+# Builds every bench program for AArch64 twice, through --emit-aarch64 with
+# an assembler and linker and directly with --emit-elf, and runs both under
+# qemu-aarch64 user mode, checking the result and exit status against the
+# interpreter. Assembles with a cross binutils when installed, otherwise
+# with llvm-mc and ld.lld. Without qemu the programs are only built.
+# Usage: bench/aarch64.sh [PARSER]
+PARSER=${1:-./parser}
+QEMU=${QEMU:-qemu-aarch64}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+if command -v aarch64-linux-gnu-as > /dev/null; then
+    assemble() { aarch64-linux-gnu-as "$1" -o "$2"; }
+elif command -v llvm-mc > /dev/null; then
+    assemble() { llvm-mc -triple=aarch64-linux-gnu -filetype=obj "$1" -o "$2"; }
+else
+    echo "need aarch64-linux-gnu-as or llvm-mc" >&2
+    exit 2
+fi
+if command -v aarch64-linux-gnu-ld > /dev/null; then
+    link() { aarch64-linux-gnu-ld "$1" -o "$2"; }
+elif command -v ld.lld > /dev/null; then
+    link() { ld.lld "$1" -o "$2"; }
+else
+    echo "need aarch64-linux-gnu-ld or ld.lld" >&2
+    exit 2
+fi
+command -v "$QEMU" > /dev/null || { echo "$QEMU not found: building only"; QEMU=; }
+
+now() { date +%s%N; }
+
+viaAsm() {
+    "$PARSER" --emit-aarch64 < "$1" > "$2.s" && assemble "$2.s" "$2.o" && link "$2.o" "$2"
+}
+
+check() {
+    got=$("$QEMU" "$1" 2>&1)
+    gotStatus=$?
+    [ "$got" = "$expect" ] && [ $gotStatus -eq $expectStatus ] && return 0
+    echo "$name: $2 expected $expect ($expectStatus), got $got ($gotStatus)"
+    return 1
+}
+
+status=0
+printf '%-12s %-12s %8s %8s\n' program result asm+ld elf
+for f in bench/*.tc; do
+    name=$(basename "$f" .tc)
+    expect=$("$PARSER" --run < "$f" 2>&1)
+    expectStatus=$?
+    t0=$(now)
+    viaAsm "$f" "$TMP/$name-asm" || { echo "$name: assembly build failed"; status=1; continue; }
+    t1=$(now)
+    "$PARSER" --emit-elf "$TMP/$name-elf" < "$f" || { echo "$name: --emit-elf failed"; status=1; continue; }
+    t2=$(now)
+    printf '%-12s %-12s %6sms %6sms\n' "$name" "$expect" $(( (t1 - t0) / 1000000 )) $(( (t2 - t1) / 1000000 ))
+    if [ -n "$QEMU" ]; then
+        check "$TMP/$name-asm" asm || status=1
+        check "$TMP/$name-elf" elf || status=1
+    fi
+done
+exit $status
@@ -0,0 +1,68 @@
+#!/bin/sh
+# Regression cases for the source tools. Each case feeds a small program to
+# the parser and compares one line of output with the expected text.
+# Usage: bench/check.sh [PARSER]
+PARSER=${1:-./parser}
+status=0
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+expect() {
+    if [ "$2" = "$3" ]; then
+        printf '%-40s ok\n' "$1"
+    else
+        printf '%-40s FAIL: got "%s", want "%s"\n' "$1" "$2" "$3"
+        status=1
+    fi
+}
+
+# A call resolves to the function even while a same-named local is in scope.
+SHADOW='int f(){return 1;} int main(){int f=2; return f()+f;}'
+expect "minify keeps call under shadowing local" \
+    "$(echo "$SHADOW" | "$PARSER" --minify | "$PARSER" --run)" "3"
+# A local's initializer still sees the outer binding of the same name.
+INIT='int main(){ int x = 5; { int x = x + 1; return x; } }'
+expect "minify keeps outer local in initializer" \
+    "$(echo "$INIT" | "$PARSER" --minify | "$PARSER" --run)" "6"
+echo "$SHADOW" > "$TMP/shadow.tc"
+expect "minify reads a file argument" \
+    "$("$PARSER" --minify "$TMP/shadow.tc")" "$(echo "$SHADOW" | "$PARSER" --minify)"
+expect "minify rejects invalid input" \
+    "$(echo 'int main(){return 1 $ 2;}' | "$PARSER" --minify | head -1)" "reject"
+
+# Line 3 holds only the call f(): one token, typed function (1).
+SHADOW_LINES='int f(){return 1;}
+int main(){int f=2; return
+f()
++f;}'
+expect "semantic tokens type call as function" \
+    "$(echo "$SHADOW_LINES" | "$PARSER" --semantic-tokens --range 3:3 | sed 's/.*"data":\[\(.*\)\]}/\1/')" "2,0,1,1,0"
+echo "$SHADOW_LINES" > "$TMP/lines.tc"
+expect "semantic tokens read a file argument" \
+    "$("$PARSER" --semantic-tokens "$TMP/lines.tc")" "$(echo "$SHADOW_LINES" | "$PARSER" --semantic-tokens)"
+
+# The call at 2:28 resolves to the function, not the local declared at 2:16.
+printf 'int f(){return 1;}\nint main(){int f=2; return f()+f;}\n' > "$TMP/a.tc"
+echo 'int g(){return 0;}' > "$TMP/b.tc"
+"$PARSER" --xref-build "$TMP/x.idx" "$TMP/b.tc" "$TMP/a.tc"
+expect "xref resolves call to the function" \
+    "$("$PARSER" --xref "$TMP/x.idx" "$TMP/a.tc:2:28" | head -1)" "$TMP/a.tc:1:5 def function f"
+
+# A local whose declaration never ran reads as zero on every engine.
+SKIPPED='int g(int a,int b,int c,int d){int q=a+b+c+d;return q;}
+int h(){int r=0; if (r) int y=3; return y;}
+int main(){int t=g(11,22,33,44); return h();}'
+for e in walk closure vm; do
+    expect "skipped local is zero ($e)" "$(echo "$SKIPPED" | "$PARSER" --run --engine $e)" "0"
+done
+
+# The x in the initializer is the outer local at 1:17, not the one it declares.
+echo 'int main(){ int x = 5; { int x = x + 1; return x; } }' > "$TMP/s.tc"
+"$PARSER" --xref-build "$TMP/s.idx" "$TMP/s.tc"
+expect "xref resolves initializer to outer local" \
+    "$("$PARSER" --xref "$TMP/s.idx" "$TMP/s.tc:1:34" | head -1)" "$TMP/s.tc:1:17 def local x"
+head -c 64 "$TMP/s.idx" > "$TMP/cut.idx"
+expect "xref rejects a truncated index" \
+    "$("$PARSER" --xref "$TMP/cut.idx" x 2>&1)" "$TMP/cut.idx: cannot read index"
+
+exit $status
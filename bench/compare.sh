@@ -0,0 +1,31 @@
+#!/bin/sh
+# Runs every bench program on the interpreters and on native code built
+# through --emit-c and the host C compiler, checking that the results agree.
+# Usage: bench/compare.sh [PARSER]   (CC and CFLAGS are honoured)
+PARSER=${1:-./parser}
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O2}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+ms() {
+    start=$(date +%s%N)
+    "$@" > "$TMP/out" 2>/dev/null
+    end=$(date +%s%N)
+    echo $(( (end - start) / 1000000 ))
+}
+
+status=0
+printf '%-20s %-12s %8s %8s %8s\n' program result walk vm c
+for f in bench/*.tc; do
+    name=$(basename "$f" .tc)
+    walk=$(ms "$PARSER" --run --engine walk "$f")
+    expect=$(cat "$TMP/out")
+    vm=$(ms "$PARSER" --run --engine vm "$f")
+    [ "$(cat "$TMP/out")" = "$expect" ] || { echo "$name: vm gives $(cat "$TMP/out")"; status=1; }
+    "$PARSER" --emit-c < "$f" > "$TMP/$name.c" && $CC -std=c99 $CFLAGS "$TMP/$name.c" -o "$TMP/$name"
+    c=$(ms "$TMP/$name")
+    [ "$(cat "$TMP/out")" = "$expect" ] || { echo "$name: C gives $(cat "$TMP/out")"; status=1; }
+    printf '%-20s %-12s %6sms %6sms %6sms\n' "$name" "$expect" "$walk" "$vm" "$c"
+done
+exit $status
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Builds every bench program through --emit-llvm at -O0 and -O3 and checks
+# both against the interpreter. Uses clang when installed, otherwise opt and
+# llc with the host C compiler as linker.
+# Usage: bench/llvm.sh [PARSER]
+PARSER=${1:-./parser}
+CC=${CC:-cc}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+build() {
+    if command -v clang > /dev/null; then
+        clang -O"$2" -Wno-override-module "$1" -o "$3"
+    elif command -v opt > /dev/null && command -v llc > /dev/null; then
+        opt -O"$2" "$1" -o "$3.bc" && llc -O"$2" -relocation-model=pic "$3.bc" -o "$3.s" && $CC "$3.s" -o "$3"
+    else
+        echo "need clang, or opt and llc" >&2
+        exit 2
+    fi
+}
+
+ms() {
+    start=$(date +%s%N)
+    "$@" > "$TMP/out" 2>/dev/null
+    end=$(date +%s%N)
+    echo $(( (end - start) / 1000000 ))
+}
+
+status=0
+printf '%-20s %-12s %8s %8s %8s\n' program result vm O0 O3
+for f in bench/*.tc; do
+    name=$(basename "$f" .tc)
+    vm=$(ms "$PARSER" --run < "$f")
+    expect=$(cat "$TMP/out")
+    "$PARSER" --emit-llvm < "$f" > "$TMP/$name.ll" || { status=1; continue; }
+    line=$(printf '%-20s %-12s %6sms' "$name" "$expect" "$vm")
+    for level in 0 3; do
+        build "$TMP/$name.ll" $level "$TMP/$name-O$level" || { status=1; continue; }
+        t=$(ms "$TMP/$name-O$level")
+        [ "$(cat "$TMP/out")" = "$expect" ] || { echo "$name: -O$level gives $(cat "$TMP/out")"; status=1; }
+        line="$line $(printf '%6sms' "$t")"
+    done
+    echo "$line"
+done
+exit $status
@@ -0,0 +1,39 @@
+#!/bin/sh
+# Runs every bench program in the built-in RV32IM simulator under each cost
+# model and instruction schedule, checking output and exit status against
+# the interpreter, and prints the simulated instruction count (unscheduled)
+# and the cycle totals per schedule.
+# Usage: bench/riscv.sh [PARSER]
+PARSER=${1:-./parser}
+MODELS=${MODELS:-"ideal inorder embedded"}
+SCHEDULES=${SCHEDULES:-"none pre post"}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+status=0
+printf '%-12s %-10s %12s' program model insns
+for s in $SCHEDULES; do printf ' %12s' "$s"; done
+echo
+for f in bench/*.tc; do
+    name=$(basename "$f" .tc)
+    expect=$("$PARSER" --run < "$f" 2> /dev/null)
+    expectStatus=$?
+    for m in $MODELS; do
+        row=
+        insns=
+        for s in $SCHEDULES; do
+            got=$("$PARSER" --sim-riscv --rv-model "$m" --schedule "$s" < "$f" 2> "$TMP/report")
+            gotStatus=$?
+            if [ "$got" != "$expect" ] || [ $gotStatus -ne $expectStatus ]; then
+                echo "$name: $m/$s expected $expect ($expectStatus), got $got ($gotStatus)"
+                status=1
+                continue
+            fi
+            set -- $(grep '^total' "$TMP/report")
+            [ -n "$insns" ] || insns=$2
+            row="$row$(printf ' %12s' "$3")"
+        done
+        printf '%-12s %-10s %12s%s\n' "$name" "$m" "$insns" "$row"
+    done
+done
+exit $status